@@ -0,0 +1,144 @@
+#!/bin/bash
+# End-to-end run of every mode against the fake procfs/sysfs tree (see fan_fixture in README.md).
+# No hardware, no root. A mode fails if the fixture got a command the kernel would refuse, if a level
+# the daemon set never reached the fan, or if the fan wasn't handed back to auto (with the watchdog off) on exit.
+# As root, the uevents (trip points, AC adapter) are sent too, and the GUI's fan helper is put through a crash.
+# Usage: ./fixture-test.sh [real seconds per mode (default 15)] [fixture speed factor (default 30)]
+RUN_FOR=${1:-15}
+SPEED=${2:-30}
+BIN=build
+failed=0
+
+make fan_controld fan_fixture fan_log > /dev/null || exit 1
+work=$(mktemp -d /tmp/fan_e2e.XXXXXX) || exit 1
+trap 'rm -rf "${work}"' EXIT
+
+# run_mode <name> <daemon options...>
+# FIX_OPTS are extra options for the fixture, CTL runs instead of the daemon (with the same options)
+run_mode() {
+    local name=$1 dir="${work}/$1" fix_log="${work}/$1.fixture" ctl_log="${work}/$1.daemon"
+    local fix_pid status want got cmds last level ok=1
+    shift
+    mkdir -p "${dir}"
+    "${BIN}/fan_fixture" -d "${dir}" -x "${SPEED}" ${FIX_OPTS} > "${fix_log}" 2>&1 &
+    fix_pid=$!
+    # the tree is there once it says where it is
+    while [ ! -s "${fix_log}" ]; do
+        sleep 0.1
+    done
+    timeout -s INT "${RUN_FOR}" ${CTL:-"${BIN}/fan_controld"} -r "${dir}" -i 1 -v "$@" > "${ctl_log}" 2>&1
+    # the daemon puts the fan back on auto on its way out, give the fixture a moment to see it
+    sleep 0.5
+    kill -INT "${fix_pid}"
+    wait "${fix_pid}"
+    status=$?
+
+    # every level the daemon ran the fan at (auto it starts on, without writing it), and what the fan was left on after each command
+    want=$(sed -n 's/.*Fan level \([^ ,]*\).*/\1/p' "${ctl_log}" | tr 'A-Z' 'a-z' | grep -vx auto | sort -u)
+    got=$(sed -n 's/.*) \([^:]*\): ".*/\1/p' "${fix_log}")
+    cmds=$(sed -n 's/.*) [^:]*: "\(.*\)"$/\1/p' "${fix_log}")
+    if [ "${status}" -ne 0 ]; then
+        echo "${name}: the fixture got commands the kernel would refuse:"
+        grep INVALID "${fix_log}"
+        ok=0
+    fi
+    if [ -z "${want}" ]; then
+        echo "${name}: the fan was never taken off auto"
+        ok=0
+    fi
+    for level in ${want}; do
+        if ! echo "${got}" | grep -qx -- "${level}"; then
+            echo "${name}: the daemon set level ${level}, the fan never got it"
+            ok=0
+        fi
+    done
+    last=$(echo "${got}" | tail -n 1)
+    if [ "${last}" != "auto" ]; then
+        echo "${name}: the fan was left on ${last:-whatever it was}, not auto"
+        ok=0
+    fi
+    # and through whichever interface it was driven: the last word on the level was auto, and the watchdog is off
+    for last in "$(echo "${cmds}" | grep '^level ' | tail -n 1):level auto" "$(echo "${cmds}" | grep '^pwm1_enable ' | tail -n 1):pwm1_enable 2" \
+                "$(echo "${cmds}" | grep '^watchdog ' | tail -n 1):watchdog 0"; do
+        if [ -n "${last%%:*}" ] && [ "${last%%:*}" != "${last#*:}" ]; then
+            echo "${name}: the last command of its kind was \`${last%%:*}', not \`${last#*:}'"
+            ok=0
+        fi
+    done
+    # the reaction time is in the fixture's log, for every command
+    if [ "${ok}" -eq 1 ]; then
+        echo "${name}: ok, levels" ${want}", $(tail -n 1 "${fix_log}")"
+    else
+        echo "${name}: FAILED, logs:"
+        cat "${ctl_log}" "${fix_log}"
+        failed=1
+    fi
+}
+
+run_mode auto -M auto
+run_mode manual -M manual
+run_mode curve -M curve
+run_mode pid -M pid
+run_mode pwm -M curve -p /sys/class/hwmon/hwmon0/pwm1
+run_mode gate -M curve -g 10:1 -t max:ema:3:250
+run_mode trips -M curve -e
+# as root, the fixture sends the uevents the kernel would, those have to have woken the daemon up
+if ! grep -q "won't notice" "${work}/trips.fixture" && grep -q "triggers 0 times" "${work}/trips.daemon"; then
+    echo "trips: the fixture's trip points were crossed, the daemon never woke up on them"
+    failed=1
+fi
+run_mode filter -M curve -t "mean:median:3:250:thinkpad0*2+coretemp/Package id 0"
+run_mode feedforward -M curve -F 50:90:10:25:3
+if grep -q "Unable to read the CPU load" "${work}/feedforward.daemon"; then
+    echo "feedforward: the fixture's /proc/stat and RAPL counter weren't read"
+    failed=1
+fi
+FIX_OPTS="-A 60" run_mode battery -M curve -b "scan=2;points=45:1,70:4,80:8"
+if ! grep -q "won't notice" "${work}/battery.fixture" && grep -q "changed 0 times" "${work}/battery.daemon"; then
+    echo "battery: the fixture pulled the AC adapter, the daemon never switched profiles"
+    failed=1
+fi
+# a second fan on the hwmon channel, the fixture has the one fan behind both interfaces
+run_mode fans -M curve -f "/sys/class/hwmon/hwmon0/pwm1:coretemp/Package id 0:40:1,60:4,75:8"
+# ask for the state halfway through, if there's something to talk to a Unix socket with
+if command -v python3 > /dev/null; then
+    (sleep $((RUN_FOR / 2)); python3 -c 'import socket, sys
+s = socket.socket(socket.AF_UNIX); s.connect(sys.argv[1]); s.sendall(b"state\n"); print(s.makefile().readline().strip())' \
+        "${work}/api.sock" > "${work}/api.reply" 2>&1) &
+fi
+run_mode api -M curve -u "${work}/api.sock" -L "${work}/telemetry.bin"
+wait
+if [ -e "${work}/api.reply" ] && ! grep -q "^state seq=" "${work}/api.reply"; then
+    echo "api: asked for the state, got: $(cat "${work}/api.reply")"
+    failed=1
+fi
+if ! "${BIN}/fan_log" -s "${work}/telemetry.bin" 2> /dev/null | grep -q "^Records: *[1-9]"; then
+    echo "api: nothing in the telemetry log"
+    failed=1
+fi
+# the GUI's fan helper (sandboxed, so root only): a level, a watchdog, and the GUI goes away without a word
+if [ "$(id -u)" -eq 0 ]; then
+    cc -Wall -Isrc -o "${work}/helper_crash" -x c - src/helper.c src/fan.c src/trip.c <<'END' || exit 1
+#include <stdio.h>
+#include <unistd.h>
+#include "helper.h"
+int main(int argc, char **argv) {
+    fan_actuator fan, *fans[1] = { &fan };
+    fan_helper helper;
+    if (argc < 3 || fan_open(&fan, argv[2], NULL, 0) != 0 || helper_start(&helper, fans, 1, NULL) != 0) {
+        return 1;
+    }
+    if (fan_set_level(&fan, 5) == 0 && fan_set_watchdog(&fan, 120) == 0) {
+        printf("Fan level 5\n");
+    }
+    fflush(stdout);
+    sleep(1);
+    // no HELPER_EXIT, the helper just sees the socket close, like it would after a crash
+    _exit(1);
+}
+END
+    CTL="${work}/helper_crash" run_mode helper
+else
+    echo "helper: skipped, the helper has to start as root"
+fi
+exit ${failed}
@@ -0,0 +1,342 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Control and telemetry API, see api.h. The protocol, one line each way:
+
+  state                 state seq=.. ms=.. mode=curve temp=52 level=3 rpm=2900 power=ac fans=2@61 temps=52,48,-,..
+  sensors               sensors thinkpad0,thinkpad1,..,coretemp/Package id 0
+  subscribe             ok, then a state line after every tick
+  unsubscribe           ok
+  auto [safe:crit:level[:scan]]
+  manual <level>[:scan]
+  curve [safe:safe_level:delta:step:crit:crit_level:throttle%]
+  points <temp:level,..>
+  pid [target:kp:ki:kd:min_level:max_level:dwell]
+  stop                  back to auto, and stop controlling the fan
+
+Anything that doesn't work out is answered with "err <why>".
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "api.h"
+
+#define API_OUT_MAX 512
+// epoll data for the listening socket, clients are their slot
+#define API_LISTEN_ID API_CLIENTS_MAX
+
+static int unix_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path) >= (int) sizeof(addr->sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+// a socket file nobody answers on is left over from a crash, one that answers is someone else's
+static int stale_socket(const struct sockaddr_un *addr) {
+    int ret, fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    ret = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0 ? -EADDRINUSE : 0;
+    close(fd);
+    if (ret == 0 && unlink(addr->sun_path) != 0 && errno != ENOENT) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+int api_open(api_server *api, const char *path) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = API_LISTEN_ID };
+    struct sockaddr_un addr;
+    int i, ret;
+    memset(api, 0, sizeof(*api));
+    api->epoll_fd = api->listen_fd = -1;
+    for (i = 0; i < API_CLIENTS_MAX; i++) {
+        api->clients[i].fd = -1;
+    }
+    if ((ret = unix_addr(&addr, path != NULL ? path : API_SOCKET_PATH)) != 0 || (ret = stale_socket(&addr)) != 0) {
+        return ret;
+    }
+    if ((api->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0
+        || bind(api->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        ret = -errno;
+        api_close(api);
+        return ret;
+    }
+    snprintf(api->path, sizeof(api->path), "%s", addr.sun_path);
+    // it can switch the fan off, not for everyone. chgrp the socket to let a group in
+    if (chmod(api->path, 0660) != 0 || listen(api->listen_fd, API_CLIENTS_MAX) != 0
+        || (api->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 || epoll_ctl(api->epoll_fd, EPOLL_CTL_ADD, api->listen_fd, &ev) != 0) {
+        ret = -errno;
+        api_close(api);
+        return ret;
+    }
+    return 0;
+}
+
+static void drop_client(api_server *api, api_client *client) {
+    // closing it takes it out of the epoll set as well
+    close(client->fd);
+    client->fd = -1;
+    client->subscribed = client->skip = false;
+    client->len = 0;
+}
+
+void api_close(api_server *api) {
+    int i;
+    for (i = 0; i < API_CLIENTS_MAX; i++) {
+        if (api->clients[i].fd >= 0) {
+            drop_client(api, &api->clients[i]);
+        }
+    }
+    if (api->listen_fd >= 0) {
+        close(api->listen_fd);
+    }
+    if (api->epoll_fd >= 0) {
+        close(api->epoll_fd);
+    }
+    if (api->path[0] != '\0') {
+        unlink(api->path);
+    }
+    api->listen_fd = api->epoll_fd = -1;
+    api->path[0] = '\0';
+}
+
+// never blocks: a client that doesn't read its answers loses them, rather than stalling the loop
+static bool send_line(api_client *client, const char *buf, int len) {
+    return send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) == len;
+}
+
+static void reply(api_client *client, const char *fmt, const char *arg) {
+    char buf[API_OUT_MAX];
+    int len = snprintf(buf, sizeof(buf), fmt, arg);
+    if (len >= (int) sizeof(buf)) {
+        len = sizeof(buf) - 1;
+        buf[len - 1] = '\n';
+    }
+    send_line(client, buf, len);
+}
+
+static int format_state(const api_view *view, char *buf, size_t size) {
+    const ctrl_state *state = view->state;
+    const ctrl_result *res = &state->res;
+    const sensor_sample *sample = view->sample;
+    int len, i;
+    len = snprintf(buf, size, "state seq=%lu ms=%lld mode=%s temp=%d level=%d rpm=%d power=%s fans=", state->seq, state->ms,
+                   ctrl_mode_name(state->mode), res->temp, res->level, res->rpm, state->power < 0 ? "-" : power_name(state->power));
+    for (i = 0; i < state->n_fans && len < (int) size; i++) {
+        len += snprintf(buf + len, size - len, "%s%d@%d", i > 0 ? "," : "", state->fan_levels[i], state->fan_temps[i]);
+    }
+    if (len < (int) size) {
+        len += snprintf(buf + len, size - len, " temps=");
+    }
+    for (i = 0; i < sample->count && len < (int) size; i++) {
+        if (sample->temps[i] == SENSOR_INVALID) {
+            len += snprintf(buf + len, size - len, "%s-", i > 0 ? "," : "");
+        } else {
+            len += snprintf(buf + len, size - len, "%s%d", i > 0 ? "," : "", SENSOR_C(sample->temps[i]));
+        }
+    }
+    if (len >= (int) size - 1) {
+        len = size - 2;
+    }
+    buf[len++] = '\n';
+    buf[len] = '\0';
+    return len;
+}
+
+static void reply_sensors(api_client *client, const sensor_set *sensors) {
+    char buf[API_OUT_MAX];
+    int len = snprintf(buf, sizeof(buf), "sensors "), i;
+    for (i = 0; i < sensors->n_temps && len < (int) sizeof(buf); i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s", i > 0 ? "," : "", sensors->names[i]);
+    }
+    if (len >= (int) sizeof(buf) - 1) {
+        len = sizeof(buf) - 2;
+    }
+    buf[len++] = '\n';
+    send_line(client, buf, len);
+}
+
+// the config for mode, from whatever came after the command. Returns NULL or what's wrong with it
+static const char *parse_mode(fan_ctrl *config, ctrl_mode mode, const char *cmd, const char *arg) {
+    auto_config *a = &config->auto_cfg;
+    manual_config *m = &config->manual_cfg;
+    curve_config *c = &config->curve_cfg;
+    switch (mode) {
+        case CTRL_AUTO:
+            if (arg != NULL && sscanf(arg, "%d:%d:%d:%d", &a->temp_safe, &a->temp_crit, &a->fan_speed, &a->scan_interval) < 3) {
+                return "expected safe:crit:level[:scan]";
+            }
+            break;
+        case CTRL_MANUAL:
+            if (arg == NULL || sscanf(arg, "%d:%d", &m->fan_speed, &m->scan_interval) < 1) {
+                return "expected level[:scan]";
+            }
+            break;
+        case CTRL_PID:
+            if (arg != NULL && ctrl_parse_pid(arg, &config->pid_cfg) != 0) {
+                return "expected target:kp:ki:kd:min_level:max_level:dwell";
+            }
+            break;
+        default:
+            if (strcmp(cmd, "points") == 0) {
+                if (arg == NULL || (c->n_points = curve_parse_points(arg, c->points, CURVE_POINTS_MAX)) < 1) {
+                    return "expected temp:level points";
+                }
+            } else if (arg != NULL) {
+                if (ctrl_parse_curve(arg, c) != 0) {
+                    return "expected safe:safe_level:delta:step:crit:crit_level:throttle%";
+                }
+                // a linear curve replaces any points
+                c->n_points = 0;
+            }
+            break;
+    }
+    return ctrl_compile(config, mode);
+}
+
+static void handle_line(api_server *api, api_client *client, char *line, const api_view *view, fan_ctrl *config, api_mode_func func, void *data) {
+    char buf[API_OUT_MAX], *arg = strchr(line, ' ');
+    auto_config a = config->auto_cfg;
+    manual_config m = config->manual_cfg;
+    curve_config c = config->curve_cfg;
+    pid_config p = config->pid_cfg;
+    const char *err;
+    ctrl_mode mode;
+    bool is_mode;
+    if (arg != NULL) {
+        *arg++ = '\0';
+    }
+    api->requests++;
+    // points is the curve as well, just not a linear one
+    if ((is_mode = strcmp(line, "points") == 0)) {
+        mode = CTRL_CURVE;
+    } else {
+        is_mode = ctrl_parse_mode(line, &mode) == 0;
+    }
+    if (strcmp(line, "state") == 0) {
+        send_line(client, buf, format_state(view, buf, sizeof(buf)));
+    } else if (strcmp(line, "sensors") == 0) {
+        reply_sensors(client, view->sensors);
+    } else if (strcmp(line, "subscribe") == 0 || strcmp(line, "unsubscribe") == 0) {
+        client->subscribed = line[0] == 's';
+        reply(client, "ok\n", NULL);
+    } else if (strcmp(line, "stop") == 0) {
+        func(data, CTRL_AUTO, false);
+        reply(client, "ok\n", NULL);
+    } else if (is_mode) {
+        if ((err = parse_mode(config, mode, line, arg)) != NULL) {
+            // leave the config as it was, the compiled tables are only replaced if they're OK
+            config->auto_cfg = a;
+            config->manual_cfg = m;
+            config->curve_cfg = c;
+            config->pid_cfg = p;
+            reply(client, "err %s\n", err);
+            return;
+        }
+        func(data, mode, true);
+        reply(client, "ok\n", NULL);
+    } else {
+        reply(client, "err unknown command `%s'\n", line);
+    }
+}
+
+static void read_client(api_server *api, api_client *client, const api_view *view, fan_ctrl *config, api_mode_func func, void *data) {
+    char *nl, *start;
+    ssize_t n;
+    while ((n = recv(client->fd, client->buf + client->len, sizeof(client->buf) - 1 - client->len, MSG_DONTWAIT)) > 0) {
+        client->len += n;
+        client->buf[client->len] = '\0';
+        start = client->buf;
+        while ((nl = strchr(start, '\n')) != NULL) {
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+            if (client->skip) {
+                client->skip = false;
+            } else {
+                handle_line(api, client, start, view, config, func, data);
+            }
+            start = nl + 1;
+        }
+        client->len -= start - client->buf;
+        memmove(client->buf, start, client->len);
+        if (client->len == sizeof(client->buf) - 1) {
+            if (!client->skip)
+                reply(client, "err line too long\n", NULL);
+            client->len = 0;
+            client->skip = true;
+        }
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        drop_client(api, client);
+    }
+}
+
+static void accept_clients(api_server *api) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    int fd, i;
+    while ((fd = accept4(api->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (i = 0; i < API_CLIENTS_MAX && api->clients[i].fd >= 0; i++) {
+        }
+        if (i == API_CLIENTS_MAX) {
+            send(fd, "err too many clients\n", 21, MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(fd);
+            continue;
+        }
+        ev.data.u32 = i;
+        if (epoll_ctl(api->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            continue;
+        }
+        api->clients[i].fd = fd;
+        api->clients[i].len = 0;
+        api->clients[i].subscribed = api->clients[i].skip = false;
+    }
+}
+
+void api_check(api_server *api, const api_view *view, fan_ctrl *config, api_mode_func func, void *data) {
+    struct epoll_event evs[API_CLIENTS_MAX + 1];
+    int n, i;
+    // level triggered, with a zero timeout: whatever we don't get to now, we get to next time
+    n = epoll_wait(api->epoll_fd, evs, API_CLIENTS_MAX + 1, 0);
+    for (i = 0; i < n; i++) {
+        if (evs[i].data.u32 == API_LISTEN_ID) {
+            accept_clients(api);
+        } else if (api->clients[evs[i].data.u32].fd >= 0) {
+            read_client(api, &api->clients[evs[i].data.u32], view, config, func, data);
+        }
+    }
+}
+
+void api_publish(api_server *api, const api_view *view) {
+    char buf[API_OUT_MAX];
+    int i, len = 0;
+    for (i = 0; i < API_CLIENTS_MAX; i++) {
+        api_client *client = &api->clients[i];
+        if (client->fd < 0 || !client->subscribed) {
+            continue;
+        }
+        // only formatted if anyone is listening
+        if (len == 0) {
+            len = format_state(view, buf, sizeof(buf));
+        }
+        if (!send_line(client, buf, len)) {
+            api->dropped++;
+        }
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Control and telemetry API: a Unix socket, one command per line, one line per answer. Scripts can
+read the state, switch modes, and subscribe to a line per tick, without going near the GUI.
+Everything is answered from what the controller last published: no sensor reads, no waiting on the
+control loop. The listening socket and all clients sit behind a single epoll descriptor, so a front
+end only ever has the one fd to watch, however many clients there are.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef API_H
+#define API_H
+
+#include <stdbool.h>
+#include "core.h"
+
+#define API_SOCKET_PATH "/run/fan_control.sock"
+#define API_CLIENTS_MAX 16
+#define API_LINE_MAX 256
+
+typedef struct _api_client {
+    int fd;          // -1 for a free slot
+    bool subscribed; // gets a state line after every tick
+    char buf[API_LINE_MAX];
+    int len;         // of the line we've read so far
+    bool skip;       // the line was too long, drop what's left of it
+} api_client;
+
+typedef struct _api_server {
+    int epoll_fd;    // the one the front end waits on
+    int listen_fd;
+    char path[108];  // sun_path, unlinked on close
+    api_client clients[API_CLIENTS_MAX];
+    unsigned long requests, dropped; // commands handled, state lines a subscriber couldn't keep up with
+} api_server;
+
+// what the answers are made of: the controller's last state, and the sample that goes with it
+typedef struct _api_view {
+    const ctrl_state *state;
+    const sensor_sample *sample;
+    const sensor_set *sensors; // only the names, they never change once discovered
+} api_view;
+
+// a command parsed and compiled a config into the front end's config controller, now run it
+// running is false to stop controlling the fan altogether
+typedef void (*api_mode_func)(void *data, ctrl_mode mode, bool running);
+
+// listen on path (NULL for the default), returns 0 or -errno (-EADDRINUSE if someone else is serving it)
+int api_open(api_server *api, const char *path);
+void api_close(api_server *api);
+// once the epoll fd is readable: take new clients, read their commands, answer them
+// mode commands go into config (never the one running the fan), and func is called if they're OK
+void api_check(api_server *api, const api_view *view, fan_ctrl *config, api_mode_func func, void *data);
+// a state line to every subscriber, those that can't keep up miss it
+void api_publish(api_server *api, const api_view *view);
+
+#endif
@@ -0,0 +1,903 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+The control core, shared by the GUI and the daemon.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "core.h"
+
+const char *fan_speeds[] = {
+    "Auto",
+    "1",
+    "2",
+    "3",
+    "4",
+    "5",
+    "6",
+    "7",
+    "Full-Speed",
+};
+
+static const char *mode_names[] = {
+    "auto",
+    "manual",
+    "curve",
+    "pid",
+};
+
+static const char *event_names[] = {
+    "steady",
+    "up",
+    "down",
+    "crit_enter",
+    "crit_leave",
+    "safe",
+    "crit",
+    "stalled",
+    "mismatch",
+};
+
+void ctrl_init(fan_ctrl *ctrl, fan_actuator *fan, sensor_set *sensors) {
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->fan = fan;
+    ctrl->sensors = sensors;
+    ctrl->mode = CTRL_AUTO;
+    // assume auto -> this is most likely the value on startup
+    ctrl->level = FAN_LVL_AUTO;
+    ctrl->state.power = -1;
+    sched_init(&ctrl->sched, 0);
+    // lets everything through, but still counts the writes
+    gate_init(&ctrl->gate);
+    // the primary sensor as it is, until told otherwise
+    ctrl->filter_cfg = (filter_config) { .fuse = FILTER_MAX, .smooth = FILTER_NONE, .window = 1, .sample_ms = 0 };
+    filter_init(&ctrl->filter);
+    if (sensors != NULL && sensors->primary >= 0) {
+        filter_add_sensor(&ctrl->filter, sensors->primary, 1);
+    }
+}
+
+const char *ctrl_mode_name(ctrl_mode mode) {
+    return mode_names[mode];
+}
+
+const char *ctrl_event_name(ctrl_event event) {
+    return event_names[event];
+}
+
+int ctrl_parse_mode(const char *name, ctrl_mode *mode) {
+    ctrl_mode m;
+    for (m = CTRL_AUTO; m <= CTRL_PID; m++) {
+        if (strcmp(name, mode_names[m]) == 0) {
+            *mode = m;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int ctrl_parse_curve(const char *arg, curve_config *curve) {
+    int throttle;
+    if (sscanf(arg, "%d:%d:%d:%d:%d:%d:%d", &curve->safe_temp, &curve->safe_speed, &curve->delta_temp,
+               &curve->step, &curve->crit_temp, &curve->crit_speed, &throttle) != 7) {
+        return -1;
+    }
+    curve->throttle_factor = (double) throttle / 100;
+    return 0;
+}
+
+int ctrl_parse_load(const char *arg, load_config *load) {
+    if (sscanf(arg, "%d:%d:%d:%d:%d", &load->util_start, &load->util_full, &load->watts_start,
+               &load->watts_full, &load->max_boost) != 5) {
+        return -1;
+    }
+    return 0;
+}
+
+int ctrl_parse_filter(const char *arg, filter_config *cfg, char *sensors, size_t len) {
+    char fuse[8], smooth[8];
+    int n = 0;
+    if (sscanf(arg, "%7[a-z]:%7[a-z]:%d:%d%n", fuse, smooth, &cfg->window, &cfg->sample_ms, &n) != 4 || (arg[n] != '\0' && arg[n] != ':')) {
+        return -1;
+    }
+    if (strcmp(fuse, "max") == 0) {
+        cfg->fuse = FILTER_MAX;
+    } else if (strcmp(fuse, "mean") == 0) {
+        cfg->fuse = FILTER_MEAN;
+    } else {
+        return -1;
+    }
+    if (strcmp(smooth, "none") == 0) {
+        cfg->smooth = FILTER_NONE;
+    } else if (strcmp(smooth, "ema") == 0) {
+        cfg->smooth = FILTER_EMA;
+    } else if (strcmp(smooth, "median") == 0) {
+        cfg->smooth = FILTER_MEDIAN;
+    } else {
+        return -1;
+    }
+    if (arg[n] == '\0') {
+        sensors[0] = '\0';
+        return 0;
+    }
+    return snprintf(sensors, len, "%s", arg + n + 1) < (int) len ? 0 : -1;
+}
+
+int ctrl_parse_gate(const char *arg, gate_config *cfg) {
+    int n = 0;
+    if (sscanf(arg, "%d:%d%n", &cfg->dwell, &cfg->max_step, &n) != 2 || arg[n] != '\0') {
+        return -1;
+    }
+    return 0;
+}
+
+int ctrl_parse_telemetry(const char *arg, telemetry_config *cfg) {
+    const char *colon = strchr(arg, ':');
+    int len = colon != NULL ? (int) (colon - arg) : (int) strlen(arg), n = 0;
+    if (len < 1 || len >= (int) sizeof(cfg->path)) {
+        return -1;
+    }
+    snprintf(cfg->path, sizeof(cfg->path), "%.*s", len, arg);
+    if (colon == NULL) {
+        return 0;
+    }
+    // as many of them as are given
+    if (sscanf(colon, ":%d%n:%d%n:%d%n:%d%n", &cfg->max_mb, &n, &cfg->files, &n, &cfg->batch, &n, &cfg->flush_s, &n) < 1 || colon[n] != '\0') {
+        return -1;
+    }
+    return 0;
+}
+
+int ctrl_parse_pid(const char *arg, pid_config *pid) {
+    if (sscanf(arg, "%d:%lf:%lf:%lf:%d:%d:%d", &pid->target, &pid->kp, &pid->ki, &pid->kd,
+               &pid->min_level, &pid->max_level, &pid->dwell) != 7) {
+        return -1;
+    }
+    return 0;
+}
+
+int ctrl_parse_profile(const char *arg, ctrl_profile *profile) {
+    char buf[512], *key, *val, *save = NULL;
+    int n;
+    if (snprintf(buf, sizeof(buf), "%s", arg) >= (int) sizeof(buf)) {
+        return -1;
+    }
+    for (key = strtok_r(buf, ";", &save); key != NULL; key = strtok_r(NULL, ";", &save)) {
+        if ((val = strchr(key, '=')) == NULL) {
+            return -1;
+        }
+        *val++ = '\0';
+        if (strcmp(key, "scan") == 0) {
+            n = atoi(val);
+            profile->auto_cfg.scan_interval = profile->manual_cfg.scan_interval = profile->curve_cfg.scan = profile->pid_cfg.scan = n;
+        } else if (strcmp(key, "adaptive") == 0) {
+            profile->adaptive_ms = atoi(val);
+        } else if (strcmp(key, "level") == 0) {
+            profile->auto_cfg.fan_speed = profile->manual_cfg.fan_speed = atoi(val);
+        } else if (strcmp(key, "safe") == 0) {
+            profile->auto_cfg.temp_safe = atoi(val);
+        } else if (strcmp(key, "crit") == 0) {
+            profile->auto_cfg.temp_crit = atoi(val);
+        } else if (strcmp(key, "curve") == 0) {
+            // a linear curve of its own, not the points of the AC one
+            if (ctrl_parse_curve(val, &profile->curve_cfg) != 0) {
+                return -1;
+            }
+            profile->curve_cfg.n_points = 0;
+        } else if (strcmp(key, "points") == 0) {
+            if ((profile->curve_cfg.n_points = curve_parse_points(val, profile->curve_cfg.points, CURVE_POINTS_MAX)) < 1) {
+                return -1;
+            }
+        } else if (strcmp(key, "pid") == 0) {
+            // the scan interval isn't part of what -D sets
+            n = profile->pid_cfg.scan;
+            if (ctrl_parse_pid(val, &profile->pid_cfg) != 0) {
+                return -1;
+            }
+            profile->pid_cfg.scan = n;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ctrl_parse_fan(const char *arg, fan_spec *spec) {
+    const char *sensor = strchr(arg, ':'), *points;
+    if (sensor == NULL || (points = strchr(sensor + 1, ':')) == NULL) {
+        return -1;
+    }
+    if (sensor - arg >= (int) sizeof(spec->pwm_path) || points - sensor - 1 >= (int) sizeof(spec->sensors)) {
+        return -1;
+    }
+    snprintf(spec->pwm_path, sizeof(spec->pwm_path), "%.*s", (int) (sensor - arg), arg);
+    snprintf(spec->sensors, sizeof(spec->sensors), "%.*s", (int) (points - sensor - 1), sensor + 1);
+    spec->n_points = curve_parse_points(points + 1, spec->points, CURVE_POINTS_MAX);
+    return spec->n_points < 1 ? -1 : 0;
+}
+
+// any fan write goes through here, so they're all timed and counted
+static int write_level(fan_ctrl *ctrl, fan_actuator *fan, int level) {
+    fan_stats *stats = ctrl->stats;
+    unsigned long long start = stats != NULL ? stats_now_ns() : 0;
+    int ret = fan_set_level(fan, level);
+    if (stats != NULL) {
+        unsigned long long ns = stats_now_ns() - start;
+        stats_record(stats, STATS_WRITE, ns);
+        stats->write_ns += ns;
+        if (ret != 0) {
+            stats->write_failures++;
+        } else {
+            stats->level_changes++;
+        }
+    }
+    return ret;
+}
+
+int ctrl_set_level(fan_ctrl *ctrl, int level) {
+    int ret = write_level(ctrl, ctrl->fan, level);
+    if (ret != 0) {
+        // always report this, not just when print_logs is set: the fan is not doing what we think it's doing
+        fprintf(stderr, "Failed to set fan speed to %s using %s backend: %s\n", fan_speeds[level], ctrl->fan->ops->name, strerror(-ret));
+        return ret;
+    }
+    ctrl->level = level;
+    ctrl->watchdog_fed = true;
+    if (ctrl->rpm != NULL) {
+        rpm_commanded(ctrl->rpm, level, sched_now_ms());
+    }
+    if (ctrl->print_logs)
+        printf("Fan speed set to %s (%s mode)\n", fan_speeds[level], mode_names[ctrl->mode]);
+    return 0;
+}
+
+void ctrl_gate_dump(const fan_ctrl *ctrl, FILE *out) {
+    ctrl_mode m;
+    for (m = CTRL_AUTO; m <= CTRL_PID; m++) {
+        if (ctrl->gate.writes[m] == 0 && ctrl->gate.held[m] == 0) {
+            continue;
+        }
+        fprintf(out, "Fan commands (%s): %lu written, %lu held back\n", mode_names[m], ctrl->gate.writes[m], ctrl->gate.held[m]);
+    }
+}
+
+// the fan speed we read before deciding, against the last level we set
+static void check_rpm(fan_ctrl *ctrl, ctrl_result *res, long long now_ms) {
+    switch (rpm_update(ctrl->rpm, res->rpm, now_ms)) {
+        case RPM_RETRY:
+            if (ctrl->print_logs)
+                printf("Fan at %d RPM, writing level %s again\n", res->rpm, fan_speeds[ctrl->level]);
+            res->error = ctrl_set_level(ctrl, ctrl->level);
+            break;
+        case RPM_STALLED:
+            // always report these, like failed writes
+            fprintf(stderr, "Fan stalled: %d RPM at level %s\n", res->rpm, fan_speeds[ctrl->level]);
+            res->event = CTRL_FAN_STALLED;
+            break;
+        case RPM_MISMATCH:
+            fprintf(stderr, "Fan at %d RPM at level %s, it used to be %d\n", res->rpm, fan_speeds[ctrl->level], ctrl->rpm->map.rpm[ctrl->level]);
+            res->event = CTRL_FAN_MISMATCH;
+            break;
+        default:
+            break;
+    }
+}
+
+int ctrl_start(fan_ctrl *ctrl, ctrl_mode mode) {
+    ctrl->mode = mode;
+    ctrl->was_crit = 0;
+    // whatever the last mode held back is of no use to this one, and its first decision goes out as it is
+    gate_reset(&ctrl->gate);
+    switch (mode) {
+        case CTRL_MANUAL:
+            if (ctrl->level != ctrl->manual_cfg.fan_speed) {
+                return ctrl_set_level(ctrl, ctrl->manual_cfg.fan_speed);
+            }
+            break;
+        case CTRL_AUTO:
+            // auto mode only takes over when critical, until then the EC is in charge
+            if (ctrl->level != FAN_LVL_AUTO) {
+                return ctrl_set_level(ctrl, FAN_LVL_AUTO);
+            }
+            break;
+        case CTRL_PID:
+            // start from scratch, the first tick sets the level
+            pid_reset(&ctrl->pid);
+            break;
+        default:
+            // the curve sets whatever level it needs on the first tick
+            ctrl->curve_level = ctrl->level;
+            ctrl->boost = 0;
+            break;
+    }
+    return 0;
+}
+
+// every tick tells the EC we're still here, should we die or hang, the fan goes back to auto on its own
+static void feed_watchdog(fan_ctrl *ctrl) {
+    fan_stats *stats = ctrl->stats;
+    unsigned long long start;
+    bool arm = ctrl->level != FAN_LVL_AUTO;
+    int ret;
+    bool fed = ctrl->watchdog_fed;
+    ctrl->watchdog_fed = false;
+    // while it's on auto, there's nothing to fall back to
+    if (!arm && !ctrl->watchdog_armed) {
+        return;
+    }
+    // thinkpad_acpi restarts the timer on every command, a level written this tick already did
+    if (arm && ctrl->watchdog_armed && fed) {
+        return;
+    }
+    start = stats != NULL ? stats_now_ns() : 0;
+    ret = fan_set_watchdog(ctrl->fan, arm ? ctrl->watchdog : 0);
+    if (stats != NULL) {
+        stats_record(stats, STATS_WRITE, stats_now_ns() - start);
+    }
+    if (ret != 0) {
+        if (ret != -EOPNOTSUPP)
+            fprintf(stderr, "Unable to arm the fan watchdog, not trying again: %s\n", strerror(-ret));
+        ctrl->watchdog = 0;
+        ctrl->watchdog_armed = false;
+        return;
+    }
+    ctrl->watchdog_armed = arm;
+}
+
+int ctrl_release(fan_ctrl *ctrl) {
+    int ret;
+    if (!ctrl->watchdog_armed) {
+        return 0;
+    }
+    if ((ret = fan_set_watchdog(ctrl->fan, 0)) != 0) {
+        return ret;
+    }
+    ctrl->watchdog_armed = false;
+    return 0;
+}
+
+int ctrl_stop(fan_ctrl *ctrl) {
+    int ret = 0, i, err;
+    ctrl->mode = CTRL_AUTO;
+    ctrl->was_crit = 0;
+    // whenever we start again, it's on fresh readings
+    filter_reset(&ctrl->filter);
+    for (i = 0; i < ctrl->n_fans; i++) {
+        fan_unit *unit = &ctrl->fans[i];
+        filter_reset(&unit->filter);
+        if (unit->level == FAN_LVL_AUTO) {
+            continue;
+        }
+        if ((err = write_level(ctrl, unit->fan, FAN_LVL_AUTO)) != 0) {
+            fprintf(stderr, "Failed to set fan %d back to auto using %s backend: %s\n", i + 2, unit->fan->ops->name, strerror(-err));
+            ret = err;
+        } else {
+            unit->level = FAN_LVL_AUTO;
+        }
+    }
+    if (ctrl->level != FAN_LVL_AUTO && (err = ctrl_set_level(ctrl, FAN_LVL_AUTO)) != 0) {
+        ret = err;
+    }
+    // so it doesn't put back auto on whoever sets a level after us
+    if (ret == 0 && ctrl->watchdog_armed) {
+        feed_watchdog(ctrl);
+    }
+    return ret;
+}
+
+const char *ctrl_add_fan(fan_ctrl *ctrl, fan_actuator *fan, const filter_channel *filter, const curve_point *points, int n) {
+    fan_unit *unit;
+    const char *err;
+    if (ctrl->n_fans >= CTRL_FANS_MAX) {
+        return "Too many fans";
+    }
+    if (filter->n_sensors < 1) {
+        return "No sensors to follow";
+    }
+    unit = &ctrl->fans[ctrl->n_fans];
+    if ((err = curve_compile(&unit->table, points, n, CTRL_FAN_HYSTERESIS)) != NULL) {
+        return err;
+    }
+    unit->fan = fan;
+    unit->filter = *filter;
+    filter_reset(&unit->filter);
+    // we don't know what it's doing, the first tick writes whatever level the curve says
+    unit->level = -1;
+    unit->temp = -1;
+    ctrl->n_fans++;
+    return NULL;
+}
+
+// the linear safe -> critical ramp as curve points: a step up every delta degrees above safe
+static int linear_points(const curve_config *c, curve_point *points) {
+    int n = 0, temp, level = c->safe_speed;
+    points[n++] = (curve_point) { .temp = 0, .level = c->safe_speed };
+    for (temp = c->safe_temp + 1; temp < c->crit_temp && level < c->crit_speed; temp += c->delta_temp) {
+        level += c->step;
+        // it's possible to hit full (or critical) speed before the critical temp, just stay there
+        if (level > c->crit_speed) {
+            level = c->crit_speed;
+        }
+        points[n++] = (curve_point) { .temp = temp, .level = level };
+    }
+    points[n++] = (curve_point) { .temp = c->crit_temp, .level = c->crit_speed };
+    return n;
+}
+
+static const char *compile_auto(const auto_config *a, fan_table *table) {
+    curve_point points[2];
+    if (a->temp_safe >= a->temp_crit) {
+        return "Safe temperature must be < critical temperature";
+    }
+    if (a->scan_interval < 1) {
+        return "Scan interval must be > 0";
+    }
+    // on auto until critical, the critical fan speed is kept until we're back at the safe temp
+    points[0] = (curve_point) { .temp = 0, .level = FAN_LVL_AUTO };
+    points[1] = (curve_point) { .temp = a->temp_crit, .level = a->fan_speed };
+    return curve_compile(table, points, 2, a->temp_crit - a->temp_safe - 1);
+}
+
+static const char *compile_curve(const curve_config *c, fan_table *table) {
+    curve_point linear[CURVE_POINTS_MAX];
+    // If the temperature drops below a certain threshold, we don't want to instantly throttle down
+    // we want to make sure we drop below said temp by a given factor
+    int f_step = (int) ((double) c->delta_temp * c->throttle_factor);
+    if (c->scan < 1) {
+        return "Scan interval must be > 0";
+    }
+    if (c->n_points > 0) {
+        return curve_compile(table, c->points, c->n_points, f_step);
+    }
+    if (c->delta_temp < 1 || c->step < 1) {
+        return "Temperature delta and fan speed step must be > 0";
+    }
+    if (c->safe_temp >= c->crit_temp || (c->safe_temp + c->delta_temp) >= c->crit_temp) {
+        return "Safe temperature must be < critical temperature - delta";
+    }
+    if (c->safe_speed > c->crit_speed) {
+        return "Safe fan speed must be <= critical fan speed";
+    }
+    return curve_compile(table, linear, linear_points(c, linear), f_step);
+}
+
+const char *ctrl_compile(fan_ctrl *ctrl, ctrl_mode mode) {
+    const manual_config *m = &ctrl->manual_cfg;
+    fan_table table;
+    const char *err;
+    switch (mode) {
+        case CTRL_AUTO:
+            if ((err = compile_auto(&ctrl->auto_cfg, &table)) == NULL) {
+                ctrl->auto_table = table;
+            }
+            return err;
+        case CTRL_CURVE:
+            if ((err = compile_curve(&ctrl->curve_cfg, &table)) == NULL) {
+                ctrl->curve_table = table;
+            }
+            return err;
+        case CTRL_PID:
+            // nothing to compile, the PID works it out as it goes
+            return pid_validate(&ctrl->pid_cfg);
+        default:
+            if (m->scan_interval < 1 || m->fan_speed < FAN_LVL_AUTO || m->fan_speed > FAN_LVL_FULL) {
+                return "Scan interval must be > 0, fan speed between 0 and 8";
+            }
+            return NULL;
+    }
+}
+
+int ctrl_scan_interval(const fan_ctrl *ctrl) {
+    switch (ctrl->mode) {
+        case CTRL_MANUAL:
+            return ctrl->manual_cfg.scan_interval;
+        case CTRL_CURVE:
+            return ctrl->curve_cfg.scan;
+        case CTRL_PID:
+            return ctrl->pid_cfg.scan;
+        default:
+            return ctrl->auto_cfg.scan_interval;
+    }
+}
+
+void ctrl_set_adaptive(fan_ctrl *ctrl, int min_ms) {
+    sched_init(&ctrl->sched, min_ms);
+    // what we go back to on AC, whatever the battery profile does
+    ctrl->profiles[POWER_AC].adaptive_ms = min_ms;
+}
+
+void ctrl_copy_config(fan_ctrl *to, const fan_ctrl *from) {
+    to->auto_cfg = from->auto_cfg;
+    to->manual_cfg = from->manual_cfg;
+    to->curve_cfg = from->curve_cfg;
+    to->pid_cfg = from->pid_cfg;
+    to->auto_table = from->auto_table;
+    to->curve_table = from->curve_table;
+}
+
+static void save_profile(const fan_ctrl *ctrl, ctrl_profile *profile) {
+    profile->auto_cfg = ctrl->auto_cfg;
+    profile->manual_cfg = ctrl->manual_cfg;
+    profile->curve_cfg = ctrl->curve_cfg;
+    profile->pid_cfg = ctrl->pid_cfg;
+    profile->auto_table = ctrl->auto_table;
+    profile->curve_table = ctrl->curve_table;
+}
+
+// all at once, between two ticks: a tick never sees half of one profile and half of the other
+static void load_profile(fan_ctrl *ctrl, const ctrl_profile *profile) {
+    ctrl->auto_cfg = profile->auto_cfg;
+    ctrl->manual_cfg = profile->manual_cfg;
+    ctrl->curve_cfg = profile->curve_cfg;
+    ctrl->pid_cfg = profile->pid_cfg;
+    ctrl->auto_table = profile->auto_table;
+    ctrl->curve_table = profile->curve_table;
+    // keep counting wakeups from the start, only the budget changes
+    ctrl->sched.min_ms = ctrl->sched.interval = profile->adaptive_ms;
+}
+
+const char *ctrl_set_profiles(fan_ctrl *ctrl, ctrl_mode mode) {
+    ctrl_profile *ac = &ctrl->profiles[POWER_AC], *bat = &ctrl->profiles[POWER_BATTERY];
+    const char *err = NULL;
+    fan_ctrl scratch;
+    ctrl_mode m;
+    if (ctrl->power == NULL) {
+        return NULL;
+    }
+    save_profile(ctrl, ac);
+    *bat = *ac;
+    if (ctrl->battery != NULL && ctrl_parse_profile(ctrl->battery, bat) != 0) {
+        err = "Invalid battery profile";
+        *bat = *ac;
+    } else if (ctrl->battery != NULL) {
+        // the widgets do the same: compile into a controller that never touches the hardware
+        ctrl_init(&scratch, NULL, NULL);
+        load_profile(&scratch, bat);
+        for (m = CTRL_AUTO; m <= CTRL_PID; m++) {
+            const char *mode_err = ctrl_compile(&scratch, m);
+            if (m == mode && mode_err != NULL) {
+                err = mode_err;
+            }
+        }
+        save_profile(&scratch, bat);
+        if (err != NULL) {
+            *bat = *ac;
+        }
+    }
+    load_profile(ctrl, &ctrl->profiles[ctrl->power->source]);
+    return err;
+}
+
+bool ctrl_power_check(fan_ctrl *ctrl, const struct pollfd *pfds) {
+    if (!power_check(ctrl->power, pfds)) {
+        return false;
+    }
+    load_profile(ctrl, &ctrl->profiles[ctrl->power->source]);
+    if (ctrl->print_logs)
+        printf("Running on %s now, switching profiles\n", power_name(ctrl->power->source));
+    return true;
+}
+
+static int next_interval(fan_ctrl *ctrl) {
+    int max_ms = ctrl_scan_interval(ctrl) * 1000;
+    // the triggers and the adaptive scheduler only watch the main sensor, the other fans need their checks
+    if (ctrl->n_fans > 0) {
+        return max_ms;
+    }
+    // only once an event has come in: whether the kernel tells anyone about a crossing is up to the
+    // governor, and a zone that never says a word would leave us checking once a minute
+    if (ctrl->trips != NULL && ctrl->trips->armed && ctrl->trips->crossings > 0) {
+        // just in case an event gets lost, or the sensor we watch drifts away from the one we act on
+        return max_ms > TRIP_BACKSTOP_MS ? max_ms : TRIP_BACKSTOP_MS;
+    }
+    // the PID is tuned for samples at a steady rate, and the load can go up at any time
+    if (ctrl->sched.min_ms <= 0 || ctrl->mode == CTRL_PID || (ctrl->mode == CTRL_CURVE && ctrl->load != NULL)) {
+        return max_ms;
+    }
+    switch (ctrl->mode) {
+        case CTRL_AUTO:
+            return sched_next(&ctrl->sched, &ctrl->auto_table, ctrl->level, max_ms);
+        case CTRL_CURVE:
+            return sched_next(&ctrl->sched, &ctrl->curve_table, ctrl->level, max_ms);
+        default:
+            // manual: no thresholds to watch, just back off to the scan interval
+            return sched_next(&ctrl->sched, NULL, ctrl->level, max_ms);
+    }
+}
+
+int ctrl_next_interval(fan_ctrl *ctrl) {
+    int ms = next_interval(ctrl), wait = gate_wait(&ctrl->gate, sched_now_ms());
+    // a level the gate held back goes out when the dwell time is up, not whenever the scheduler gets round to it
+    if (wait >= 0 && wait < ms) {
+        ms = wait;
+    }
+    // the EC gives up on us when the watchdog runs out, be back well before it does
+    if (ctrl->watchdog > 0 && ctrl->level != FAN_LVL_AUTO && ms > ctrl->watchdog * 500) {
+        return ctrl->watchdog * 500;
+    }
+    return ms;
+}
+
+void ctrl_bracket(const fan_ctrl *ctrl, int temp, int *lo, int *hi) {
+    const fan_table *table;
+    int level = ctrl->level;
+    switch (ctrl->mode) {
+        case CTRL_AUTO:
+            table = &ctrl->auto_table;
+            break;
+        case CTRL_CURVE:
+            // with feed-forward, the load can change the level without the temperature moving at all
+            if (ctrl->load != NULL) {
+                *lo = -1;
+                *hi = CURVE_TEMPS;
+                return;
+            }
+            table = &ctrl->curve_table;
+            level = ctrl->curve_level;
+            break;
+        default:
+            // manual doesn't care about the temperature, and the PID cares about every degree of it
+            *lo = -1;
+            *hi = CURVE_TEMPS;
+            return;
+    }
+    *lo = curve_next_down(table, temp, level);
+    *hi = curve_next_up(table, temp);
+}
+
+// add to the curve's level for the load the temperature hasn't caught up with yet
+static int feed_forward(fan_ctrl *ctrl, int level) {
+    int boost = load_boost(&ctrl->load_cfg, ctrl->load);
+    // ramp back down a level per tick, so a load that flickers doesn't make the fan do the same
+    if (boost < ctrl->boost - 1) {
+        boost = ctrl->boost - 1;
+    }
+    ctrl->boost = boost;
+    level += boost;
+    return level > FAN_LVL_FULL ? FAN_LVL_FULL : level;
+}
+
+// the level a mode decided on, through the gate: returns false if it's held back
+// urgent increases go out as they are, see gate_level
+static bool command_level(fan_ctrl *ctrl, ctrl_result *res, int level, bool urgent, long long now_ms) {
+    if ((level = gate_level(&ctrl->gate, ctrl->mode, ctrl->level, level, urgent, now_ms)) == ctrl->level) {
+        return false;
+    }
+    res->event = level < ctrl->level ? CTRL_LEVEL_DOWN : CTRL_LEVEL_UP;
+    res->level = level;
+    res->error = ctrl_set_level(ctrl, level);
+    // a write that failed still starts the dwell time, or a broken fan gets hammered every tick
+    gate_written(&ctrl->gate, ctrl->mode, now_ms);
+    return true;
+}
+
+static void tick_curve(fan_ctrl *ctrl, ctrl_result *res, long long now_ms) {
+    const curve_config *c = &ctrl->curve_cfg;
+    // the hysteresis applies to the curve's own level, not to whatever the load added
+    int level = curve_eval(&ctrl->curve_table, res->temp, ctrl->curve_level);
+    int crit = c->n_points > 0 ? c->points[c->n_points - 1].temp : c->crit_temp;
+    ctrl->curve_level = level;
+    if (ctrl->load != NULL) {
+        level = feed_forward(ctrl, level);
+    }
+    if (level == ctrl->level) {
+        return;
+    }
+    command_level(ctrl, res, level, res->temp >= crit, now_ms);
+}
+
+static void tick_auto(fan_ctrl *ctrl, ctrl_result *res, long long now_ms) {
+    // same evaluator as the curve, the table is just auto below critical, and the critical speed above
+    int level = curve_eval(&ctrl->auto_table, res->temp, ctrl->level);
+    // the only way up is to the critical speed, that never waits
+    if (level == ctrl->level || !command_level(ctrl, res, level, level > ctrl->level, now_ms)) {
+        // either we're below critical, or still running hot
+        res->event = ctrl->was_crit ? CTRL_CRIT : CTRL_SAFE;
+        return;
+    }
+    // a write that failed changed nothing, the next tick tries again
+    if (res->error != 0) {
+        res->level = ctrl->level;
+        res->event = ctrl->was_crit ? CTRL_CRIT : CTRL_SAFE;
+        return;
+    }
+    // went to the critical speed, or back to auto once we've cooled down to safe
+    ctrl->was_crit = res->level != FAN_LVL_AUTO;
+    res->event = ctrl->was_crit ? CTRL_CRIT_ENTER : CTRL_CRIT_LEAVE;
+}
+
+static void tick_pid(fan_ctrl *ctrl, ctrl_result *res, long long now_ms) {
+    int level = pid_update(&ctrl->pid_cfg, &ctrl->pid, res->temp, now_ms, ctrl->level);
+    if (level == ctrl->level) {
+        return;
+    }
+    command_level(ctrl, res, level, res->temp >= ctrl->pid_cfg.target + PID_URGENT_C, now_ms);
+}
+
+void ctrl_step(fan_ctrl *ctrl, int temp, long long now_ms, ctrl_result *res) {
+    res->temp = temp;
+    res->level = ctrl->level;
+    res->error = 0;
+    res->event = CTRL_STEADY;
+    switch (ctrl->mode) {
+        case CTRL_CURVE:
+            tick_curve(ctrl, res, now_ms);
+            break;
+        case CTRL_AUTO:
+            tick_auto(ctrl, res, now_ms);
+            break;
+        case CTRL_PID:
+            tick_pid(ctrl, res, now_ms);
+            break;
+        default:
+            // manual, the level was set when the mode was applied, nothing to do
+            break;
+    }
+}
+
+// the other fans, off the same sample: however many there are, it's still the one wakeup
+static void tick_fans(fan_ctrl *ctrl) {
+    fan_unit *unit;
+    int i, level, ret;
+    for (i = 0; i < ctrl->n_fans; i++) {
+        unit = &ctrl->fans[i];
+        // can't read its sensors, leave the fan where it is
+        if (unit->temp == -1) {
+            continue;
+        }
+        level = curve_eval(&unit->table, unit->temp, unit->level);
+        if (level == unit->level) {
+            continue;
+        }
+        if ((ret = write_level(ctrl, unit->fan, level)) != 0) {
+            fprintf(stderr, "Failed to set fan %d speed to %s using %s backend: %s\n", i + 2, fan_speeds[level], unit->fan->ops->name, strerror(-ret));
+            continue;
+        }
+        unit->level = level;
+        if (ctrl->print_logs)
+            printf("Fan %d speed set to %s (%d C)\n", i + 2, fan_speeds[level], unit->temp);
+    }
+}
+
+// the sample just read, through the filters of every fan. Returns the temperature the modes go by, -1 if it couldn't be read
+static int filter_sample(fan_ctrl *ctrl, long long now) {
+    fan_unit *unit;
+    int i, mdeg;
+    for (i = 0; i < ctrl->n_fans; i++) {
+        unit = &ctrl->fans[i];
+        mdeg = filter_add(&ctrl->filter_cfg, &unit->filter, filter_fuse(&ctrl->filter_cfg, &unit->filter, &ctrl->sample));
+        unit->temp = mdeg == SENSOR_INVALID ? -1 : SENSOR_C(mdeg);
+    }
+    if (ctrl->filter_cfg.sample_ms > 0) {
+        ctrl->sample_next = now + ctrl->filter_cfg.sample_ms;
+    }
+    mdeg = filter_add(&ctrl->filter_cfg, &ctrl->filter, filter_fuse(&ctrl->filter_cfg, &ctrl->filter, &ctrl->sample));
+    return mdeg == SENSOR_INVALID ? -1 : SENSOR_C(mdeg);
+}
+
+long long ctrl_sample_timeout(const fan_ctrl *ctrl, long long wait) {
+    long long left;
+    if (ctrl->filter_cfg.sample_ms <= 0) {
+        return wait;
+    }
+    left = ctrl->sample_next - sched_now_ms();
+    if (left < 0) {
+        return 0;
+    }
+    return left < wait ? left : wait;
+}
+
+bool ctrl_sample(fan_ctrl *ctrl) {
+    long long now = sched_now_ms();
+    if (ctrl->filter_cfg.sample_ms <= 0 || now < ctrl->sample_next) {
+        return false;
+    }
+    sensors_read(ctrl->sensors, &ctrl->sample);
+    filter_sample(ctrl, now);
+    // it's a wakeup all the same
+    ctrl->sched.wakeups++;
+    return true;
+}
+
+static void log_tick(fan_ctrl *ctrl, const ctrl_result *res) {
+    telemetry_add(ctrl->telemetry, history_clock_ms(), &ctrl->sample, res->temp, res->level, res->rpm,
+        ctrl->mode, res->event, ctrl->power != NULL ? (int) ctrl->power->source : -1);
+}
+
+int ctrl_tick(fan_ctrl *ctrl, ctrl_result *res) {
+    fan_stats *stats = ctrl->stats;
+    unsigned long long start = 0, read_done = 0;
+    long long now;
+    int temp, rpm = RPM_UNKNOWN, retry_err, i;
+    ctrl_event alarm;
+    if (stats != NULL) {
+        start = stats_now_ns();
+    }
+    sensors_read(ctrl->sensors, &ctrl->sample);
+    if (ctrl->rpm != NULL && (rpm = fan_read_rpm(ctrl->fan)) < 0) {
+        rpm = RPM_UNKNOWN;
+    }
+    now = sched_now_ms();
+    temp = filter_sample(ctrl, now);
+    if (ctrl->load != NULL && load_read(ctrl->load, now) != 0 && ctrl->print_logs)
+        printf("Unable to read the CPU load, going by temperature alone\n");
+    if (stats != NULL) {
+        read_done = stats_now_ns();
+        stats->ticks++;
+        stats_record(stats, STATS_READ, read_done - start);
+        if (temp == -1 || ctrl->sample.failed > 0) {
+            stats->read_failures++;
+        }
+    }
+    if (temp == -1) {
+        res->temp = -1;
+        res->level = ctrl->level;
+        res->error = 0;
+        res->rpm = rpm;
+        res->event = CTRL_STEADY;
+        // a gap in the log would look like we weren't running
+        if (ctrl->telemetry != NULL) {
+            log_tick(ctrl, res);
+        }
+        return -1;
+    }
+    sched_sample(&ctrl->sched, temp);
+    if (stats != NULL) {
+        stats->write_ns = 0;
+    }
+    // a level that didn't take is written again before we decide on the next one
+    res->rpm = rpm;
+    res->error = 0;
+    res->event = CTRL_STEADY;
+    if (ctrl->rpm != NULL) {
+        check_rpm(ctrl, res, now);
+    }
+    alarm = res->event;
+    retry_err = res->error;
+    ctrl_step(ctrl, temp, now, res);
+    tick_fans(ctrl);
+    // a stalled fan matters more than whatever the mode had to say
+    if (alarm != CTRL_STEADY) {
+        res->event = alarm;
+    }
+    if (res->error == 0) {
+        res->error = retry_err;
+    }
+    if (stats != NULL) {
+        // the fan write (if any) has its own histogram
+        stats_record(stats, STATS_DECIDE, stats_now_ns() - read_done - stats->write_ns);
+    }
+    if (ctrl->watchdog > 0) {
+        feed_watchdog(ctrl);
+    }
+    ctrl->state.res = *res;
+    ctrl->state.mode = ctrl->mode;
+    ctrl->state.ms = history_clock_ms();
+    ctrl->state.seq++;
+    if (ctrl->rpm != NULL) {
+        ctrl->state.rpm_map = ctrl->rpm->map;
+    }
+    ctrl->state.power = ctrl->power != NULL ? (int) ctrl->power->source : -1;
+    ctrl->state.n_fans = ctrl->n_fans;
+    for (i = 0; i < ctrl->n_fans; i++) {
+        ctrl->state.fan_levels[i] = ctrl->fans[i].level;
+        ctrl->state.fan_temps[i] = ctrl->fans[i].temp;
+    }
+    if (ctrl->history != NULL) {
+        history_add(ctrl->history, ctrl->state.ms, &ctrl->sample, res->level, res->rpm);
+    }
+    if (ctrl->telemetry != NULL) {
+        log_tick(ctrl, res);
+    }
+    if (ctrl->trips != NULL) {
+        int lo, hi;
+        ctrl_bracket(ctrl, temp, &lo, &hi);
+        if (trip_arm(ctrl->trips, temp, lo, hi) != 0 && ctrl->print_logs)
+            printf("Unable to set thermal triggers on %s, polling\n", ctrl->trips->name);
+    }
+    return res->temp;
+}
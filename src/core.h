@@ -0,0 +1,225 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+The control core: reads the sensors, decides on a fan level, and sets it. No GTK in here,
+so the same code drives both the GUI and the headless daemon.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef CORE_H
+#define CORE_H
+
+#include <stdbool.h>
+#include "fan.h"
+#include "sensors.h"
+#include "curve.h"
+#include "sched.h"
+#include "history.h"
+#include "stats.h"
+#include "trip.h"
+#include "pid.h"
+#include "load.h"
+#include "rpm.h"
+#include "power.h"
+#include "filter.h"
+#include "gate.h"
+#include "telemetry.h"
+
+extern const char *fan_speeds[];
+
+typedef enum _ctrl_mode {
+    CTRL_AUTO = 0,
+    CTRL_MANUAL = 1,
+    CTRL_CURVE = 2,
+    CTRL_PID = 3,
+} ctrl_mode;
+
+// what the last tick did, the front end decides how to show it
+typedef enum _ctrl_event {
+    CTRL_STEADY,     // nothing changed
+    CTRL_LEVEL_UP,   // curve or PID stepped up
+    CTRL_LEVEL_DOWN, // curve or PID stepped down
+    CTRL_CRIT_ENTER, // auto: critical temp reached, fans ramped up
+    CTRL_CRIT_LEAVE, // auto: safe temp reached, fans back to auto
+    CTRL_SAFE,       // auto: below critical, fans on auto
+    CTRL_CRIT,       // auto: still running hot
+    CTRL_FAN_STALLED,  // the fan was told to spin, and it doesn't
+    CTRL_FAN_MISMATCH, // the fan settled well away from what the level did before
+} ctrl_event;
+
+typedef struct _auto_config {
+    int temp_safe, temp_crit, scan_interval, fan_speed; // fan speed to use when critical
+} auto_config;
+
+typedef struct _manual_config {
+    int scan_interval, fan_speed;
+} manual_config;
+
+typedef struct _curve_config {
+    int step, safe_temp, crit_temp, delta_temp, scan, safe_speed, crit_speed;
+    double throttle_factor;
+    // if there are any points, they replace the linear safe -> critical ramp
+    curve_point points[CURVE_POINTS_MAX];
+    int n_points;
+} curve_config;
+
+// fans besides the one the modes drive, see ctrl_add_fan
+#define CTRL_FANS_MAX 4
+// the curves of those fans step down this many degrees below where they stepped up
+#define CTRL_FAN_HYSTERESIS 3
+
+// what -f asked for: pwm_path:sensors:points, resolved once the fans and sensors are open
+typedef struct _fan_spec {
+    char pwm_path[PATH_MAX];
+    char sensors[FILTER_LIST_LEN]; // name[*weight]+..., see filter_resolve
+    curve_point points[CURVE_POINTS_MAX];
+    int n_points;
+} fan_spec;
+
+// one of those fans, they're all gone through in the same tick as the main one
+typedef struct _fan_unit {
+    fan_actuator *fan;
+    filter_channel filter; // the sensors it follows
+    int level;  // level we last set successfully, -1 before the first tick
+    int temp;   // what its sensors read (filtered) on the last sample, -1 if they couldn't be read
+    fan_table table;
+} fan_unit;
+
+// everything that changes with the power source: the configs of every mode, and how often to look
+typedef struct _ctrl_profile {
+    auto_config auto_cfg;
+    manual_config manual_cfg;
+    curve_config curve_cfg;
+    pid_config pid_cfg;
+    fan_table auto_table, curve_table;
+    int adaptive_ms;
+} ctrl_profile;
+
+typedef struct _ctrl_result {
+    int temp;  // CPU temp in degrees C, -1 if the read failed
+    int level; // level to show: the one we set, or tried to set
+    int error; // 0, or -errno if the fan write failed
+    int rpm;   // fan speed read back before deciding, RPM_UNKNOWN if we can't
+    ctrl_event event;
+} ctrl_result;
+
+// published after every successful tick, this is all a front end needs to show what's going on
+typedef struct _ctrl_state {
+    ctrl_result res;
+    ctrl_mode mode;
+    long long ms;      // wall-clock time of the tick, ms since epoch
+    unsigned long seq; // bumped every tick, so a view can tell whether there's anything new
+    rpm_map rpm_map;   // what each level did so far on this machine
+    int n_fans;        // the other fans, with the temperature of their sensors
+    int fan_levels[CTRL_FANS_MAX], fan_temps[CTRL_FANS_MAX];
+    int power;         // POWER_AC or POWER_BATTERY, -1 if the profile doesn't follow the power source
+} ctrl_state;
+
+typedef struct _fan_ctrl {
+    fan_actuator *fan;
+    sensor_set *sensors;
+    sensor_sample sample; // last values read
+    ctrl_mode mode;
+    auto_config auto_cfg;
+    manual_config manual_cfg;
+    curve_config curve_cfg;
+    pid_config pid_cfg;
+    pid_state pid;
+    load_config load_cfg;
+    filter_config filter_cfg; // how every channel is fused and smoothed
+    filter_channel filter;    // the sensors the modes go by, the primary one unless told otherwise
+    long long sample_next;    // when the next in-between sample is due, with filter_cfg.sample_ms
+    fan_gate gate;            // every level the modes decide on goes through here, set gate.cfg to hold them back
+    // compiled versions of the auto and curve configs, this is what the ticks run on
+    fan_table auto_table, curve_table;
+    // picks the next sample time when adaptive sampling is on, counts wakeups either way
+    fan_sched sched;
+    fan_history *history; // every successful tick is recorded here, NULL to not keep any history
+    fan_telemetry *telemetry; // every tick is logged here, failed ones too, NULL to not log anything
+    fan_stats *stats;     // tick timings and counters, NULL to not time anything
+    trip_watch *trips;    // re-armed around the current level every tick, NULL to just poll
+    load_watch *load;     // feed-forward for the curve, NULL to go by the temperature alone
+    rpm_watch *rpm;       // checks every level change took, NULL if the fan can't tell us its speed
+    power_watch *power;   // switches profiles when the power source changes, NULL to run the same one on both
+    const char *battery;  // on battery, these override the configs (see ctrl_parse_profile)
+    ctrl_profile profiles[2]; // compiled, by power source, only used with power set
+    fan_unit fans[CTRL_FANS_MAX]; // the other fans, each on a curve of its own
+    int n_fans;
+    int watchdog; // seconds the EC waits for our next tick before it takes over again, 0 for off
+    bool watchdog_armed;
+    bool watchdog_fed; // a level was written since the last tick, which resets the watchdog just as well
+    int level;    // level we last set successfully
+    int was_crit; // auto mode: are we running at the critical fan speed
+    int curve_level, boost; // curve mode: the level the curve asked for, and what the load added to it
+    bool print_logs;
+    ctrl_state state;
+} fan_ctrl;
+
+void ctrl_init(fan_ctrl *ctrl, fan_actuator *fan, sensor_set *sensors);
+// validate the config for the given mode, and compile it into the table ctrl_tick uses
+// returns NULL if it's OK, or a message saying what's wrong (the previous table is kept)
+const char *ctrl_compile(fan_ctrl *ctrl, ctrl_mode mode);
+// switch mode (or re-apply the config of the current one), sets the level for manual mode, returns 0 or -errno
+// the config for the mode must have been compiled
+int ctrl_start(fan_ctrl *ctrl, ctrl_mode mode);
+// back to AUTO (the other fans too), returns 0 or -errno
+int ctrl_stop(fan_ctrl *ctrl);
+// another fan to run on a curve of its own, following the sensors of filter whatever the mode of the main fan is
+// returns NULL if it's added, or a message saying what's wrong
+const char *ctrl_add_fan(fan_ctrl *ctrl, fan_actuator *fan, const filter_channel *filter, const curve_point *points, int n);
+// one iteration of the control loop, returns the temperature read (filtered), -1 on failure
+int ctrl_tick(fan_ctrl *ctrl, ctrl_result *res);
+// with filter_cfg.sample_ms: ms until the next in-between sample is due, never more than wait
+long long ctrl_sample_timeout(const fan_ctrl *ctrl, long long wait);
+// the in-between sample, if it's due: the sensors are read into the filters, nothing is decided
+// returns true if it took one
+bool ctrl_sample(fan_ctrl *ctrl);
+// the decision part of a tick, for a temperature that was already read (or replayed from a trace)
+// now_ms is a monotonic timestamp of the sample, the PID needs to know how far apart they are
+void ctrl_step(fan_ctrl *ctrl, int temp, long long now_ms, ctrl_result *res);
+int ctrl_set_level(fan_ctrl *ctrl, int level);
+// levels the gate let through and held back, by mode
+void ctrl_gate_dump(const fan_ctrl *ctrl, FILE *out);
+// the configs of every mode, and their compiled tables, ie from a controller that only compiles them
+void ctrl_copy_config(fan_ctrl *to, const fan_ctrl *from);
+int ctrl_scan_interval(const fan_ctrl *ctrl);
+// adaptive sampling between min_ms and the scan interval of the mode, 0 turns it off
+void ctrl_set_adaptive(fan_ctrl *ctrl, int min_ms);
+// the configs as they are now become the AC profile, the battery one is derived from it with ctrl->battery
+// then the configs of the current power source are used. Doesn't restart the mode, does nothing without power
+// returns NULL, or a message saying what's wrong with the battery profile for mode (the AC one is used instead)
+const char *ctrl_set_profiles(fan_ctrl *ctrl, ctrl_mode mode);
+// after poll: true if the power source changed, the configs are switched over, the caller restarts the mode
+bool ctrl_power_check(fan_ctrl *ctrl, const struct pollfd *pfds);
+// ms until the next tick: the scan interval, or whatever the adaptive scheduler thinks is best
+// with thermal triggers armed, a long backstop: the triggers wake us up when it matters
+// never more than half the watchdog timeout while the fan isn't on auto
+int ctrl_next_interval(fan_ctrl *ctrl);
+// the temperatures where the current mode would pick another level: at or below lo, at or above hi
+// lo is -1 and hi CURVE_TEMPS if there are none (ie manual mode)
+void ctrl_bracket(const fan_ctrl *ctrl, int temp, int *lo, int *hi);
+// leave the fan on whatever level it's on, as we exit: the watchdog is disarmed so the EC doesn't take it back
+int ctrl_release(fan_ctrl *ctrl);
+const char *ctrl_mode_name(ctrl_mode mode);
+const char *ctrl_event_name(ctrl_event event);
+// command line helpers, return 0 or -1 if the argument is invalid
+int ctrl_parse_mode(const char *name, ctrl_mode *mode);
+// safe:safe_speed:delta:step:crit:crit_speed:throttle%
+int ctrl_parse_curve(const char *arg, curve_config *curve);
+// target:kp:ki:kd:min_level:max_level:dwell
+int ctrl_parse_pid(const char *arg, pid_config *pid);
+// util_start:util_full:watts_start:watts_full:max_boost
+int ctrl_parse_load(const char *arg, load_config *load);
+// key=value;... on top of profile: scan, adaptive, level, safe, crit (auto), curve, points, pid (as -C, -P, -D)
+int ctrl_parse_profile(const char *arg, ctrl_profile *profile);
+// pwm_path:sensors:points, ie /sys/class/hwmon/hwmon3/pwm2:GPU:40:1,60:4,75:8
+int ctrl_parse_fan(const char *arg, fan_spec *spec);
+// fuse:smooth:window:sample_ms[:sensors], ie max:median:5:1000:thinkpad0+coretemp/temp1*2
+// sensors is left empty if there are none (they stay the primary one), len is its size
+int ctrl_parse_filter(const char *arg, filter_config *cfg, char *sensors, size_t len);
+// dwell:max_step, ie 10:2
+int ctrl_parse_gate(const char *arg, gate_config *cfg);
+// path[:max_mb[:files[:batch[:flush_s]]]], ie /var/log/fan_control.bin:16:4, the rest is left as it is
+int ctrl_parse_telemetry(const char *arg, telemetry_config *cfg);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Fan curve validation and compilation.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdlib.h>
+#include "curve.h"
+#include "fan.h"
+
+int curve_parse_points(const char *str, curve_point *points, int max) {
+    int n = 0;
+    char *end;
+    while (*str != '\0') {
+        if (*str == ' ' || *str == ',' || *str == '\t' || *str == '\n') {
+            str++;
+            continue;
+        }
+        if (n == max) {
+            return -1;
+        }
+        points[n].temp = strtol(str, &end, 10);
+        if (end == str || *end != ':') {
+            return -1;
+        }
+        str = end + 1;
+        points[n].level = strtol(str, &end, 10);
+        if (end == str) {
+            return -1;
+        }
+        str = end;
+        n++;
+    }
+    return n;
+}
+
+const char *curve_compile(fan_table *table, const curve_point *points, int n, int hysteresis) {
+    int i, t;
+    if (n < 1 || n > CURVE_POINTS_MAX) {
+        return "A curve needs between 1 and 16 points";
+    }
+    if (hysteresis < 0) {
+        return "Decrement threshold can't be negative";
+    }
+    for (i = 0; i < n; i++) {
+        if (points[i].temp < 0 || points[i].temp > CURVE_TEMP_MAX) {
+            return "Curve temperatures must be between 0 and 127";
+        }
+        if (points[i].level < FAN_LVL_AUTO || points[i].level > FAN_LVL_FULL) {
+            return "Curve fan levels must be between 0 (auto) and 8 (full)";
+        }
+        if (i > 0 && points[i].temp <= points[i - 1].temp) {
+            return "Curve temperatures must be increasing";
+        }
+        if (i > 0 && points[i].level < points[i - 1].level) {
+            return "Curve fan levels can't decrease as the temperature goes up";
+        }
+    }
+    // below the first point, we just use the first level
+    for (i = 0, t = 0; t < CURVE_TEMPS; t++) {
+        while (i + 1 < n && points[i + 1].temp <= t) {
+            i++;
+        }
+        table->level[t] = points[i].level;
+    }
+    table->hysteresis = hysteresis;
+    return NULL;
+}
+
+int curve_next_up(const fan_table *table, int temp) {
+    int t = curve_index(temp), level = table->level[t];
+    while (++t < CURVE_TEMPS) {
+        if (table->level[t] > level) {
+            return t;
+        }
+    }
+    return CURVE_TEMPS;
+}
+
+int curve_next_down(const fan_table *table, int temp, int current) {
+    int t = curve_index(temp);
+    while (--t >= 0) {
+        if (curve_eval(table, t, current) < current) {
+            return t;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,51 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Fan curves: a list of temperature -> level points, validated and compiled into a lookup table
+indexed by degrees C, so each tick is a single array lookup.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef CURVE_H
+#define CURVE_H
+
+#define CURVE_TEMP_MAX 127 // anything hotter uses the level for this temperature
+#define CURVE_TEMPS (CURVE_TEMP_MAX + 1)
+#define CURVE_POINTS_MAX 16
+
+// from temp degrees C upwards (until the next point), run the fan at level
+typedef struct _curve_point {
+    int temp, level;
+} curve_point;
+
+typedef struct _fan_table {
+    unsigned char level[CURVE_TEMPS];
+    // stepping down: a level is kept while temp + hysteresis still maps onto it
+    int hysteresis;
+} fan_table;
+
+// parse "30:1 50:3 65:5 75:8" (space or comma separated), returns the number of points, -1 on error
+int curve_parse_points(const char *str, curve_point *points, int max);
+// returns NULL on success, or a message explaining why the points don't make a valid curve
+const char *curve_compile(fan_table *table, const curve_point *points, int n, int hysteresis);
+// first temperature above temp where the table steps up a level, CURVE_TEMPS if there is none
+int curve_next_up(const fan_table *table, int temp);
+// highest temperature below temp where we'd step down from current, -1 if there is none
+int curve_next_down(const fan_table *table, int temp, int current);
+
+static inline int curve_index(int temp) {
+    return temp < 0 ? 0 : (temp > CURVE_TEMP_MAX ? CURVE_TEMP_MAX : temp);
+}
+
+// the level to run at for temp, given the current level
+static inline int curve_eval(const fan_table *table, int temp, int current) {
+    int up = table->level[curve_index(temp)], down;
+    if (up >= current) {
+        return up;
+    }
+    // stepping down, but only as far as the hysteresis allows
+    down = table->level[curve_index(temp + table->hysteresis)];
+    return down < current ? down : current;
+}
+
+#endif
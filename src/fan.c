@@ -0,0 +1,289 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Fan actuator backends. The files are opened once, and every level change is a single pwrite,
+rather than the fork + exec of /bin/sh + redirect that system("echo level ...") used to cost us.
+Reading the RPM back is a single pread, parsed by hand.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include "fan.h"
+#include "paths.h"
+
+// hwmon pwmN_enable values
+#define PWM_ENABLE_MANUAL 1
+#define PWM_ENABLE_AUTO 2
+#define PWM_MAX 255
+
+static int write_str(int fd, const char *buf, size_t len) {
+    ssize_t written;
+    if (fd < 0) {
+        return -EBADF;
+    }
+    // procfs and sysfs files don't care about the offset, but a regular file (ie tests) should be overwritten, not appended to
+    written = pwrite(fd, buf, len, 0);
+    if (written < 0) {
+        return -errno;
+    }
+    if ((size_t) written != len) {
+        return -EIO;
+    }
+    return 0;
+}
+
+// thinkpad_acpi's fan file takes commands, not a value: procfs doesn't care about the offset, and a
+// regular file (ie tests) opened with O_APPEND gets them one after the other, like the kernel does,
+// rather than the second write of a tick (the watchdog) overwriting the first (the level)
+static int write_cmd(int fd, const char *buf, size_t len) {
+    ssize_t written;
+    if (fd < 0) {
+        return -EBADF;
+    }
+    written = write(fd, buf, len);
+    if (written < 0) {
+        return -errno;
+    }
+    if ((size_t) written != len) {
+        return -EIO;
+    }
+    return 0;
+}
+
+// the number at the start of buf, after any whitespace
+static int parse_rpm(const char *p) {
+    int val = 0;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p < '0' || *p > '9') {
+        return -EINVAL;
+    }
+    while (*p >= '0' && *p <= '9') {
+        val = val * 10 + (*p - '0');
+        p++;
+    }
+    return val;
+}
+
+static int read_rpm_str(fan_actuator *fan, char *buf, size_t len) {
+    ssize_t n;
+    if (fan->rpm_fd < 0) {
+        return -EBADF;
+    }
+    if ((n = pread(fan->rpm_fd, buf, len - 1, 0)) < 0) {
+        return -errno;
+    }
+    buf[n] = '\0';
+    return 0;
+}
+
+static int thinkpad_read_rpm(fan_actuator *fan) {
+    char buf[512];
+    const char *p;
+    int ret;
+    if ((ret = read_rpm_str(fan, buf, sizeof(buf))) != 0) {
+        return ret;
+    }
+    // status:\t\tenabled\nspeed:\t\t2900\nlevel:\t\tauto\n...
+    if ((p = strstr(buf, "speed:")) == NULL) {
+        return -EINVAL;
+    }
+    return parse_rpm(p + 6);
+}
+
+static int hwmon_read_rpm(fan_actuator *fan) {
+    char buf[16];
+    int ret;
+    if ((ret = read_rpm_str(fan, buf, sizeof(buf))) != 0) {
+        return ret;
+    }
+    return parse_rpm(buf);
+}
+
+static int mock_read_rpm(fan_actuator *fan) {
+    return -EOPNOTSUPP;
+}
+
+static int thinkpad_set_level(fan_actuator *fan, int level) {
+    char cmd[24];
+    int len;
+    switch (level) {
+        case FAN_LVL_AUTO:
+            len = snprintf(cmd, sizeof(cmd), "level auto\n");
+            break;
+        case FAN_LVL_FULL:
+            len = snprintf(cmd, sizeof(cmd), "level full-speed\n");
+            break;
+        default:
+            len = snprintf(cmd, sizeof(cmd), "level %d\n", level);
+    }
+    return write_cmd(fan->fd, cmd, len);
+}
+
+static int thinkpad_set_watchdog(fan_actuator *fan, int seconds) {
+    char cmd[24];
+    int len = snprintf(cmd, sizeof(cmd), "watchdog %d\n", seconds);
+    return write_cmd(fan->fd, cmd, len);
+}
+
+static int hwmon_set_level(fan_actuator *fan, int level) {
+    char val[8];
+    int len, ret;
+    if (level == FAN_LVL_AUTO) {
+        len = snprintf(val, sizeof(val), "%d\n", PWM_ENABLE_AUTO);
+        return write_str(fan->enable_fd, val, len);
+    }
+    // only switch to manual if we weren't in manual mode already, saves a write per level change
+    if (fan->level <= FAN_LVL_AUTO) {
+        len = snprintf(val, sizeof(val), "%d\n", PWM_ENABLE_MANUAL);
+        if ((ret = write_str(fan->enable_fd, val, len)) != 0) {
+            return ret;
+        }
+    }
+    // levels 1-7 map linearly onto the PWM duty cycle, below full speed (max duty cycle), so each level is a speed of its own
+    len = snprintf(val, sizeof(val), "%d\n", level >= FAN_LVL_FULL ? PWM_MAX : level * PWM_MAX / FAN_LVL_FULL);
+    return write_str(fan->fd, val, len);
+}
+
+static int mock_set_level(fan_actuator *fan, int level) {
+    return fan->fail;
+}
+
+static void fd_close(fan_actuator *fan) {
+    if (fan->fd >= 0) {
+        close(fan->fd);
+    }
+    if (fan->enable_fd >= 0) {
+        close(fan->enable_fd);
+    }
+    if (fan->rpm_fd >= 0) {
+        close(fan->rpm_fd);
+    }
+    fan->fd = fan->enable_fd = fan->rpm_fd = -1;
+}
+
+static void mock_close(fan_actuator *fan) {
+}
+
+static const fan_ops thinkpad_ops = {
+    .name = "thinkpad_acpi",
+    .set_level = thinkpad_set_level,
+    .read_rpm = thinkpad_read_rpm,
+    .set_watchdog = thinkpad_set_watchdog,
+    .close = fd_close,
+};
+
+static const fan_ops hwmon_ops = {
+    .name = "hwmon",
+    .set_level = hwmon_set_level,
+    .read_rpm = hwmon_read_rpm,
+    .close = fd_close,
+};
+
+static const fan_ops mock_ops = {
+    .name = "mock",
+    .set_level = mock_set_level,
+    .read_rpm = mock_read_rpm,
+    .close = mock_close,
+};
+
+void fan_init(fan_actuator *fan, const fan_ops *ops) {
+    memset(fan, 0, sizeof(*fan));
+    fan->ops = ops;
+    fan->fd = fan->enable_fd = fan->rpm_fd = -1;
+    fan->level = -1;
+}
+
+int fan_open_thinkpad(fan_actuator *fan, const char *path) {
+    fan_init(fan, &thinkpad_ops);
+    fan->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fan->fd < 0) {
+        return -errno;
+    }
+    // the same file shows the speed when read, not being able to is no reason to give up on setting it
+    fan->rpm_fd = open(path, O_RDONLY | O_CLOEXEC);
+    return 0;
+}
+
+int fan_open_hwmon(fan_actuator *fan, const char *pwm_path) {
+    char enable_path[PATH_MAX], rpm_path[PATH_MAX];
+    const char *name = strrchr(pwm_path, '/');
+    fan_init(fan, &hwmon_ops);
+    if (snprintf(enable_path, sizeof(enable_path), "%s_enable", pwm_path) >= (int) sizeof(enable_path)) {
+        return -ENAMETOOLONG;
+    }
+    fan->fd = open(pwm_path, O_WRONLY | O_CLOEXEC);
+    if (fan->fd < 0) {
+        return -errno;
+    }
+    fan->enable_fd = open(enable_path, O_WRONLY | O_CLOEXEC);
+    if (fan->enable_fd < 0) {
+        int err = -errno;
+        fd_close(fan);
+        return err;
+    }
+    // pwmN goes with fanN_input, if there is one
+    name = name != NULL ? name + 1 : pwm_path;
+    if (strncmp(name, "pwm", 3) == 0 && snprintf(rpm_path, sizeof(rpm_path), "%.*sfan%s_input", (int) (name - pwm_path), pwm_path, name + 3) < (int) sizeof(rpm_path)) {
+        fan->rpm_fd = open(rpm_path, O_RDONLY | O_CLOEXEC);
+    }
+    return 0;
+}
+
+void fan_open_mock(fan_actuator *fan) {
+    fan_init(fan, &mock_ops);
+}
+
+int fan_open(fan_actuator *fan, const char *root, const char *pwm_path, int mock) {
+    char path[PATH_MAX];
+    if (mock) {
+        fan_open_mock(fan);
+        return 0;
+    }
+    if (root_path(path, sizeof(path), root, pwm_path != NULL ? pwm_path : FAN_PROC_PATH) != 0) {
+        // still leave a usable actuator behind, like the other failures do
+        fan_init(fan, pwm_path != NULL ? &hwmon_ops : &thinkpad_ops);
+        return -ENAMETOOLONG;
+    }
+    if (pwm_path != NULL) {
+        return fan_open_hwmon(fan, path);
+    }
+    return fan_open_thinkpad(fan, path);
+}
+
+int fan_set_level(fan_actuator *fan, int level) {
+    int ret;
+    if (level < FAN_LVL_AUTO || level > FAN_LVL_FULL) {
+        return -EINVAL;
+    }
+    ret = fan->ops->set_level(fan, level);
+    if (ret == 0) {
+        fan->level = level;
+        fan->writes++;
+    }
+    return ret;
+}
+
+int fan_set_watchdog(fan_actuator *fan, int seconds) {
+    if (fan->ops->set_watchdog == NULL) {
+        return -EOPNOTSUPP;
+    }
+    if (seconds < 0 || seconds > FAN_WATCHDOG_MAX) {
+        return -EINVAL;
+    }
+    return fan->ops->set_watchdog(fan, seconds);
+}
+
+int fan_read_rpm(fan_actuator *fan) {
+    return fan->ops->read_rpm(fan);
+}
+
+void fan_close(fan_actuator *fan) {
+    fan->ops->close(fan);
+}
@@ -0,0 +1,60 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Fan actuator layer: sets fan levels without going through a shell, and reads back how fast the fan
+actually turns.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef FAN_H
+#define FAN_H
+
+#define FAN_LVL_AUTO 0
+#define FAN_LVL_FULL 8
+
+#define FAN_PROC_PATH "/proc/acpi/ibm/fan"
+// thinkpad_acpi: if no command comes in for this long, the EC takes over again. 0 is off
+#define FAN_WATCHDOG_MAX 120
+
+typedef struct _fan_actuator fan_actuator;
+
+// a backend only needs to know how to write a level, read the RPM, and how to clean up after itself
+typedef struct _fan_ops {
+    const char *name;
+    int (*set_level)(fan_actuator *fan, int level); // returns 0, or -errno
+    int (*read_rpm)(fan_actuator *fan);             // returns the RPM, or -errno
+    int (*set_watchdog)(fan_actuator *fan, int seconds); // returns 0, or -errno. NULL if there's no such thing
+    void (*close)(fan_actuator *fan);
+} fan_ops;
+
+struct _fan_actuator {
+    const fan_ops *ops;
+    int fd;         // thinkpad: the fan file, hwmon: pwmN
+    int enable_fd;  // hwmon only: pwmN_enable
+    int rpm_fd;     // thinkpad: the fan file again, read-only, hwmon: fanN_input. -1 if we can't read it
+    int level;      // last level written successfully, -1 if we don't know
+    int writes;     // number of successful writes, handy to check the mock
+    int fail;       // mock only: if non-zero, set_level fails with this -errno
+    int unit;       // helper only: which of the helper's fans this one stands for (fd is the socket)
+};
+
+// a closed actuator with the given backend, for backends that live outside fan.c
+void fan_init(fan_actuator *fan, const fan_ops *ops);
+
+// each of these return 0 on success, -errno on failure. The actuator is usable (returning errors) either way
+int fan_open_thinkpad(fan_actuator *fan, const char *path);
+int fan_open_hwmon(fan_actuator *fan, const char *pwm_path);
+void fan_open_mock(fan_actuator *fan);
+// open whatever the command line asked for: the mock, a hwmon pwm channel, or thinkpad_acpi if pwm_path is NULL
+// the paths are relative to root, which is NULL for the real thing
+int fan_open(fan_actuator *fan, const char *root, const char *pwm_path, int mock);
+
+int fan_set_level(fan_actuator *fan, int level);
+// (re)arm the watchdog that puts the fan back on auto if we stop writing to it, 0 turns it off
+// returns 0, or -errno (-EOPNOTSUPP if the backend doesn't have one)
+int fan_set_watchdog(fan_actuator *fan, int seconds);
+// the RPM the fan reports right now, -errno if it doesn't (ie -EOPNOTSUPP for the mock)
+int fan_read_rpm(fan_actuator *fan);
+void fan_close(fan_actuator *fan);
+
+#endif
@@ -0,0 +1,563 @@
+/*
+ThinkPad Fan Control - headless daemon
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Runs the same control core as the GUI, without GTK, on a plain poll loop.
+Meant for machines nobody is logged in to, or to be started early in boot.
+
+ThinkPad fan control is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+version 2 as published by the Free Software Foundation. See main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <poll.h>
+#include <signal.h>
+#include "core.h"
+#include "api.h"
+
+// how late a tick can be before we count it as a missed deadline
+#define DEADLINE_SLACK_MS 50
+
+static volatile sig_atomic_t quit = 0, dump_stats = 0;
+
+// what an API command asked for, the loop switches over once the commands are handled
+typedef struct _api_request {
+    bool changed;
+    ctrl_mode mode;
+} api_request;
+
+static void on_signal(int sig) {
+    if (sig == SIGUSR1) {
+        dump_stats = 1;
+        return;
+    }
+    quit = 1;
+}
+
+// stop means auto here: the EC is in charge, unless it gets critical
+static void api_mode(void *data, ctrl_mode mode, bool running) {
+    api_request *req = data;
+    req->changed = true;
+    req->mode = running ? mode : CTRL_AUTO;
+}
+
+void print_help(char const *bin) {
+    printf("%s Usage:\n\
+            -M <mode> : Control mode: auto, manual, curve or pid (default auto)\n\
+            -i <seconds> : Scan interval (default auto: 120, manual: 10, curve: 5, pid: 2)\n\
+            -c <temp> : Auto: critical temperature (default 55)\n\
+            -s <temp> : Auto: safe temperature (default 50)\n\
+            -l <level> : Auto: fan level when critical (default 8), manual: fan level (default 7)\n\
+            -C <curve> : Curve: safe:safe_level:delta:step:critical:critical_level:throttle%% (default 35:1:5:1:65:8:50)\n\
+            -P <points> : Curve: temp:level points, replacing the linear curve (e.g. 30:1,50:3,65:5,75:8)\n\
+            -D <pid> : PID: target:kp:ki:kd:min_level:max_level:dwell (default 60:0.4:0.01:1:1:8:10)\n\
+            -F <load> : Curve: add levels for CPU load, util_start%%:util_full%%:watts_start:watts_full:max_boost (e.g. 50:90:10:25:3)\n\
+            -p <path> : Control a hwmon pwm channel instead of %s\n\
+            -f <fan> : Another fan on a curve of its own, pwm_path:sensors:points, the sensors by name or number as name[*weight]+... (e.g. /sys/class/hwmon/hwmon3/pwm2:GPU:40:1,60:4,75:8), up to %d times\n\
+            -t <filter> : Fuse and smooth the temperatures, fuse:smooth:window:sample_ms[:sensors], fuse is max or mean, smooth none, ema or median (e.g. max:median:5:1000:thinkpad0+coretemp/temp1*2)\n\
+            -g <gate> : Hold fan levels for at least dwell seconds, and move at most max_step levels at a time, dwell:max_step (e.g. 10:2), increases near critical always go through\n\
+            -r <dir> : Look for procfs and sysfs files under <dir> instead of / (ie a tree made by fan_fixture)\n\
+            -a <ms> : Adaptive sampling between every <ms> and the scan interval (default off)\n\
+            -e : Wake up when a thermal trip point (or hwmon alarm) we set is crossed, rather than polling, if there are writable ones\n\
+            -R <file> : Keep the learned level to RPM map in <file>, loaded on start and saved on exit\n\
+            -b <profile> : On battery, override the above with key=value;... (scan, adaptive, level, safe, crit, curve, points, pid), e.g. \"scan=20;points=45:1,70:4,80:8\"\n\
+            -W <seconds> : thinkpad_acpi fan watchdog, the EC takes over if we stop checking for this long (default %d, 0 for off)\n\
+            -u <path> : Serve the control and telemetry API on this Unix socket (e.g. %s)\n\
+            -L <log> : Append every tick to a binary telemetry log, path[:max_mb[:files[:batch[:flush_s]]]] (default 16MB, 4 files, every 64 ticks or 60s), read it with fan_log\n\
+            -m : Mock fan, don't touch the hardware\n\
+            -S : Print tick timings and counters on exit (they're also printed on SIGUSR1)\n\
+            -v : Verbose, print logs to stdout (default false)\n\
+            -h : Help - display this message\n", bin, FAN_PROC_PATH, CTRL_FANS_MAX, FAN_WATCHDOG_MAX, API_SOCKET_PATH);
+}
+
+int main(int argc, char **argv) {
+    bool print_logs = false, mock_fan = false, print_stats = false, use_trips = false, use_load = false;
+    int c, ret, interval = 0, level = -1, adaptive_ms = 0, next_ms, watchdog = FAN_WATCHDOG_MAX, n_fans = 0, i;
+    long long next;
+    char const *pwm_path = NULL, *root = NULL, *err, *rpm_path = NULL, *battery = NULL, *api_path = NULL;
+    char map_str[128], rpm_str[24];
+    char const *bin = argv[0];
+    ctrl_mode mode = CTRL_AUTO;
+    fan_actuator fan, fans[CTRL_FANS_MAX];
+    fan_spec fan_specs[CTRL_FANS_MAX];
+    sensor_set sensors;
+    fan_ctrl ctrl, config;
+    fan_stats stats;
+    trip_watch trips;
+    load_config load_cfg;
+    load_watch load;
+    filter_config filter_cfg;
+    filter_channel chan;
+    char filter_sensors[FILTER_LIST_LEN] = "";
+    bool use_filter = false;
+    gate_config gate_cfg = { 0 };
+    rpm_watch rpm;
+    power_watch power;
+    ctrl_profile check;
+    api_server api;
+    api_view view;
+    api_request api_req = { .changed = false };
+    bool serving = false;
+    fan_telemetry telemetry;
+    telemetry_config tel_cfg = {
+        .path = "",
+        .max_mb = 16,
+        .files = 4,
+        .batch = 64,
+        .flush_s = 60,
+    };
+    ctrl_result res;
+    struct pollfd pfds[TRIP_FDS_MAX + 2];
+    struct sigaction sa;
+    // same defaults as the GUI
+    auto_config auto_cfg = {
+        .temp_safe = 50,
+        .temp_crit = 55,
+        .scan_interval = 120,
+        .fan_speed = FAN_LVL_FULL,
+    };
+    manual_config manual_cfg = {
+        .scan_interval = 10,
+        .fan_speed = 7,
+    };
+    curve_config curve_cfg = {
+        .safe_temp = 35,
+        .safe_speed = 1,
+        .delta_temp = 5,
+        .step = 1,
+        .crit_temp = 65,
+        .crit_speed = FAN_LVL_FULL,
+        .scan = 5,
+        .throttle_factor = 0.5,
+    };
+    pid_config pid_cfg = {
+        .target = 60,
+        .kp = 0.4,
+        .ki = 0.01,
+        .kd = 1.0,
+        .min_level = 1,
+        .max_level = FAN_LVL_FULL,
+        .dwell = 10,
+        .scan = 2,
+    };
+
+    while ((c = getopt(argc, argv, "M:i:c:s:l:C:P:D:F:R:W:b:u:L:p:f:a:t:g:emvhr:S")) != -1) {
+        switch (c) {
+            case 'M':
+                if (ctrl_parse_mode(optarg, &mode) != 0) {
+                    fprintf(stderr, "Unknown mode `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'c':
+                auto_cfg.temp_crit = atoi(optarg);
+                break;
+            case 's':
+                auto_cfg.temp_safe = atoi(optarg);
+                break;
+            case 'l':
+                level = atoi(optarg);
+                break;
+            case 'C':
+                if (ctrl_parse_curve(optarg, &curve_cfg) != 0) {
+                    fprintf(stderr, "Invalid curve `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                curve_cfg.n_points = curve_parse_points(optarg, curve_cfg.points, CURVE_POINTS_MAX);
+                if (curve_cfg.n_points < 1) {
+                    fprintf(stderr, "Invalid curve points `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (ctrl_parse_pid(optarg, &pid_cfg) != 0) {
+                    fprintf(stderr, "Invalid PID config `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                if (ctrl_parse_load(optarg, &load_cfg) != 0 || (err = load_validate(&load_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid feed-forward config `%s'.\n", optarg);
+                    return 1;
+                }
+                use_load = true;
+                break;
+            case 't':
+                if (ctrl_parse_filter(optarg, &filter_cfg, filter_sensors, sizeof(filter_sensors)) != 0 || (err = filter_validate(&filter_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid filter `%s'.\n", optarg);
+                    return 1;
+                }
+                use_filter = true;
+                break;
+            case 'g':
+                if (ctrl_parse_gate(optarg, &gate_cfg) != 0) {
+                    fprintf(stderr, "Invalid command gate `%s', expected dwell:max_step.\n", optarg);
+                    return 1;
+                }
+                if ((err = gate_validate(&gate_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid command gate `%s': %s\n", optarg, err);
+                    return 1;
+                }
+                break;
+            case 'R':
+                rpm_path = optarg;
+                break;
+            case 'u':
+                api_path = optarg;
+                break;
+            case 'L':
+                if (ctrl_parse_telemetry(optarg, &tel_cfg) != 0) {
+                    fprintf(stderr, "Invalid telemetry log `%s', expected path[:max_mb[:files[:batch[:flush_s]]]].\n", optarg);
+                    return 1;
+                }
+                if ((err = telemetry_validate(&tel_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid telemetry log `%s': %s\n", optarg, err);
+                    return 1;
+                }
+                break;
+            case 'b':
+                memset(&check, 0, sizeof(check));
+                if (ctrl_parse_profile(optarg, &check) != 0) {
+                    fprintf(stderr, "Invalid battery profile `%s'.\n", optarg);
+                    return 1;
+                }
+                battery = optarg;
+                break;
+            case 'W':
+                watchdog = atoi(optarg);
+                if (watchdog < 0 || watchdog > FAN_WATCHDOG_MAX) {
+                    fprintf(stderr, "Watchdog must be between 0 and %d seconds.\n", FAN_WATCHDOG_MAX);
+                    return 1;
+                }
+                break;
+            case 'p':
+                pwm_path = optarg;
+                break;
+            case 'f':
+                if (n_fans >= CTRL_FANS_MAX) {
+                    fprintf(stderr, "No more than %d other fans.\n", CTRL_FANS_MAX);
+                    return 1;
+                }
+                if (ctrl_parse_fan(optarg, &fan_specs[n_fans]) != 0) {
+                    fprintf(stderr, "Invalid fan `%s'.\n", optarg);
+                    return 1;
+                }
+                n_fans++;
+                break;
+            case 'r':
+                root = optarg;
+                break;
+            case 'a':
+                adaptive_ms = atoi(optarg);
+                break;
+            case 'e':
+                use_trips = true;
+                break;
+            case 'm':
+                mock_fan = true;
+                break;
+            case 'v':
+                print_logs = true;
+                break;
+            case 'S':
+                print_stats = true;
+                break;
+            case 'h':
+                print_help(bin);
+                return 0;
+            case '?':
+                print_help(bin);
+                if (isprint(optopt)) {
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                } else {
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                }
+                return 1;
+            default:
+                abort();
+        }
+    }
+    if (interval > 0) {
+        auto_cfg.scan_interval = manual_cfg.scan_interval = curve_cfg.scan = pid_cfg.scan = interval;
+    }
+    if (level >= 0) {
+        auto_cfg.fan_speed = manual_cfg.fan_speed = level;
+    }
+
+    if (sensors_discover(&sensors, root) == 0) {
+        fprintf(stderr, "No temperature sensors found\n");
+        return 1;
+    }
+    if ((ret = fan_open(&fan, root, pwm_path, mock_fan)) != 0) {
+        // unlike the GUI, there's no point in carrying on if we can't control the fan
+        fprintf(stderr, "Unable to open %s fan: %s\n", fan.ops->name, strerror(-ret));
+        sensors_close(&sensors);
+        return 1;
+    }
+    ctrl_init(&ctrl, &fan, &sensors);
+    ctrl.print_logs = print_logs;
+    ctrl.watchdog = watchdog;
+    ctrl_set_adaptive(&ctrl, adaptive_ms);
+    ctrl.gate.cfg = gate_cfg;
+    if (use_filter) {
+        ctrl.filter_cfg = filter_cfg;
+        if (filter_sensors[0] != '\0' && (err = filter_resolve(&ctrl.filter, &sensors, filter_sensors)) != NULL) {
+            fprintf(stderr, "Invalid sensors `%s': %s\n", filter_sensors, err);
+            fan_close(&fan);
+            sensors_close(&sensors);
+            return 1;
+        }
+    }
+    // cheap enough to always collect, so SIGUSR1 has something to show
+    stats_init(&stats);
+    ctrl.stats = &stats;
+    ctrl.auto_cfg = auto_cfg;
+    ctrl.manual_cfg = manual_cfg;
+    ctrl.curve_cfg = curve_cfg;
+    ctrl.pid_cfg = pid_cfg;
+    // validate, and compile the curve tables once
+    if ((err = ctrl_compile(&ctrl, mode)) != NULL) {
+        fprintf(stderr, "Invalid %s config: %s\n", ctrl_mode_name(mode), err);
+        fan_close(&fan);
+        sensors_close(&sensors);
+        return 1;
+    }
+    // API commands compile into this one, it never touches the hardware
+    ctrl_init(&config, NULL, NULL);
+    ctrl_copy_config(&config, &ctrl);
+    config.mode = mode;
+    for (i = 0; i < n_fans; i++) {
+        fan_spec *spec = &fan_specs[i];
+        if ((err = filter_resolve(&chan, &sensors, spec->sensors)) != NULL) {
+            fprintf(stderr, "Invalid sensors `%s' for fan %s: %s\n", spec->sensors, spec->pwm_path, err);
+            ret = -ENOENT;
+        } else if ((ret = fan_open(&fans[i], root, spec->pwm_path, mock_fan)) != 0) {
+            fprintf(stderr, "Unable to open fan %s: %s\n", spec->pwm_path, strerror(-ret));
+        } else if ((err = ctrl_add_fan(&ctrl, &fans[i], &chan, spec->points, spec->n_points)) != NULL) {
+            fprintf(stderr, "Invalid curve for fan %s: %s\n", spec->pwm_path, err);
+            fan_close(&fans[i]);
+            ret = -EINVAL;
+        } else if (print_logs) {
+            printf("Fan %d (%s) follows %s\n", i + 2, spec->pwm_path, spec->sensors);
+        }
+        if (ret != 0) {
+            while (--i >= 0)
+                fan_close(&fans[i]);
+            fan_close(&fan);
+            sensors_close(&sensors);
+            return 1;
+        }
+    }
+    if (battery != NULL) {
+        if ((ret = power_open(&power, root)) != 0) {
+            fprintf(stderr, "No AC adapter to follow, the profile is the same on battery: %s\n", strerror(-ret));
+        } else {
+            ctrl.power = &power;
+            ctrl.battery = battery;
+            if ((err = ctrl_set_profiles(&ctrl, mode)) != NULL) {
+                fprintf(stderr, "Invalid battery profile: %s\n", err);
+                power_close(&power);
+                for (i = 0; i < ctrl.n_fans; i++) {
+                    fan_close(&fans[i]);
+                }
+                fan_close(&fan);
+                sensors_close(&sensors);
+                return 1;
+            }
+            if (print_logs)
+                printf("Running on %s, following the power source\n", power_name(power.source));
+        }
+    }
+
+    if (use_trips) {
+        if ((ret = trip_open(&trips, root)) != 0) {
+            // not fatal, it's what we did before there were triggers
+            fprintf(stderr, "No writable thermal trip points or hwmon alarms, polling: %s\n", strerror(-ret));
+        } else {
+            ctrl.trips = &trips;
+            if (print_logs)
+                printf("Thermal triggers on %s\n", trips.name);
+        }
+    }
+
+    if (use_load) {
+        if ((ret = load_open(&load, root)) != 0) {
+            fprintf(stderr, "Unable to read the CPU load, going by temperature alone: %s\n", strerror(-ret));
+        } else {
+            ctrl.load_cfg = load_cfg;
+            ctrl.load = &load;
+            if (print_logs)
+                printf("Feed-forward on CPU utilisation%s\n", load.energy_fd >= 0 ? " and package power" : "");
+        }
+    }
+
+    // check every level change took, if the fan can tell us how fast it's going
+    if (fan_read_rpm(&fan) >= 0) {
+        rpm_init(&rpm);
+        if (rpm_path != NULL && (ret = rpm_map_load(&rpm.map, rpm_path)) != 0 && ret != -ENOENT)
+            fprintf(stderr, "Unable to load the RPM map from %s: %s\n", rpm_path, strerror(-ret));
+        ctrl.rpm = &rpm;
+    } else if (print_logs) {
+        printf("No RPM readback from the %s fan\n", fan.ops->name);
+    }
+
+    if (api_path != NULL) {
+        if ((ret = api_open(&api, api_path)) != 0) {
+            fprintf(stderr, "Unable to serve the API on %s: %s\n", api_path, strerror(-ret));
+        } else {
+            serving = true;
+            if (print_logs)
+                printf("Serving the API on %s\n", api_path);
+        }
+    }
+    if (tel_cfg.path[0] != '\0') {
+        // not fatal either, the fan matters more than the record of it
+        if ((ret = telemetry_open(&telemetry, &tel_cfg, &sensors)) != 0) {
+            fprintf(stderr, "Unable to open the telemetry log %s: %s\n", tel_cfg.path, strerror(-ret));
+        } else {
+            ctrl.telemetry = &telemetry;
+            if (print_logs)
+                printf("Logging telemetry to %s\n", tel_cfg.path);
+        }
+    }
+    view = (api_view) { .state = &ctrl.state, .sample = &ctrl.sample, .sensors = &sensors };
+
+    // no SA_RESTART: we want poll to return so we can set the fan back to auto
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    ctrl_start(&ctrl, mode);
+    if (print_logs)
+        printf("Running %s control, %d temperature sensors, %s fan\n", ctrl_mode_name(mode), sensors.n_temps, fan.ops->name);
+    next = sched_now_ms();
+    while (!quit) {
+        long long wait, late;
+        unsigned long long ui_start;
+        int ok = ctrl_tick(&ctrl, &res) != -1;
+        next_ms = ctrl_next_interval(&ctrl);
+        // logging is all the UI we have
+        ui_start = stats_now_ns();
+        // a fan without a tachometer has no RPM to show, not a negative one
+        rpm_str[0] = '\0';
+        if (res.rpm >= 0) {
+            snprintf(rpm_str, sizeof(rpm_str), " (%d RPM)", res.rpm);
+        }
+        if (!ok) {
+            fprintf(stderr, "Failed to read CPU temperature\n");
+        } else if (print_logs && ctrl.load != NULL) {
+            printf("CPU Temp: %d C, load %d%% %dW (+%d), Fan level %s%s, next check in %dms\n", res.temp,
+                   load.util, load.watts, ctrl.boost, fan_speeds[res.level], rpm_str, next_ms);
+        } else if (print_logs) {
+            printf("CPU Temp: %d C, Fan level %s%s, next check in %dms\n", res.temp, fan_speeds[res.level], rpm_str, next_ms);
+        }
+        for (i = 0; ok && print_logs && i < ctrl.n_fans; i++) {
+            printf("  Fan %d: %d C, level %s\n", i + 2, ctrl.fans[i].temp, ctrl.fans[i].level < 0 ? "?" : fan_speeds[ctrl.fans[i].level]);
+        }
+        if (ok && serving) {
+            api_publish(&api, &view);
+        }
+        stats_record(&stats, STATS_UI, stats_now_ns() - ui_start);
+        // schedule off the previous deadline, so slow ticks don't make us drift
+        next += next_ms;
+        // signals only wake us up to quit, or to dump the stats, the tick waits for the deadline
+        // unless one of the thermal triggers went off, that's the whole point of having them
+        // and the power source changing: the other profile starts straight away, like a mode the API switched to
+        while (!quit && (wait = next - sched_now_ms()) > 0) {
+            int n_trips = ctrl.trips != NULL ? trip_pollfds(ctrl.trips, pfds) : 0;
+            int n_power = n_trips + (ctrl.power != NULL ? power_pollfds(ctrl.power, pfds + n_trips) : 0);
+            int n_pfds = n_power;
+            if (serving) {
+                pfds[n_pfds++] = (struct pollfd) { .fd = api.epoll_fd, .events = POLLIN };
+            }
+            // in-between samples only go into the filters, they don't end the wait
+            if (poll(pfds, n_pfds, (int) ctrl_sample_timeout(&ctrl, wait)) < 0 && errno != EINTR) {
+                perror("poll");
+                quit = 1;
+                break;
+            }
+            ctrl_sample(&ctrl);
+            if (n_trips > 0 && trip_check(ctrl.trips, pfds)) {
+                next = sched_now_ms();
+            }
+            if (n_power > n_trips && ctrl_power_check(&ctrl, pfds + n_trips)) {
+                ctrl_start(&ctrl, mode);
+                next = sched_now_ms();
+            }
+            if (n_pfds > n_power && pfds[n_power].revents & POLLIN) {
+                api_check(&api, &view, &config, api_mode, &api_req);
+            }
+            if (api_req.changed) {
+                api_req.changed = false;
+                mode = config.mode = api_req.mode;
+                ctrl_copy_config(&ctrl, &config);
+                if (ctrl.power != NULL && (err = ctrl_set_profiles(&ctrl, mode)) != NULL)
+                    fprintf(stderr, "Invalid battery profile, using the AC one: %s\n", err);
+                ctrl_start(&ctrl, mode);
+                if (print_logs)
+                    printf("API: running %s control\n", ctrl_mode_name(mode));
+                next = sched_now_ms();
+            }
+            if (dump_stats) {
+                dump_stats = 0;
+                stats_dump(&stats, stdout);
+            }
+        }
+        late = sched_now_ms() - next;
+        stats_deadline(&stats, late, DEADLINE_SLACK_MS);
+        if (late > 0) {
+            // don't try to catch up with ticks we've missed
+            next = sched_now_ms();
+        }
+    }
+    if (print_logs)
+        printf("Exit, %.1f wakeups per hour\n", sched_wakeups_per_hour(&ctrl.sched));
+    if (print_logs && ctrl.trips != NULL)
+        printf("Woken up by thermal triggers %lu times\n", trips.crossings);
+    if (print_logs && ctrl.rpm != NULL) {
+        rpm_map_format(&rpm.map, map_str, sizeof(map_str));
+        printf("Level to RPM: %s, %lu rewrites, %lu stalls, %lu mismatches\n", map_str, rpm.retried, rpm.stalls, rpm.mismatches);
+    }
+    if (print_logs && ctrl.power != NULL)
+        printf("Power source changed %lu times\n", power.changes);
+    if (print_logs)
+        ctrl_gate_dump(&ctrl, stdout);
+    if (ctrl.telemetry != NULL) {
+        // the writer is done after this, its counters are ours to read
+        telemetry_close(&telemetry);
+        if (print_logs)
+            printf("Telemetry: %lu records, %lu dropped, %lu writes, %lu rotations\n", telemetry.records, telemetry.dropped, telemetry.writes, telemetry.rotations);
+    }
+    if (print_stats)
+        stats_dump(&stats, stdout);
+    ctrl_stop(&ctrl);
+    if (ctrl.rpm != NULL && rpm_path != NULL && (ret = rpm_map_save(&rpm.map, rpm_path)) != 0)
+        fprintf(stderr, "Unable to save the RPM map to %s: %s\n", rpm_path, strerror(-ret));
+    if (ctrl.trips != NULL)
+        trip_close(&trips);
+    if (ctrl.load != NULL)
+        load_close(&load);
+    if (ctrl.power != NULL)
+        power_close(&power);
+    if (serving)
+        api_close(&api);
+    for (i = 0; i < ctrl.n_fans; i++) {
+        fan_close(&fans[i]);
+    }
+    fan_close(&fan);
+    sensors_close(&sensors);
+    return 0;
+}
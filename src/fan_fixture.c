@@ -0,0 +1,821 @@
+/*
+ThinkPad Fan Control - fake procfs/sysfs fixture
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Builds a directory tree that looks like thinkpad_acpi, a thermal zone, and a couple of hwmon
+devices, and keeps it alive: a simple thermal model heats up according to a load script, and cools
+down according to whatever fan level was last written (to the fan file, or the hwmon pwm files).
+Point the GUI or the daemon at it with -r, and the whole control loop runs on any Linux box,
+without root, and without a ThinkPad.
+
+ThinkPad fan control is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+version 2 as published by the Free Software Foundation. See main.c and LICENCE
+*/
+#define _GNU_SOURCE // nftw
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "fan.h"
+#include "sensors.h"
+#include "paths.h"
+#include "load.h"
+#include "power.h"
+
+#define FIX_STEP_MS 100 // real time between model steps
+#define FIX_HWMON_DIR HWMON_PATH "/hwmon0"
+#define FIX_CORETEMP_DIR HWMON_PATH "/hwmon1"
+#define FIX_ZONE_DIR THERMAL_ZONE_PATH "/thermal_zone0"
+#define FIX_ZONE_DEVPATH "/devices/virtual/thermal/thermal_zone0"
+#define FIX_ZONE_TRIPS 2
+#define FIX_RAPL_DIR RAPL_PATH "/intel-rapl:0"
+#define FIX_AC_DIR POWER_SUPPLY_PATH "/AC"
+#define FIX_AC_DEVPATH "/devices/LNXSYSTM:00/LNXSYBUS:00/ACPI0003:00/power_supply/AC"
+// the thermal model: dT/dt = heat - cooling * (T - ambient), cooling goes up with the airflow
+#define FIX_AMBIENT 30.0
+#define FIX_HEAT_IDLE 0.1  // degrees C per second at no load
+#define FIX_HEAT_LOAD 0.55 // extra at full load
+#define FIX_COOL_PASSIVE 0.010
+#define FIX_COOL_FAN 0.005 // extra at full airflow
+#define FIX_RPM_MAX 5000
+#define FIX_SPIN_S 1.5 // time constant of the fan getting up to (or down from) speed
+#define FIX_RPM_STEP 50 // the RPM files are only rewritten when it changed by this much
+// what the load looks like from /proc/stat and RAPL, both count in simulated time
+#define FIX_CPUS 4
+#define FIX_HZ 100 // USER_HZ, jiffies per second
+#define FIX_WATTS_IDLE 3.0
+#define FIX_WATTS_LOAD 22.0 // extra at full load
+#define FIX_ENERGY_RANGE 262143328850LL // wraps around like the real thing, in uJ
+#define FIX_SCRIPT_MAX 256
+#define FIX_WATCHDOG_MAX 120
+
+// load from this many (simulated) seconds on, until the next step
+typedef struct _load_step {
+    double time, load;
+} load_step;
+
+typedef enum _fan_source {
+    FAN_SRC_EC,     // auto: the embedded controller decides
+    FAN_SRC_LEVEL,  // thinkpad_acpi level 1-7, full-speed or disengaged
+    FAN_SRC_PWM,    // hwmon pwm1, manual
+} fan_source;
+
+typedef struct _fixture {
+    char root[PATH_MAX];
+    // files the model keeps up to date, or that the controllers write to
+    int thermal_fd, zone_fd, hwmon_temp_fd, core_temp_fd, rpm_fd, fan_fd, pwm_fd, enable_fd, stat_fd, energy_fd, online_fd;
+    int trip_fds[FIX_ZONE_TRIPS];
+    int inotify_fd, fan_wd, pwm_wd, enable_wd;
+    off_t fan_pos;        // the fan file is the status, then the commands as they were written, we've seen up to here
+    // fan state, through either interface, the last write wins
+    fan_source source;
+    int level, pwm, pwm_enable;
+    bool disengaged;
+    int watchdog;         // seconds, 0 is off
+    double watchdog_at;   // simulated time the watchdog goes off (the timeout in real seconds)
+    // the model
+    load_step script[FIX_SCRIPT_MAX];
+    int n_steps;
+    bool loop;
+    double time, temp, speed;
+    double rpm;           // what the fan actually does, it lags behind what it was told
+    int shown_rpm;        // what the files say right now
+    double dead_at;       // simulated time the fan stalls for good, 0 for never
+    double busy, idle, energy; // jiffies, and uJ
+    double ac_every;      // simulated seconds between pulling the AC adapter and plugging it back in, 0 for never
+    bool on_ac;
+    int shown;            // whole degrees in the files right now
+    double shown_since;   // since when
+    // what happened
+    int crit;
+    unsigned long commands, invalid, trip_events;
+    double crit_time, max_temp;
+    bool verbose;
+} fixture;
+
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int sig) {
+    quit = 1;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// replace the whole file, readers keep their descriptors, so it has to be in place
+static int write_file(int fd, const char *buf, size_t len) {
+    if (pwrite(fd, buf, len, 0) != (ssize_t) len || ftruncate(fd, len) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int read_file(int fd, char *buf, size_t len) {
+    ssize_t n = pread(fd, buf, len - 1, 0);
+    if (n < 0) {
+        return -errno;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+// mkdir -p root/dir
+static int make_dirs(const char *root, const char *dir) {
+    char path[PATH_MAX], *p;
+    if (root_path(path, sizeof(path), root, dir) != 0) {
+        return -ENAMETOOLONG;
+    }
+    for (p = path + strlen(root) + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+                return -errno;
+            }
+            if (c == '\0') {
+                return 0;
+            }
+            *p = c;
+        }
+    }
+}
+
+// create root/dir/name with the given content, returns the (read-write) descriptor, or -errno
+static int make_file(fixture *fix, const char *dir, const char *name, const char *content) {
+    char rel[PATH_MAX], path[PATH_MAX];
+    int fd, ret;
+    if ((ret = make_dirs(fix->root, dir)) != 0) {
+        return ret;
+    }
+    snprintf(rel, sizeof(rel), "%s/%s", dir, name);
+    if (root_path(path, sizeof(path), fix->root, rel) != 0) {
+        return -ENAMETOOLONG;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return -errno;
+    }
+    if ((ret = write_file(fd, content, strlen(content))) != 0) {
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+// same, for files nobody writes to after we've created them
+static int make_static(fixture *fix, const char *dir, const char *name, const char *content) {
+    int fd = make_file(fix, dir, name, content);
+    if (fd < 0) {
+        return fd;
+    }
+    close(fd);
+    return 0;
+}
+
+static int watch(fixture *fix, const char *dir, const char *name) {
+    char rel[PATH_MAX], path[PATH_MAX];
+    snprintf(rel, sizeof(rel), "%s/%s", dir, name);
+    if (root_path(path, sizeof(path), fix->root, rel) != 0) {
+        return -1;
+    }
+    return inotify_add_watch(fix->inotify_fd, path, IN_MODIFY);
+}
+
+// the level the EC would pick: off when cool, up a level every 6 degrees from 40
+static int ec_level(double temp) {
+    int level = (int) (temp - 40) / 6;
+    return level < 0 ? 0 : (level > 7 ? 7 : level);
+}
+
+// 0 (fan off) to 1 (full speed), disengaged goes a bit beyond that
+static double airflow(const fixture *fix) {
+    switch (fix->source) {
+        case FAN_SRC_PWM:
+            return fix->pwm / 255.0;
+        case FAN_SRC_LEVEL:
+            if (fix->disengaged) {
+                return 1.1;
+            }
+            return fix->level >= FAN_LVL_FULL ? 1.0 : fix->level * 0.9 / 7;
+        default:
+            return ec_level(fix->temp) * 0.9 / 7;
+    }
+}
+
+static const char *level_name(const fixture *fix) {
+    static char buf[12];
+    if (fix->source == FAN_SRC_EC) {
+        return "auto";
+    }
+    // the level the duty cycle stands for, as fan.c maps them: 1-7 below 255, full speed at 255
+    if (fix->source == FAN_SRC_PWM && fix->pwm >= 255) {
+        return "full-speed";
+    }
+    if (fix->source == FAN_SRC_PWM) {
+        snprintf(buf, sizeof(buf), "%d", (fix->pwm * FAN_LVL_FULL + 127) / 255);
+        return buf;
+    }
+    if (fix->disengaged) {
+        return "disengaged";
+    }
+    if (fix->level >= FAN_LVL_FULL) {
+        return "full-speed";
+    }
+    snprintf(buf, sizeof(buf), "%d", fix->level);
+    return buf;
+}
+
+// what thinkpad_acpi shows when you read the fan file. Always the same length, so it's rewritten
+// in place without touching the commands written after it
+static void write_fan_status(fixture *fix) {
+    char buf[512];
+    int len = snprintf(buf, sizeof(buf),
+                       "status:\t\tenabled\n"
+                       "speed:\t\t%-6d\n"
+                       "level:\t\t%-10s\n"
+                       "commands:\tlevel <level> (<level> is 0-7, auto, disengaged, full-speed)\n"
+                       "commands:\tenable, disable\n"
+                       "commands:\twatchdog <timeout> (<timeout> is 0 (off), 1-120 (seconds))\n",
+                       fix->shown_rpm, level_name(fix));
+    if (pwrite(fix->fan_fd, buf, len, 0) != len) {
+        return;
+    }
+    // the first time, or after a shell's > truncated the file: the commands start after the status
+    if (fix->fan_pos < len) {
+        fix->fan_pos = len;
+    }
+}
+
+static void write_temps(fixture *fix) {
+    char buf[64];
+    int len, temp = fix->shown;
+    // thinkpad_acpi: CPU first, unused slots are -128
+    len = snprintf(buf, sizeof(buf), "temperatures:\t%d %d -128 -128 -128 -128 -128 -128\n", temp, temp - 10);
+    write_file(fix->thermal_fd, buf, len);
+    len = snprintf(buf, sizeof(buf), "%d\n", (temp + 2) * 1000);
+    write_file(fix->zone_fd, buf, len);
+    write_file(fix->core_temp_fd, buf, len);
+    len = snprintf(buf, sizeof(buf), "%d\n", temp * 1000);
+    write_file(fix->hwmon_temp_fd, buf, len);
+}
+
+static void write_rpm(fixture *fix) {
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%d\n", fix->shown_rpm);
+    write_file(fix->rpm_fd, buf, len);
+}
+
+static void write_load(fixture *fix) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "cpu  %llu 0 0 %llu 0 0 0 0 0 0\nintr 0\n",
+                       (unsigned long long) fix->busy, (unsigned long long) fix->idle);
+    write_file(fix->stat_fd, buf, len);
+    len = snprintf(buf, sizeof(buf), "%lld\n", (long long) fix->energy % FIX_ENERGY_RANGE);
+    write_file(fix->energy_fd, buf, len);
+}
+
+static void log_command(fixture *fix, const char *cmd, bool ok) {
+    fix->commands++;
+    if (!ok) {
+        fix->invalid++;
+    }
+    // how long the temperature that triggered this (most likely) has been in the files: the reaction time
+    printf("[%8.1fs] %dC (for %.1fs) %s: \"%s\"%s\n", fix->time, fix->shown, fix->time - fix->shown_since,
+           level_name(fix), cmd, ok ? "" : " INVALID (EINVAL)");
+}
+
+// one command, which the kernel would act on (or reject with EINVAL)
+static void fan_apply(fixture *fix, char *cmd) {
+    char *arg, *end;
+    long val;
+    bool ok = true;
+    cmd += strspn(cmd, " \t");
+    if (*cmd == '\0') {
+        return;
+    }
+    arg = strchr(cmd, ' ');
+    if (arg != NULL) {
+        *arg++ = '\0';
+    }
+    if (strcmp(cmd, "level") == 0 && arg != NULL) {
+        val = strtol(arg, &end, 10);
+        if (strcmp(arg, "auto") == 0) {
+            fix->source = FAN_SRC_EC;
+        } else if (strcmp(arg, "full-speed") == 0 || strcmp(arg, "disengaged") == 0) {
+            fix->source = FAN_SRC_LEVEL;
+            fix->level = FAN_LVL_FULL;
+            fix->disengaged = arg[0] == 'd';
+        } else if (end != arg && *end == '\0' && val >= 0 && val <= 7) {
+            fix->source = FAN_SRC_LEVEL;
+            fix->level = val;
+            fix->disengaged = false;
+        } else {
+            ok = false;
+        }
+    } else if (strcmp(cmd, "enable") == 0) {
+        fix->source = FAN_SRC_EC;
+    } else if (strcmp(cmd, "disable") == 0) {
+        fix->source = FAN_SRC_LEVEL;
+        fix->level = 0;
+        fix->disengaged = false;
+    } else if (strcmp(cmd, "watchdog") == 0 && arg != NULL && (val = strtol(arg, &end, 10)) >= 0 && val <= FIX_WATCHDOG_MAX && end != arg && *end == '\0') {
+        fix->watchdog = val;
+    } else {
+        ok = false;
+    }
+    // any command re-arms the watchdog, its timer runs on the wall clock, like the controllers that feed it
+    if (fix->watchdog > 0) {
+        fix->watchdog_at = fix->time + fix->watchdog * fix->speed;
+    }
+    if (arg != NULL) {
+        arg[-1] = ' ';
+    }
+    log_command(fix, cmd, ok);
+}
+
+// writes to the fan file: every command since the last time, not just the last one, two of them often
+// come in the same tick (a level, then the watchdog). Like thinkpad_acpi, a write can hold more than one,
+// separated by commas
+static void fan_command(fixture *fix) {
+    char buf[512], *line, *cmd, *lines, *cmds, *end;
+    struct stat st;
+    ssize_t n;
+    size_t len;
+    bool seen = false;
+    if (fstat(fix->fan_fd, &st) != 0) {
+        return;
+    }
+    // echo level 7 > fan: the file was truncated, whatever is in it now is the command
+    if (st.st_size < fix->fan_pos) {
+        fix->fan_pos = 0;
+    }
+    while ((n = pread(fix->fan_fd, buf, sizeof(buf) - 1, fix->fan_pos)) > 0) {
+        buf[n] = '\0';
+        // whole lines, unless there's no end to this one
+        end = memrchr(buf, '\n', n);
+        len = end != NULL ? (size_t) (end - buf) + 1 : (size_t) n;
+        buf[len] = '\0';
+        fix->fan_pos += len;
+        for (line = strtok_r(buf, "\n", &lines); line != NULL; line = strtok_r(NULL, "\n", &lines)) {
+            for (cmd = strtok_r(line, ",", &cmds); cmd != NULL; cmd = strtok_r(NULL, ",", &cmds)) {
+                fan_apply(fix, cmd);
+            }
+        }
+        seen = true;
+    }
+    // or it was our own status update
+    if (seen) {
+        write_fan_status(fix);
+        write_rpm(fix);
+    }
+}
+
+// a write to pwm1 or pwm1_enable
+static void pwm_command(fixture *fix, int fd, int *value, const char *name) {
+    char buf[32], cmd[48];
+    int val;
+    if (read_file(fd, buf, sizeof(buf)) <= 0 || sscanf(buf, "%d", &val) != 1 || val == *value) {
+        // our own write, or nothing changed
+        return;
+    }
+    *value = val;
+    if (fix->pwm_enable == 1) {
+        fix->source = FAN_SRC_PWM;
+    } else if (fix->pwm_enable == 0) {
+        // no fan speed control: full speed
+        fix->source = FAN_SRC_LEVEL;
+        fix->level = FAN_LVL_FULL;
+        fix->disengaged = false;
+    } else {
+        fix->source = FAN_SRC_EC;
+    }
+    snprintf(cmd, sizeof(cmd), "%s %d", name, val);
+    log_command(fix, cmd, true);
+    write_fan_status(fix);
+    write_rpm(fix);
+}
+
+static void handle_events(fixture *fix) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n = read(fix->inotify_fd, buf, sizeof(buf));
+    char *p;
+    for (p = buf; n > 0 && p < buf + n; p += sizeof(*ev) + ev->len) {
+        ev = (const struct inotify_event *) p;
+        if (ev->wd == fix->fan_wd) {
+            fan_command(fix);
+        } else if (ev->wd == fix->pwm_wd) {
+            pwm_command(fix, fix->pwm_fd, &fix->pwm, "pwm1");
+        } else if (ev->wd == fix->enable_wd) {
+            pwm_command(fix, fix->enable_fd, &fix->pwm_enable, "pwm1_enable");
+        }
+    }
+}
+
+static double script_load(const fixture *fix) {
+    double t = fix->time, end = fix->script[fix->n_steps - 1].time;
+    int i;
+    if (fix->loop && end > 0 && t >= end) {
+        t -= end * (long) (t / end);
+    }
+    for (i = fix->n_steps - 1; i > 0 && fix->script[i].time > t; i--) {
+    }
+    return fix->script[i].load;
+}
+
+// what the kernel broadcasts when a device changes, only root gets to pretend to be the kernel
+// env is the rest of the environment, the variables separated by newlines
+static void send_uevent(const char *devpath, const char *subsystem, const char *env) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    char msg[512];
+    int i, len, fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    static bool warned = false;
+    // action@devpath, then the environment, NUL separated
+    len = snprintf(msg, sizeof(msg), "change@%s\nACTION=change\nDEVPATH=%s\nSUBSYSTEM=%s\n%s", devpath, devpath, subsystem, env) + 1;
+    len = len > (int) sizeof(msg) ? (int) sizeof(msg) : len;
+    for (i = 0; i < len; i++) {
+        if (msg[i] == '\n') {
+            msg[i] = '\0';
+        }
+    }
+    if (fd < 0 || sendto(fd, msg, len, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (!warned)
+            perror("uevent (the controllers won't notice)");
+        warned = true;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void send_ac_uevent(const fixture *fix) {
+    char env[64];
+    snprintf(env, sizeof(env), "POWER_SUPPLY_NAME=AC\nPOWER_SUPPLY_ONLINE=%d", fix->on_ac);
+    send_uevent(FIX_AC_DEVPATH, "power_supply", env);
+}
+
+// the zone temperature went from prev_mc to mc: a trip point set in between was crossed,
+// and (like the user_space governor) the kernel sends a change uevent for the zone
+static void check_trips(fixture *fix, int prev_mc, int mc) {
+    char buf[32], env[64];
+    int k, trip_mc;
+    for (k = 0; k < FIX_ZONE_TRIPS; k++) {
+        if (read_file(fix->trip_fds[k], buf, sizeof(buf)) <= 0 || (trip_mc = atoi(buf)) <= 0) {
+            continue;
+        }
+        if ((prev_mc < trip_mc && mc >= trip_mc) || (prev_mc >= trip_mc && mc < trip_mc)) {
+            snprintf(env, sizeof(env), "NAME=x86_pkg_temp\nTEMP=%d\nTRIP=%d", mc, k);
+            send_uevent(FIX_ZONE_DEVPATH, "thermal", env);
+            fix->trip_events++;
+            printf("[%8.1fs] trip point %d (%dC) crossed %s\n", fix->time, k, trip_mc / 1000, mc >= trip_mc ? "going up" : "going down");
+        }
+    }
+}
+
+static void step_ac(fixture *fix) {
+    char buf[4];
+    bool on_ac = (long) (fix->time / fix->ac_every) % 2 == 0;
+    if (on_ac == fix->on_ac) {
+        return;
+    }
+    fix->on_ac = on_ac;
+    snprintf(buf, sizeof(buf), "%d\n", on_ac);
+    write_file(fix->online_fd, buf, strlen(buf));
+    send_ac_uevent(fix);
+    printf("[%8.1fs] AC adapter %s\n", fix->time, on_ac ? "plugged in" : "pulled");
+}
+
+static void model_step(fixture *fix, double dt) {
+    double target = fix->dead_at > 0 && fix->time >= fix->dead_at ? 0 : airflow(fix) * FIX_RPM_MAX;
+    double cooling, load = script_load(fix), heat = FIX_HEAT_IDLE + FIX_HEAT_LOAD * load;
+    int shown, prev;
+    fix->rpm += (target - fix->rpm) * (dt < FIX_SPIN_S ? dt / FIX_SPIN_S : 1);
+    if (abs((int) fix->rpm - fix->shown_rpm) >= FIX_RPM_STEP || (target == 0 && fix->shown_rpm != 0 && fix->rpm < FIX_RPM_STEP)) {
+        // anything a controller wrote to the fan file first, or our status would overwrite it
+        handle_events(fix);
+        fix->shown_rpm = target == 0 && fix->rpm < FIX_RPM_STEP ? 0 : (int) fix->rpm;
+        write_fan_status(fix);
+        write_rpm(fix);
+    }
+    cooling = FIX_COOL_PASSIVE + FIX_COOL_FAN * fix->rpm / FIX_RPM_MAX;
+    fix->temp += (heat - cooling * (fix->temp - FIX_AMBIENT)) * dt;
+    // the load shows up in the counters straight away, the temperature takes its time
+    fix->busy += load * FIX_CPUS * FIX_HZ * dt;
+    fix->idle += (1 - load) * FIX_CPUS * FIX_HZ * dt;
+    fix->energy += (FIX_WATTS_IDLE + FIX_WATTS_LOAD * load) * 1e6 * dt;
+    write_load(fix);
+    fix->time += dt;
+    if (fix->ac_every > 0) {
+        step_ac(fix);
+    }
+    if (fix->temp > fix->max_temp) {
+        fix->max_temp = fix->temp;
+    }
+    if (fix->temp >= fix->crit) {
+        fix->crit_time += dt;
+    }
+    if (fix->watchdog > 0 && fix->time >= fix->watchdog_at && fix->source != FAN_SRC_EC) {
+        // nobody told us anything for too long, the kernel hands the fan back to the EC
+        fix->source = FAN_SRC_EC;
+        printf("[%8.1fs] watchdog expired, fan back to auto\n", fix->time);
+        write_fan_status(fix);
+    }
+    shown = (int) fix->temp;
+    if (shown != fix->shown) {
+        prev = fix->shown;
+        fix->shown = shown;
+        fix->shown_since = fix->time;
+        write_temps(fix);
+        // once the new temperature is there to read, the zone reads 2 degrees above thinkpad_acpi
+        check_trips(fix, (prev + 2) * 1000, (shown + 2) * 1000);
+        // the EC reacts to the temperature, and so does the RPM
+        write_rpm(fix);
+        if (fix->verbose) {
+            printf("[%8.1fs] %dC, load %.0f%%, fan %s\n", fix->time, shown, script_load(fix) * 100, level_name(fix));
+        }
+    }
+}
+
+// seconds and load percentage per line, the load holds until the next line
+static int load_script(fixture *fix, const char *path) {
+    char line[256];
+    double time, load;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -errno;
+    }
+    fix->n_steps = 0;
+    while (fgets(line, sizeof(line), fp) != NULL && fix->n_steps < FIX_SCRIPT_MAX) {
+        if (sscanf(line, "%lf%*[ \t,]%lf", &time, &load) != 2) {
+            continue;
+        }
+        fix->script[fix->n_steps].time = time;
+        fix->script[fix->n_steps].load = load / 100;
+        fix->n_steps++;
+    }
+    fclose(fp);
+    return fix->n_steps > 0 ? 0 : -EINVAL;
+}
+
+static int build_tree(fixture *fix) {
+    char buf[16];
+    int ret;
+    fix->shown = (int) fix->temp;
+    if ((fix->thermal_fd = make_file(fix, "/proc/acpi/ibm", "thermal", "")) < 0) {
+        return fix->thermal_fd;
+    }
+    if ((fix->fan_fd = make_file(fix, "/proc/acpi/ibm", "fan", "")) < 0) {
+        return fix->fan_fd;
+    }
+    if ((ret = make_static(fix, FIX_ZONE_DIR, "type", "x86_pkg_temp\n")) != 0) {
+        return ret;
+    }
+    if ((fix->zone_fd = make_file(fix, FIX_ZONE_DIR, "temp", "")) < 0) {
+        return fix->zone_fd;
+    }
+    // like x86_pkg_temp_thermal: two passive trips, no cooling device bound to them, for fan_control -e to move
+    if ((ret = make_static(fix, FIX_ZONE_DIR, "trip_point_0_type", "passive\n")) != 0 || (ret = make_static(fix, FIX_ZONE_DIR, "trip_point_1_type", "passive\n")) != 0) {
+        return ret;
+    }
+    // we read them back on every degree, to send the uevents the kernel would
+    if ((fix->trip_fds[0] = make_file(fix, FIX_ZONE_DIR, "trip_point_0_temp", "0\n")) < 0) {
+        return fix->trip_fds[0];
+    }
+    if ((fix->trip_fds[1] = make_file(fix, FIX_ZONE_DIR, "trip_point_1_temp", "0\n")) < 0) {
+        return fix->trip_fds[1];
+    }
+    // thinkpad_acpi's own hwmon device: a temperature, the fan speed, and the pwm interface
+    if ((ret = make_static(fix, FIX_HWMON_DIR, "name", "thinkpad\n")) != 0) {
+        return ret;
+    }
+    if ((fix->hwmon_temp_fd = make_file(fix, FIX_HWMON_DIR, "temp1_input", "")) < 0) {
+        return fix->hwmon_temp_fd;
+    }
+    if ((fix->rpm_fd = make_file(fix, FIX_HWMON_DIR, "fan1_input", "")) < 0) {
+        return fix->rpm_fd;
+    }
+    snprintf(buf, sizeof(buf), "%d\n", fix->pwm);
+    if ((fix->pwm_fd = make_file(fix, FIX_HWMON_DIR, "pwm1", buf)) < 0) {
+        return fix->pwm_fd;
+    }
+    snprintf(buf, sizeof(buf), "%d\n", fix->pwm_enable);
+    if ((fix->enable_fd = make_file(fix, FIX_HWMON_DIR, "pwm1_enable", buf)) < 0) {
+        return fix->enable_fd;
+    }
+    // and coretemp, with a label
+    if ((ret = make_static(fix, FIX_CORETEMP_DIR, "name", "coretemp\n")) != 0) {
+        return ret;
+    }
+    if ((ret = make_static(fix, FIX_CORETEMP_DIR, "temp1_label", "Package id 0\n")) != 0) {
+        return ret;
+    }
+    if ((fix->core_temp_fd = make_file(fix, FIX_CORETEMP_DIR, "temp1_input", "")) < 0) {
+        return fix->core_temp_fd;
+    }
+    // the CPU load, and the package energy counter, for fan_control -F
+    if ((fix->stat_fd = make_file(fix, "/proc", "stat", "")) < 0) {
+        return fix->stat_fd;
+    }
+    if ((ret = make_static(fix, FIX_RAPL_DIR, "name", "package-0\n")) != 0) {
+        return ret;
+    }
+    snprintf(buf, sizeof(buf), "%lld\n", FIX_ENERGY_RANGE);
+    if ((ret = make_static(fix, FIX_RAPL_DIR, "max_energy_range_uj", buf)) != 0) {
+        return ret;
+    }
+    if ((fix->energy_fd = make_file(fix, FIX_RAPL_DIR, "energy_uj", "")) < 0) {
+        return fix->energy_fd;
+    }
+    // an AC adapter, plugged in, for fan_control -b
+    if ((ret = make_static(fix, FIX_AC_DIR, "type", "Mains\n")) != 0) {
+        return ret;
+    }
+    if ((fix->online_fd = make_file(fix, FIX_AC_DIR, "online", "1\n")) < 0) {
+        return fix->online_fd;
+    }
+    write_temps(fix);
+    write_fan_status(fix);
+    write_rpm(fix);
+    write_load(fix);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+void print_help(char const *bin) {
+    printf("%s Usage:\n\
+            -d <dir> : Build the tree in <dir> (default: a new directory in /tmp, removed on exit)\n\
+            -s <file> : Load script, one \"seconds load%%\" pair per line (default: 1 minute idle, 5 minutes full load, 5 minutes idle)\n\
+            -L : Loop the load script\n\
+            -T <temp> : Starting temperature (default 40)\n\
+            -x <factor> : Run the model this many times faster than real time (default 1)\n\
+            -t <seconds> : Stop after this many simulated seconds (default: run until killed)\n\
+            -c <temp> : Count time spent at or above this temperature (default 80)\n\
+            -D <seconds> : The fan stalls after this many simulated seconds, and never turns again\n\
+            -A <seconds> : Pull the AC adapter after this many simulated seconds, plug it back in after as many again, and so on (the uevents need root)\n\
+            -n : Just build the tree and exit, nothing keeps it up to date\n\
+            -k : Keep the directory on exit\n\
+            -v : Verbose, print every temperature change\n\
+            -h : Help - display this message\n", bin);
+}
+
+int main(int argc, char **argv) {
+    bool once = false, keep = false, made_dir = false;
+    int c, ret;
+    double duration = 0;
+    long long next;
+    char const *bin = argv[0], *dir = NULL, *script = NULL;
+    struct sigaction sa;
+    struct pollfd pfd;
+    static fixture fix = {
+        .temp = 40,
+        .speed = 1,
+        .crit = 80,
+        .pwm_enable = 2,
+        .source = FAN_SRC_EC,
+        .inotify_fd = -1,
+        .on_ac = true,
+        // idle for a minute, then full load for 5 minutes, then idle again
+        .script = {
+            { 0, 0.05 },
+            { 60, 1 },
+            { 360, 0.05 },
+            { 660, 0.05 },
+        },
+        .n_steps = 4,
+    };
+
+    while ((c = getopt(argc, argv, "d:s:LT:x:t:c:D:A:nkvh")) != -1) {
+        switch (c) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 's':
+                script = optarg;
+                break;
+            case 'L':
+                fix.loop = true;
+                break;
+            case 'T':
+                fix.temp = atof(optarg);
+                break;
+            case 'x':
+                fix.speed = atof(optarg);
+                break;
+            case 't':
+                duration = atof(optarg);
+                break;
+            case 'c':
+                fix.crit = atoi(optarg);
+                break;
+            case 'D':
+                fix.dead_at = atof(optarg);
+                break;
+            case 'A':
+                fix.ac_every = atof(optarg);
+                break;
+            case 'n':
+                once = true;
+                break;
+            case 'k':
+                keep = true;
+                break;
+            case 'v':
+                fix.verbose = true;
+                break;
+            case 'h':
+                print_help(bin);
+                return 0;
+            case '?':
+                print_help(bin);
+                if (isprint(optopt)) {
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                } else {
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                }
+                return 1;
+            default:
+                abort();
+        }
+    }
+    if (script != NULL && (ret = load_script(&fix, script)) != 0) {
+        fprintf(stderr, "Unable to load script %s: %s\n", script, strerror(-ret));
+        return 1;
+    }
+    if (fix.speed <= 0) {
+        fix.speed = 1;
+    }
+    if (dir != NULL) {
+        snprintf(fix.root, sizeof(fix.root), "%s", dir);
+    } else {
+        snprintf(fix.root, sizeof(fix.root), "/tmp/fan_fixture.XXXXXX");
+        if (mkdtemp(fix.root) == NULL) {
+            perror("mkdtemp");
+            return 1;
+        }
+        made_dir = true;
+    }
+    if ((ret = build_tree(&fix)) != 0) {
+        fprintf(stderr, "Unable to build the tree in %s: %s\n", fix.root, strerror(-ret));
+        return 1;
+    }
+    printf("%s\n", fix.root);
+    if (once) {
+        return 0;
+    }
+    fflush(stdout);
+
+    fix.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fix.inotify_fd < 0 || (fix.fan_wd = watch(&fix, "/proc/acpi/ibm", "fan")) < 0
+        || (fix.pwm_wd = watch(&fix, FIX_HWMON_DIR, "pwm1")) < 0 || (fix.enable_wd = watch(&fix, FIX_HWMON_DIR, "pwm1_enable")) < 0) {
+        perror("inotify");
+        return 1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    // the controllers might be reading our stdout through a pipe
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    pfd.fd = fix.inotify_fd;
+    pfd.events = POLLIN;
+    next = now_ms() + FIX_STEP_MS;
+    while (!quit && (duration <= 0 || fix.time < duration)) {
+        long long wait = next - now_ms();
+        if (poll(&pfd, 1, wait > 0 ? (int) wait : 0) > 0) {
+            handle_events(&fix);
+        }
+        if (now_ms() >= next) {
+            model_step(&fix, FIX_STEP_MS / 1000.0 * fix.speed);
+            next += FIX_STEP_MS;
+        }
+    }
+    printf("Ran %.0fs: %lu commands (%lu invalid), %lu trip crossings, max %.1fC, %.0fs at or above %dC\n",
+           fix.time, fix.commands, fix.invalid, fix.trip_events, fix.max_temp, fix.crit_time, fix.crit);
+    close(fix.inotify_fd);
+    if (made_dir && !keep) {
+        nftw(fix.root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    // like a failed test: something was asked of the fan that the kernel would have refused
+    return fix.invalid > 0 ? 2 : 0;
+}
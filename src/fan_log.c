@@ -0,0 +1,447 @@
+/*
+ThinkPad Fan Control - telemetry log reader
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Reads the binary telemetry log the GUI and the daemon write with -L, straight out of a mapping of
+each file, and prints it as CSV, as a summary, or as the "seconds temp level" lines fan_tune takes.
+Rotated files are read in the order they're given, oldest first: log.3 log.2 log.1 log
+
+ThinkPad fan control is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+version 2 as published by the Free Software Foundation. See main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "core.h"
+
+// records further apart than this are a gap (suspend, the daemon not running), not time spent at a level
+#define LOG_GAP_S 60
+// CSV goes out in chunks this big, one fwrite per chunk
+#define LOG_OUT_SIZE (1 << 16)
+
+typedef enum _log_format {
+    LOG_CSV,
+    LOG_SUMMARY,
+    LOG_TUNE,
+} log_format;
+
+// a file, mapped
+typedef struct _log_file {
+    const char *path;
+    unsigned char *map;
+    size_t size, count; // count whole records, a partial one at the end is left out
+    const telemetry_header *header;
+} log_file;
+
+// everything -s prints, time in ms
+typedef struct _log_summary {
+    unsigned long records, failed, gaps, events[CTRL_FAN_MISMATCH + 1];
+    long long first_ms, last_ms, gap_ms, mode_ms[CTRL_PID + 1], level_ms[FAN_LVL_FULL + 1];
+    long long rpm_sum[FAN_LVL_FULL + 1];
+    unsigned long rpm_count[FAN_LVL_FULL + 1];
+    int temp_min, temp_max;
+    long long temp_sum;
+    unsigned long temp_count;
+    int sensor_min[SENSOR_MAX], sensor_max[SENSOR_MAX];
+    long long sensor_sum[SENSOR_MAX];
+    unsigned long sensor_count[SENSOR_MAX];
+} log_summary;
+
+typedef struct _log_out {
+    char buf[LOG_OUT_SIZE];
+    size_t len;
+} log_out;
+
+static int log_map(log_file *file, const char *path) {
+    struct stat st;
+    const telemetry_header *h;
+    int fd, ret = 0;
+    memset(file, 0, sizeof(*file));
+    file->path = path;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) != 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    if (st.st_size < (off_t) sizeof(telemetry_header)) {
+        close(fd);
+        return -EINVAL;
+    }
+    file->size = st.st_size;
+    file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps the file open
+    close(fd);
+    if (file->map == MAP_FAILED) {
+        file->map = NULL;
+        return -errno;
+    }
+    madvise(file->map, file->size, MADV_SEQUENTIAL);
+    h = (const telemetry_header *) file->map;
+    if (memcmp(h->magic, TELEMETRY_MAGIC, sizeof(h->magic)) != 0 || h->version != TELEMETRY_VERSION
+        || h->n_temps > SENSOR_MAX || h->header_size < sizeof(*h) || h->header_size > file->size
+        || h->record_size != telemetry_record_size(h->n_temps)) {
+        munmap(file->map, file->size);
+        file->map = NULL;
+        return -EINVAL;
+    }
+    file->header = h;
+    file->count = (file->size - h->header_size) / h->record_size;
+    return 0;
+}
+
+static void log_unmap(log_file *file) {
+    if (file->map != NULL) {
+        munmap(file->map, file->size);
+    }
+    file->map = NULL;
+}
+
+static const telemetry_record *log_record(const log_file *file, size_t i) {
+    return (const telemetry_record *) (file->map + file->header->header_size + i * file->header->record_size);
+}
+
+static void out_flush(log_out *out) {
+    fwrite(out->buf, 1, out->len, stdout);
+    out->len = 0;
+}
+
+static void out_str(log_out *out, const char *s) {
+    size_t len = strlen(s);
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+static void out_char(log_out *out, char c) {
+    out->buf[out->len++] = c;
+}
+
+// printf is most of the time spent on a big log, this isn't
+static void out_int(log_out *out, long long v) {
+    char tmp[24];
+    int n = 0;
+    unsigned long long u = v < 0 ? -(unsigned long long) v : (unsigned long long) v;
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (v < 0) {
+        out_char(out, '-');
+    }
+    while (n > 0) {
+        out->buf[out->len++] = tmp[--n];
+    }
+}
+
+static void csv_header(log_out *out, const telemetry_header *h) {
+    unsigned int i;
+    out_str(out, "ms,mode,event,temp,level,rpm,power");
+    for (i = 0; i < h->n_temps; i++) {
+        out_char(out, ',');
+        out_str(out, h->names[i]);
+    }
+    out_char(out, '\n');
+}
+
+// what we don't know is left empty
+static void csv_record(log_out *out, const telemetry_record *r, unsigned int n_temps) {
+    unsigned int i;
+    out_int(out, r->ms);
+    out_char(out, ',');
+    if (r->mode <= CTRL_PID) {
+        out_str(out, ctrl_mode_name(r->mode));
+    } else {
+        out_int(out, r->mode);
+    }
+    out_char(out, ',');
+    if (r->event <= CTRL_FAN_MISMATCH) {
+        out_str(out, ctrl_event_name(r->event));
+    } else {
+        out_int(out, r->event);
+    }
+    out_char(out, ',');
+    if (r->temp >= 0) {
+        out_int(out, r->temp);
+    }
+    out_char(out, ',');
+    out_int(out, r->level);
+    out_char(out, ',');
+    if (r->rpm >= 0) {
+        out_int(out, r->rpm);
+    }
+    out_char(out, ',');
+    if (r->power == POWER_AC || r->power == POWER_BATTERY) {
+        out_str(out, power_name(r->power));
+    }
+    for (i = 0; i < n_temps; i++) {
+        out_char(out, ',');
+        if (r->temps[i] != TELEMETRY_NO_TEMP) {
+            out_int(out, r->temps[i]);
+        }
+    }
+    out_char(out, '\n');
+}
+
+// seconds since the first record, the temp and the level, failed reads left out
+static void tune_record(log_out *out, const telemetry_record *r, long long first_ms) {
+    long long ms = r->ms - first_ms;
+    if (r->temp < 0) {
+        return;
+    }
+    out_int(out, ms / 1000);
+    out_char(out, '.');
+    out_char(out, '0' + (ms % 1000) / 100);
+    out_char(out, '0' + (ms % 100) / 10);
+    out_char(out, '0' + ms % 10);
+    out_char(out, ' ');
+    out_int(out, r->temp);
+    out_char(out, ' ');
+    out_int(out, r->level);
+    out_char(out, '\n');
+}
+
+static void summary_init(log_summary *sum) {
+    int i;
+    memset(sum, 0, sizeof(*sum));
+    sum->temp_min = 1000;
+    sum->temp_max = -1000;
+    for (i = 0; i < SENSOR_MAX; i++) {
+        sum->sensor_min[i] = 1000;
+        sum->sensor_max[i] = -1000;
+    }
+}
+
+// the time up to the next record counts towards this one's mode and level
+static void summary_add(log_summary *sum, const telemetry_record *r, const telemetry_record *next, unsigned int n_temps) {
+    long long dt = next != NULL ? next->ms - r->ms : 0;
+    unsigned int i;
+    int level = r->level <= FAN_LVL_FULL ? r->level : FAN_LVL_FULL;
+    if (sum->records++ == 0) {
+        sum->first_ms = r->ms;
+    }
+    sum->last_ms = r->ms;
+    if (dt > LOG_GAP_S * 1000LL || dt < 0) {
+        sum->gaps++;
+        sum->gap_ms += dt > 0 ? dt : 0;
+        dt = 0;
+    }
+    if (r->mode <= CTRL_PID) {
+        sum->mode_ms[r->mode] += dt;
+    }
+    if (r->event <= CTRL_FAN_MISMATCH) {
+        sum->events[r->event]++;
+    }
+    sum->level_ms[level] += dt;
+    if (r->rpm >= 0) {
+        sum->rpm_sum[level] += r->rpm;
+        sum->rpm_count[level]++;
+    }
+    if (r->temp < 0) {
+        sum->failed++;
+    } else {
+        sum->temp_sum += r->temp;
+        sum->temp_count++;
+        if (r->temp < sum->temp_min)
+            sum->temp_min = r->temp;
+        if (r->temp > sum->temp_max)
+            sum->temp_max = r->temp;
+    }
+    for (i = 0; i < n_temps; i++) {
+        int t = r->temps[i];
+        if (t == TELEMETRY_NO_TEMP) {
+            continue;
+        }
+        sum->sensor_sum[i] += t;
+        sum->sensor_count[i]++;
+        if (t < sum->sensor_min[i])
+            sum->sensor_min[i] = t;
+        if (t > sum->sensor_max[i])
+            sum->sensor_max[i] = t;
+    }
+}
+
+static void print_time(const char *label, long long ms) {
+    char buf[64];
+    time_t t = ms / 1000;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s%s\n", label, buf);
+}
+
+static void summary_print(const log_summary *sum, const telemetry_header *h) {
+    long long span = sum->last_ms - sum->first_ms, active = span - sum->gap_ms;
+    unsigned int i;
+    int m;
+    print_time("From:    ", sum->first_ms);
+    print_time("To:      ", sum->last_ms);
+    printf("Span:    %.1fh, %.1fh of it logged, %lu gaps over %ds\n", span / 3600000.0, active / 3600000.0, sum->gaps, LOG_GAP_S);
+    printf("Records: %lu, %lu failed reads\n", sum->records, sum->failed);
+    if (sum->temp_count > 0) {
+        printf("Temp:    %d / %.1f / %d C (min / avg / max)\n", sum->temp_min, (double) sum->temp_sum / sum->temp_count, sum->temp_max);
+    }
+    if (active <= 0) {
+        return;
+    }
+    printf("Modes:  ");
+    for (m = 0; m <= CTRL_PID; m++) {
+        if (sum->mode_ms[m] > 0)
+            printf(" %s %.1f%%", ctrl_mode_name(m), 100.0 * sum->mode_ms[m] / active);
+    }
+    printf("\n%-23s %6s  %6s\n", "Level", "Time", "RPM");
+    for (m = 0; m <= FAN_LVL_FULL; m++) {
+        if (sum->level_ms[m] == 0 && sum->rpm_count[m] == 0) {
+            continue;
+        }
+        printf("%-23s %5.1f%%", fan_speeds[m], 100.0 * sum->level_ms[m] / active);
+        if (sum->rpm_count[m] > 0)
+            printf("  %6.0f", (double) sum->rpm_sum[m] / sum->rpm_count[m]);
+        printf("\n");
+    }
+    printf("%-23s %6s %6s %6s\n", "Sensor", "Min", "Avg", "Max");
+    for (i = 0; i < h->n_temps; i++) {
+        if (sum->sensor_count[i] == 0) {
+            printf("%-23s %6s %6s %6s\n", h->names[i], "-", "-", "-");
+            continue;
+        }
+        printf("%-23s %6d %6.1f %6d\n", h->names[i], sum->sensor_min[i], (double) sum->sensor_sum[i] / sum->sensor_count[i], sum->sensor_max[i]);
+    }
+    printf("Events: ");
+    for (m = CTRL_LEVEL_UP; m <= CTRL_FAN_MISMATCH; m++) {
+        if (sum->events[m] > 0)
+            printf(" %s %lu", ctrl_event_name(m), sum->events[m]);
+    }
+    printf("\n");
+}
+
+void print_help(char const *bin) {
+    printf("%s Usage: [options] <log> [log...]\n\
+            Reads the telemetry log written with -L, more than one file (the rotated ones) oldest first: log.3 log.2 log.1 log\n\
+            Prints CSV by default: ms,mode,event,temp,level,rpm,power and a column per sensor, empty where there was no reading\n\
+            -s : Summary instead: time per mode and level, average RPM per level, min/avg/max per sensor, events\n\
+            -t : \"seconds temp level\" lines instead, for fan_tune -f\n\
+            -h : Help - display this message\n", bin);
+}
+
+int main(int argc, char **argv) {
+    int c, ret, i, n_files;
+    size_t j;
+    char const *bin = argv[0];
+    log_format format = LOG_CSV;
+    log_file *files;
+    const telemetry_header *first = NULL;
+    const telemetry_record *r, *prev = NULL;
+    unsigned int n_temps;
+    log_summary sum;
+    log_out *out;
+    long long first_ms = -1;
+
+    while ((c = getopt(argc, argv, "sth")) != -1) {
+        switch (c) {
+            case 's':
+                format = LOG_SUMMARY;
+                break;
+            case 't':
+                format = LOG_TUNE;
+                break;
+            case 'h':
+                print_help(bin);
+                return 0;
+            case '?':
+                print_help(bin);
+                if (isprint(optopt)) {
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                } else {
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                }
+                return 1;
+            default:
+                abort();
+        }
+    }
+    n_files = argc - optind;
+    if (n_files < 1) {
+        print_help(bin);
+        fprintf(stderr, "Need a log.\n");
+        return 1;
+    }
+    files = calloc(n_files, sizeof(*files));
+    out = malloc(sizeof(*out));
+    if (files == NULL || out == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    out->len = 0;
+    // all of them up front, so a bad one is caught before any output
+    for (i = 0; i < n_files; i++) {
+        if ((ret = log_map(&files[i], argv[optind + i])) != 0) {
+            fprintf(stderr, "Unable to read %s: %s\n", argv[optind + i], ret == -EINVAL ? "not a telemetry log" : strerror(-ret));
+            while (--i >= 0)
+                log_unmap(&files[i]);
+            return 1;
+        }
+        // the columns have to line up, a log with other sensors is read on its own
+        if (first != NULL && memcmp(first, files[i].header, sizeof(*first)) != 0) {
+            fprintf(stderr, "%s has other sensors than %s, read it on its own\n", files[i].path, files[0].path);
+            while (i >= 0)
+                log_unmap(&files[i--]);
+            return 1;
+        }
+        first = files[i].header;
+    }
+    n_temps = first->n_temps;
+
+    summary_init(&sum);
+    if (format == LOG_CSV) {
+        csv_header(out, first);
+    }
+    for (i = 0; i < n_files; i++) {
+        for (j = 0; j < files[i].count; j++) {
+            r = log_record(&files[i], j);
+            // one behind, so it knows how long the previous one lasted
+            if (format == LOG_SUMMARY) {
+                if (prev != NULL)
+                    summary_add(&sum, prev, r, n_temps);
+                prev = r;
+                continue;
+            }
+            if (format == LOG_CSV) {
+                csv_record(out, r, n_temps);
+            } else {
+                if (first_ms < 0)
+                    first_ms = r->ms;
+                tune_record(out, r, first_ms);
+            }
+            // room for the longest line there can be
+            if (out->len > LOG_OUT_SIZE - 128 - SENSOR_MAX * 5) {
+                out_flush(out);
+            }
+        }
+    }
+    if (format == LOG_SUMMARY) {
+        if (prev == NULL) {
+            printf("No records\n");
+        } else {
+            summary_add(&sum, prev, NULL, n_temps);
+            summary_print(&sum, first);
+        }
+    }
+    out_flush(out);
+    // the records point into the mappings, these go last
+    for (i = 0; i < n_files; i++) {
+        log_unmap(&files[i]);
+    }
+    free(files);
+    free(out);
+    return 0;
+}
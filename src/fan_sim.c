@@ -0,0 +1,390 @@
+/*
+ThinkPad Fan Control - trace replay simulator
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Feeds a recorded (or generated) temperature trace through the same control core the GUI and
+the daemon use, as fast as it can, no timers and no hardware. Used to compare curves and
+throttle factors on hours of data, and as a benchmark for the control code.
+
+ThinkPad fan control is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+version 2 as published by the Free Software Foundation. See main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <time.h>
+#include "core.h"
+
+// temperature at a point in time, in seconds since the start of the trace
+typedef struct _trace {
+    double *time;
+    int *temp;
+    int n, size;
+} trace;
+
+typedef struct _sim_stats {
+    unsigned long ticks, changes;
+    double duration, crit_time, level_time; // seconds, level * seconds
+} sim_stats;
+
+static int round_temp(double temp) {
+    return (int) (temp < 0 ? temp - 0.5 : temp + 0.5);
+}
+
+static int trace_push(trace *tr, double time, int temp) {
+    if (tr->n == tr->size) {
+        int size = tr->size ? tr->size * 2 : 4096;
+        double *t = realloc(tr->time, size * sizeof(*t));
+        int *v;
+        if (t == NULL) {
+            return -ENOMEM;
+        }
+        tr->time = t;
+        if ((v = realloc(tr->temp, size * sizeof(*v))) == NULL) {
+            return -ENOMEM;
+        }
+        tr->temp = v;
+        tr->size = size;
+    }
+    tr->time[tr->n] = time;
+    tr->temp[tr->n] = temp;
+    tr->n++;
+    return 0;
+}
+
+static void trace_free(trace *tr) {
+    free(tr->time);
+    free(tr->temp);
+}
+
+// one sample per line: seconds and degrees C, separated by spaces, tabs or a comma
+// anything that doesn't start with a number (headers, # comments) is skipped
+static int trace_load(trace *tr, const char *path) {
+    char line[256];
+    double time, temp;
+    int ret = 0;
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (fp == NULL) {
+        return -errno;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%lf%*[ \t,]%lf", &time, &temp) != 2) {
+            continue;
+        }
+        if (tr->n > 0 && time < tr->time[tr->n - 1]) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = trace_push(tr, time, round_temp(temp));
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return ret;
+}
+
+// a trace sampled every second: idle around 40C with bursts of load, heating up and cooling
+// down with a 30s time constant. Same seed, same trace
+static int trace_generate(trace *tr, double hours, unsigned int seed) {
+    long t, end = (long) (hours * 3600), burst_end = 0;
+    double temp = 40, target = 40;
+    int ret;
+    srand(seed);
+    for (t = 0; t < end; t++) {
+        if (t >= burst_end) {
+            // next burst (or idle spell), between 10s and 5 minutes
+            burst_end = t + 10 + rand() % 290;
+            target = 40 + (rand() % 4 == 0 ? 0 : rand() % 50);
+        }
+        temp += (target - temp) / 30;
+        if ((ret = trace_push(tr, t, round_temp(temp + (rand() % 3 - 1)))) != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// the temperature we count as too hot for a mode, unless given on the command line
+static int crit_temp(const fan_ctrl *ctrl, ctrl_mode mode) {
+    const curve_config *c = &ctrl->curve_cfg;
+    switch (mode) {
+        case CTRL_CURVE:
+            return c->n_points > 0 ? c->points[c->n_points - 1].temp : c->crit_temp;
+        case CTRL_PID:
+            // it's meant to hold the target, anything above that is overshoot
+            return ctrl->pid_cfg.target + 1;
+        default:
+            return ctrl->auto_cfg.temp_crit;
+    }
+}
+
+static void simulate(fan_ctrl *ctrl, ctrl_mode mode, const trace *tr, int crit, sim_stats *stats) {
+    double next = tr->time[0], scan = ctrl_scan_interval(ctrl), next_sample = tr->time[0];
+    ctrl_result res;
+    int i, temp = -1;
+    bool tick;
+    memset(stats, 0, sizeof(*stats));
+    // the gate counts per run too
+    memset(ctrl->gate.writes, 0, sizeof(ctrl->gate.writes));
+    memset(ctrl->gate.held, 0, sizeof(ctrl->gate.held));
+    // start from scratch, with the fan on auto
+    ctrl_stop(ctrl);
+    ctrl_start(ctrl, mode);
+    for (i = 0; i < tr->n; i++) {
+        int level = ctrl->level;
+        // how long this sample holds, until the next one
+        double dt = i + 1 < tr->n ? tr->time[i + 1] - tr->time[i] : 0;
+        tick = tr->time[i] >= next;
+        // what the filter would have seen: a reading on every tick, and every sample_ms in between
+        if (tick || (ctrl->filter_cfg.sample_ms > 0 && tr->time[i] >= next_sample)) {
+            temp = SENSOR_C(filter_add(&ctrl->filter_cfg, &ctrl->filter, tr->temp[i] * 1000));
+            next_sample = tr->time[i] + ctrl->filter_cfg.sample_ms / 1000.0;
+        }
+        if (tick) {
+            ctrl_step(ctrl, temp, (long long) (tr->time[i] * 1000), &res);
+            stats->ticks++;
+            if (ctrl->level != level) {
+                stats->changes++;
+            }
+            // gaps in the trace: the next tick is the first sample after the scan interval
+            while (next <= tr->time[i]) {
+                next += scan;
+            }
+        }
+        if (tr->temp[i] >= crit) {
+            stats->crit_time += dt;
+        }
+        stats->level_time += ctrl->level * dt;
+        stats->duration += dt;
+    }
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void print_help(char const *bin) {
+    printf("%s Usage:\n\
+            -f <file> : Trace to replay, one \"seconds temp\" pair per line (- for stdin)\n\
+            -S <hours> : Generate a synthetic trace of this many hours instead\n\
+            -x <seed> : Seed for the synthetic trace (default 1)\n\
+            -M <mode> : Control mode: auto, manual, curve or pid (default curve)\n\
+            -i <seconds> : Scan interval (default auto: 120, manual: 10, curve: 5, pid: 2)\n\
+            -c <temp> : Auto: critical temperature (default 55)\n\
+            -s <temp> : Auto: safe temperature (default 50)\n\
+            -l <level> : Auto: fan level when critical (default 8), manual: fan level (default 7)\n\
+            -C <curve> : Curve: safe:safe_level:delta:step:critical:critical_level:throttle%% (default 35:1:5:1:65:8:50)\n\
+            -P <points> : Curve: temp:level points, replacing the linear curve (e.g. 30:1,50:3,65:5,75:8)\n\
+            -D <pid> : PID: target:kp:ki:kd:min_level:max_level:dwell (default 60:0.4:0.01:1:1:8:10)\n\
+            -t <filter> : Smooth the trace like the sensors would be, fuse:smooth:window:sample_ms (the trace is one sensor, so fuse is ignored)\n\
+            -g <gate> : Hold fan levels for at least dwell seconds, and move at most max_step levels at a time, dwell:max_step (e.g. 10:2), increases near critical always go through\n\
+            -T <temp> : Count time spent at or above this temperature (default: the critical temp of the mode)\n\
+            -r <runs> : Replay the trace this many times, for benchmarking (default 1)\n\
+            -h : Help - display this message\n", bin);
+}
+
+int main(int argc, char **argv) {
+    int c, ret, interval = 0, level = -1, crit = -1, runs = 1, run;
+    unsigned int seed = 1;
+    double hours = 0, start, elapsed;
+    char const *trace_path = NULL, *err;
+    char const *bin = argv[0];
+    ctrl_mode mode = CTRL_CURVE;
+    fan_actuator fan;
+    fan_ctrl ctrl;
+    trace tr = { 0 };
+    filter_config filter_cfg;
+    char filter_sensors[FILTER_LIST_LEN];
+    bool use_filter = false;
+    gate_config gate_cfg = { 0 };
+    sim_stats stats;
+    // same defaults as the GUI and the daemon
+    auto_config auto_cfg = {
+        .temp_safe = 50,
+        .temp_crit = 55,
+        .scan_interval = 120,
+        .fan_speed = FAN_LVL_FULL,
+    };
+    manual_config manual_cfg = {
+        .scan_interval = 10,
+        .fan_speed = 7,
+    };
+    curve_config curve_cfg = {
+        .safe_temp = 35,
+        .safe_speed = 1,
+        .delta_temp = 5,
+        .step = 1,
+        .crit_temp = 65,
+        .crit_speed = FAN_LVL_FULL,
+        .scan = 5,
+        .throttle_factor = 0.5,
+    };
+    pid_config pid_cfg = {
+        .target = 60,
+        .kp = 0.4,
+        .ki = 0.01,
+        .kd = 1.0,
+        .min_level = 1,
+        .max_level = FAN_LVL_FULL,
+        .dwell = 10,
+        .scan = 2,
+    };
+
+    while ((c = getopt(argc, argv, "f:S:x:M:i:c:s:l:C:P:D:t:g:T:r:h")) != -1) {
+        switch (c) {
+            case 'f':
+                trace_path = optarg;
+                break;
+            case 'S':
+                hours = atof(optarg);
+                break;
+            case 'x':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'M':
+                if (ctrl_parse_mode(optarg, &mode) != 0) {
+                    fprintf(stderr, "Unknown mode `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'c':
+                auto_cfg.temp_crit = atoi(optarg);
+                break;
+            case 's':
+                auto_cfg.temp_safe = atoi(optarg);
+                break;
+            case 'l':
+                level = atoi(optarg);
+                break;
+            case 'C':
+                if (ctrl_parse_curve(optarg, &curve_cfg) != 0) {
+                    fprintf(stderr, "Invalid curve `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                curve_cfg.n_points = curve_parse_points(optarg, curve_cfg.points, CURVE_POINTS_MAX);
+                if (curve_cfg.n_points < 1) {
+                    fprintf(stderr, "Invalid curve points `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (ctrl_parse_pid(optarg, &pid_cfg) != 0) {
+                    fprintf(stderr, "Invalid PID config `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                if (ctrl_parse_filter(optarg, &filter_cfg, filter_sensors, sizeof(filter_sensors)) != 0 || (err = filter_validate(&filter_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid filter `%s'.\n", optarg);
+                    return 1;
+                }
+                use_filter = true;
+                break;
+            case 'g':
+                if (ctrl_parse_gate(optarg, &gate_cfg) != 0) {
+                    fprintf(stderr, "Invalid command gate `%s', expected dwell:max_step.\n", optarg);
+                    return 1;
+                }
+                if ((err = gate_validate(&gate_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid command gate `%s': %s\n", optarg, err);
+                    return 1;
+                }
+                break;
+            case 'T':
+                crit = atoi(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'h':
+                print_help(bin);
+                return 0;
+            case '?':
+                print_help(bin);
+                if (isprint(optopt)) {
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                } else {
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                }
+                return 1;
+            default:
+                abort();
+        }
+    }
+    if (interval > 0) {
+        auto_cfg.scan_interval = manual_cfg.scan_interval = curve_cfg.scan = pid_cfg.scan = interval;
+    }
+    if (level >= 0) {
+        auto_cfg.fan_speed = manual_cfg.fan_speed = level;
+    }
+    if (runs < 1) {
+        runs = 1;
+    }
+
+    if (trace_path != NULL) {
+        ret = trace_load(&tr, trace_path);
+    } else if (hours > 0) {
+        ret = trace_generate(&tr, hours, seed);
+    } else {
+        print_help(bin);
+        fprintf(stderr, "Need a trace (-f) or a synthetic trace length (-S).\n");
+        return 1;
+    }
+    if (ret != 0 || tr.n == 0) {
+        fprintf(stderr, "Unable to load trace: %s\n", ret != 0 ? strerror(-ret) : "no samples");
+        trace_free(&tr);
+        return 1;
+    }
+
+    // the decisions are all we're after, the mock fan just keeps track of the level
+    fan_open_mock(&fan);
+    ctrl_init(&ctrl, &fan, NULL);
+    ctrl.auto_cfg = auto_cfg;
+    ctrl.manual_cfg = manual_cfg;
+    ctrl.curve_cfg = curve_cfg;
+    ctrl.pid_cfg = pid_cfg;
+    if (use_filter) {
+        ctrl.filter_cfg = filter_cfg;
+    }
+    ctrl.gate.cfg = gate_cfg;
+    if ((err = ctrl_compile(&ctrl, mode)) != NULL) {
+        fprintf(stderr, "Invalid %s config: %s\n", ctrl_mode_name(mode), err);
+        trace_free(&tr);
+        return 1;
+    }
+    ctrl.mode = mode;
+    if (crit < 0) {
+        crit = crit_temp(&ctrl, mode);
+    }
+
+    start = now_sec();
+    for (run = 0; run < runs; run++) {
+        simulate(&ctrl, mode, &tr, crit, &stats);
+    }
+    elapsed = now_sec() - start;
+
+    printf("Mode: %s, scan interval: %ds\n", ctrl_mode_name(mode), ctrl_scan_interval(&ctrl));
+    printf("Trace: %d samples, %.1f hours\n", tr.n, stats.duration / 3600);
+    printf("Decisions: %lu per run, %d runs in %.3fms (%.0f decisions/s)\n",
+           stats.ticks, runs, elapsed * 1000, elapsed > 0 ? stats.ticks * runs / elapsed : 0);
+    printf("Level changes: %lu\n", stats.changes);
+    ctrl_gate_dump(&ctrl, stdout);
+    printf("At or above %dC: %.0fs (%.2f%%)\n", crit, stats.crit_time,
+           stats.duration > 0 ? stats.crit_time * 100 / stats.duration : 0);
+    // auto counts as 0, we don't know what the EC does with the fan
+    printf("Average level: %.2f\n", stats.duration > 0 ? stats.level_time / stats.duration : 0);
+    fan_close(&fan);
+    trace_free(&tr);
+    return 0;
+}
@@ -0,0 +1,579 @@
+/*
+ThinkPad Fan Control - curve tuner
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Fits a first order thermal model to a log of temperatures and fan levels: the heat that comes in,
+and how fast the fan takes it away at each level. With the heat the log had, every curve in a grid
+is replayed through the same control core the GUI and the daemon use, the model working out what the
+temperature would have done with the levels that curve picked. The curve with the lowest average
+fan level that doesn't run hotter than the log did wins, ready for -C.
+
+ThinkPad fan control is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+version 2 as published by the Free Software Foundation. See main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "core.h"
+
+// the EC doesn't say what it runs the fan at on auto, this is what it usually looks like below critical
+#define TUNE_AUTO_LEVEL 2
+// the temperature this long before and after a level change shows what the fan did, the heat can't change much in between
+#define TUNE_EVENT_S 20
+// samples further apart than this are a gap in the log (suspend, a restart), the model starts over after one
+#define TUNE_GAP_S 60
+#define TUNE_THREADS_MAX 64
+// curves with an average level within this fraction of the best are as good, the one with the fewest changes wins
+#define TUNE_TIE 0.05
+
+// temperature and the level the fan was on, in seconds since the start of the log
+typedef struct _tune_log {
+    double *time;
+    int *temp, *level;
+    int n, size;
+} tune_log;
+
+// dT/dt = heat - cooling * level * (T - ambient)
+// what the machine sheds without the fan can't be told apart from the heat, it's counted in with it.
+// That errs on the hot side: running hotter than the log did, it would shed a bit more than the model thinks
+typedef struct _thermal_model {
+    double ambient; // degrees C
+    double cooling; // per second, per level, per degree over ambient
+    double *heat;   // degrees C per second, per sample: whatever the log did, that the fan doesn't account for
+    double rms;     // residual of the fit, degrees C per second
+    int events;     // level changes the fit is based on
+} thermal_model;
+
+typedef struct _tune_result {
+    bool valid; // false if the curve doesn't compile
+    double duration, level_time, crit_time; // seconds, level * seconds, seconds at or above critical
+    unsigned long changes;
+    int max_temp;
+} tune_result;
+
+// what the threads share: read only, except for next and the result of the curve they picked
+typedef struct _tune_job {
+    const tune_log *log;
+    const thermal_model *model;
+    const curve_config *curves;
+    tune_result *results;
+    int n_curves, crit;
+    atomic_int next;
+} tune_job;
+
+static int log_push(tune_log *log, double time, int temp, int level) {
+    if (log->n == log->size) {
+        int size = log->size ? log->size * 2 : 4096;
+        double *t = realloc(log->time, size * sizeof(*t));
+        int *v;
+        if (t == NULL) {
+            return -ENOMEM;
+        }
+        log->time = t;
+        if ((v = realloc(log->temp, size * sizeof(*v))) == NULL) {
+            return -ENOMEM;
+        }
+        log->temp = v;
+        if ((v = realloc(log->level, size * sizeof(*v))) == NULL) {
+            return -ENOMEM;
+        }
+        log->level = v;
+        log->size = size;
+    }
+    log->time[log->n] = time;
+    log->temp[log->n] = temp;
+    log->level[log->n] = level;
+    log->n++;
+    return 0;
+}
+
+static void log_free(tune_log *log) {
+    free(log->time);
+    free(log->temp);
+    free(log->level);
+}
+
+// key=value out of an API state line
+static bool state_field(const char *line, const char *key, long long *value) {
+    const char *p = strstr(line, key);
+    char *end;
+    if (p == NULL) {
+        return false;
+    }
+    p += strlen(key);
+    *value = strtoll(p, &end, 10);
+    return end != p;
+}
+
+// either what `subscribe` on the API sends (state seq=.. ms=.. temp=.. level=..), or one sample per line:
+// seconds, degrees C and the fan level, separated by spaces, tabs or a comma. Anything else is skipped
+static int log_load(tune_log *log, const char *path) {
+    char line[512];
+    double time, start = -1;
+    long long ms, temp, level;
+    int t, l, ret = 0;
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (fp == NULL) {
+        return -errno;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "state ", 6) == 0) {
+            if (!state_field(line, " ms=", &ms) || !state_field(line, " temp=", &temp) || !state_field(line, " level=", &level)) {
+                continue;
+            }
+            // wall-clock ms, from the start of the log is easier to read
+            if (start < 0) {
+                start = ms / 1000.0;
+            }
+            time = ms / 1000.0 - start;
+            t = temp;
+            l = level;
+        } else if (sscanf(line, "%lf%*[ \t,]%d%*[ \t,]%d", &time, &t, &l) != 3) {
+            continue;
+        }
+        // a failed read, or a level that makes no sense
+        if (t < 0 || l < FAN_LVL_AUTO || l > FAN_LVL_FULL) {
+            continue;
+        }
+        // the same tick twice (ie two subscribers logging to the same file), or the clock went back
+        if (log->n > 0 && time <= log->time[log->n - 1]) {
+            continue;
+        }
+        ret = log_push(log, time, t, l);
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return ret;
+}
+
+static int model_level(int level) {
+    return level == FAN_LVL_AUTO ? TUNE_AUTO_LEVEL : level;
+}
+
+// sample i and the next one are both in the log, close enough to tell what happened in between
+static bool model_step(const tune_log *log, int i) {
+    double dt = log->time[i + 1] - log->time[i];
+    return dt > 0 && dt <= TUNE_GAP_S;
+}
+
+// least squares slope of the temperature from sample from to sample to, degrees C per second
+static double slope(const tune_log *log, int from, int to) {
+    double mt = 0, mT = 0, sxx = 0, sxy = 0;
+    int i, n = to - from + 1;
+    for (i = from; i <= to; i++) {
+        mt += log->time[i];
+        mT += log->temp[i];
+    }
+    mt /= n;
+    mT /= n;
+    for (i = from; i <= to; i++) {
+        sxx += (log->time[i] - mt) * (log->time[i] - mt);
+        sxy += (log->time[i] - mt) * (log->temp[i] - mT);
+    }
+    return sxx > 0 ? sxy / sxx : 0;
+}
+
+// the fan level changed at sample i: the samples on the same level, without gaps, up to TUNE_EVENT_S
+// before (on the old level) and after it (on the new one). Returns false if there's not enough of either
+// sample i itself is in neither: it's the one that crossed the curve's threshold, odds are it reads high (or low)
+static bool event_window(const tune_log *log, int i, int *from, int *to) {
+    int a = i, b = i;
+    while (a > 0 && model_step(log, a - 1) && log->level[a - 1] == log->level[i - 1] && log->time[i] - log->time[a - 1] <= TUNE_EVENT_S) {
+        a--;
+    }
+    while (b + 1 < log->n && model_step(log, b) && log->level[b] == log->level[i] && log->time[b + 1] - log->time[i] <= TUNE_EVENT_S) {
+        b++;
+    }
+    *from = a;
+    *to = b;
+    // a level that only lasted a tick or two says more about the noise than about the fan
+    return a < i - 1 && b > i + 1 && log->time[i - 1] - log->time[a] >= TUNE_EVENT_S / 2 && log->time[b] - log->time[i + 1] >= TUNE_EVENT_S / 2;
+}
+
+// returns 0, -ENOMEM, or -EINVAL if the log doesn't show the fan cooling anything
+static int model_fit(thermal_model *m, const tune_log *log) {
+    double sxx = 0, sxy = 0, sq = 0, change, x, dt;
+    int i, from, to;
+    m->events = 0;
+    // the fan and the heat both change the temperature, and most of the time there's no telling which did what.
+    // Right before and right after the level changes, the heat is about the same: the change in slope is the fan
+    for (i = 1; i < log->n; i++) {
+        // on auto, nobody knows what the fan did
+        if (log->level[i] == log->level[i - 1] || log->level[i] == FAN_LVL_AUTO || log->level[i - 1] == FAN_LVL_AUTO) {
+            continue;
+        }
+        if (!event_window(log, i, &from, &to)) {
+            continue;
+        }
+        change = slope(log, i + 1, to) - slope(log, from, i - 1);
+        x = -(log->level[i] - log->level[i - 1]) * (log->temp[i] - m->ambient);
+        sxx += x * x;
+        sxy += x * change;
+        sq += change * change;
+        m->events++;
+    }
+    m->cooling = sxx > 0 ? sxy / sxx : 0;
+    if (m->cooling <= 0) {
+        return -EINVAL;
+    }
+    // what's left of the change in slope: sum (change - cooling * x)^2 / events
+    sq += m->cooling * m->cooling * sxx - 2 * m->cooling * sxy;
+    m->rms = sq > 0 ? sqrt(sq / m->events) : 0;
+    if ((m->heat = calloc(log->n, sizeof(*m->heat))) == NULL) {
+        return -ENOMEM;
+    }
+    // whatever the fan doesn't explain is the heat, so the recorded levels give back the log as it was
+    for (i = 0; i + 1 < log->n; i++) {
+        if (!model_step(log, i)) {
+            continue;
+        }
+        dt = log->time[i + 1] - log->time[i];
+        m->heat[i] = (log->temp[i + 1] - log->temp[i]) / dt + m->cooling * model_level(log->level[i]) * (log->temp[i] - m->ambient);
+    }
+    return 0;
+}
+
+static int round_temp(double temp) {
+    return (int) (temp < 0 ? temp - 0.5 : temp + 0.5);
+}
+
+// the log's heat, the curve's levels: what the temperature would have done, as fan_sim replays it
+static void replay(const tune_log *log, const thermal_model *m, const curve_config *cfg, int crit, tune_result *r) {
+    fan_actuator fan;
+    fan_ctrl ctrl;
+    ctrl_result res;
+    double temp = log->temp[0], next = log->time[0], dt;
+    int i, level;
+    memset(r, 0, sizeof(*r));
+    fan_open_mock(&fan);
+    ctrl_init(&ctrl, &fan, NULL);
+    ctrl.curve_cfg = *cfg;
+    if (ctrl_compile(&ctrl, CTRL_CURVE) != NULL) {
+        fan_close(&fan);
+        return;
+    }
+    r->valid = true;
+    ctrl_start(&ctrl, CTRL_CURVE);
+    for (i = 0; i < log->n; i++) {
+        if (log->time[i] >= next) {
+            level = ctrl.level;
+            ctrl_step(&ctrl, round_temp(temp), (long long) (log->time[i] * 1000), &res);
+            if (ctrl.level != level) {
+                r->changes++;
+            }
+            while (next <= log->time[i]) {
+                next += cfg->scan;
+            }
+        }
+        if (round_temp(temp) > r->max_temp) {
+            r->max_temp = round_temp(temp);
+        }
+        if (i + 1 == log->n) {
+            break;
+        }
+        if (!model_step(log, i)) {
+            // a gap, pick up from where the log is after it
+            temp = log->temp[i + 1];
+            continue;
+        }
+        dt = log->time[i + 1] - log->time[i];
+        if (round_temp(temp) >= crit) {
+            r->crit_time += dt;
+        }
+        r->level_time += model_level(ctrl.level) * dt;
+        r->duration += dt;
+        temp += dt * (m->heat[i] - m->cooling * model_level(ctrl.level) * (temp - m->ambient));
+    }
+    fan_close(&fan);
+}
+
+// the log as it was recorded, in the same terms as a replay
+static void recorded(const tune_log *log, int crit, tune_result *r) {
+    double dt;
+    int i;
+    memset(r, 0, sizeof(*r));
+    r->valid = true;
+    for (i = 0; i < log->n; i++) {
+        if (log->temp[i] > r->max_temp) {
+            r->max_temp = log->temp[i];
+        }
+        if (i > 0 && log->level[i] != log->level[i - 1]) {
+            r->changes++;
+        }
+        if (i + 1 == log->n || !model_step(log, i)) {
+            continue;
+        }
+        dt = log->time[i + 1] - log->time[i];
+        if (log->temp[i] >= crit) {
+            r->crit_time += dt;
+        }
+        r->level_time += model_level(log->level[i]) * dt;
+        r->duration += dt;
+    }
+}
+
+static void *tune_thread(void *data) {
+    tune_job *job = data;
+    int i;
+    // curves are handed out one at a time, they don't all take as long
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->n_curves) {
+        replay(job->log, job->model, &job->curves[i], job->crit, &job->results[i]);
+    }
+    return NULL;
+}
+
+// safe temp, delta, step and throttle factor over the ranges the curve tab allows, the rest as given
+static int make_grid(const curve_config *base, curve_config *curves, int max) {
+    int n = 0, safe, delta, step, throttle;
+    for (safe = 30; safe < base->crit_temp - 1; safe++) {
+        for (delta = 1; delta <= 10 && safe + delta < base->crit_temp; delta++) {
+            for (step = 1; step <= 3; step++) {
+                for (throttle = 0; throttle <= 100; throttle += 10) {
+                    if (n == max) {
+                        return n;
+                    }
+                    curves[n] = *base;
+                    curves[n].n_points = 0;
+                    curves[n].safe_temp = safe;
+                    curves[n].delta_temp = delta;
+                    curves[n].step = step;
+                    curves[n].throttle_factor = throttle / 100.0;
+                    n++;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+static double avg_level(const tune_result *r) {
+    return r->duration > 0 ? r->level_time / r->duration : 0;
+}
+
+// lowest average level without more time at or above critical than allowed
+// if none of them keep to that, the one that runs hot the least
+static int pick_best(const tune_result *results, int n, double allowed) {
+    double best_avg = -1;
+    int i, best = -1;
+    for (i = 0; i < n; i++) {
+        if (results[i].valid && results[i].crit_time <= allowed && (best_avg < 0 || avg_level(&results[i]) < best_avg)) {
+            best_avg = avg_level(&results[i]);
+        }
+    }
+    if (best_avg < 0) {
+        for (i = 0; i < n; i++) {
+            if (results[i].valid && (best < 0 || results[i].crit_time < results[best].crit_time)) {
+                best = i;
+            }
+        }
+        return best;
+    }
+    // near enough the same average: fewer changes, the fan is quieter for it
+    for (i = 0; i < n; i++) {
+        if (!results[i].valid || results[i].crit_time > allowed || avg_level(&results[i]) > best_avg * (1 + TUNE_TIE) + 1e-9) {
+            continue;
+        }
+        if (best < 0 || results[i].changes < results[best].changes
+            || (results[i].changes == results[best].changes && avg_level(&results[i]) < avg_level(&results[best]))) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_result(const char *what, const tune_result *r, int crit) {
+    printf("%s: average level %.2f, %.0fs (%.2f%%) at or above %dC, max %dC, %lu level changes\n", what, avg_level(r),
+           r->crit_time, r->duration > 0 ? r->crit_time * 100 / r->duration : 0, crit, r->max_temp, r->changes);
+}
+
+void print_help(char const *bin) {
+    printf("%s Usage:\n\
+            -f <file> : Log to fit and tune on, API state lines (see subscribe) or \"seconds temp level\" per line (- for stdin)\n\
+            -C <curve> : Curve to start from: safe:safe_level:delta:step:critical:critical_level:throttle%% (default 35:1:5:1:65:8:50)\n\
+                         the safe and critical levels and the critical temp are kept, the rest is tuned\n\
+            -i <seconds> : Scan interval of the curve (default 5)\n\
+            -A <temp> : Ambient temperature, what the machine cools down towards (default 25)\n\
+            -B <percent> : Time at or above the critical temp the tuned curve may add to what the log had (default 0)\n\
+            -j <threads> : Threads to search with (default: one per CPU)\n\
+            -q : Quiet, only print the tuned curve (for -C)\n\
+            -h : Help - display this message\n", bin);
+}
+
+int main(int argc, char **argv) {
+    int c, ret, i, threads = 0, n_curves, best, budget = 0;
+    bool quiet = false;
+    double start, elapsed, allowed;
+    char const *log_path = NULL;
+    char const *bin = argv[0];
+    tune_log log = { 0 };
+    thermal_model model = { .ambient = 25 };
+    tune_result now, base, *results;
+    curve_config *curves;
+    pthread_t tids[TUNE_THREADS_MAX];
+    tune_job job;
+    // same defaults as the GUI and the daemon
+    curve_config curve_cfg = {
+        .safe_temp = 35,
+        .safe_speed = 1,
+        .delta_temp = 5,
+        .step = 1,
+        .crit_temp = 65,
+        .crit_speed = FAN_LVL_FULL,
+        .scan = 5,
+        .throttle_factor = 0.5,
+    };
+
+    while ((c = getopt(argc, argv, "f:C:i:A:B:j:qh")) != -1) {
+        switch (c) {
+            case 'f':
+                log_path = optarg;
+                break;
+            case 'C':
+                if (ctrl_parse_curve(optarg, &curve_cfg) != 0) {
+                    fprintf(stderr, "Invalid curve `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                curve_cfg.scan = atoi(optarg);
+                break;
+            case 'A':
+                model.ambient = atof(optarg);
+                break;
+            case 'B':
+                budget = atoi(optarg);
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            case 'h':
+                print_help(bin);
+                return 0;
+            case '?':
+                print_help(bin);
+                if (isprint(optopt)) {
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                } else {
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                }
+                return 1;
+            default:
+                abort();
+        }
+    }
+    if (threads < 1) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > TUNE_THREADS_MAX) {
+        threads = TUNE_THREADS_MAX;
+    }
+    if (log_path == NULL) {
+        print_help(bin);
+        fprintf(stderr, "Need a log (-f).\n");
+        return 1;
+    }
+    if ((ret = log_load(&log, log_path)) != 0 || log.n < 2) {
+        fprintf(stderr, "Unable to load log: %s\n", ret != 0 ? strerror(-ret) : "not enough samples");
+        log_free(&log);
+        return 1;
+    }
+    if ((ret = model_fit(&model, &log)) != 0) {
+        if (ret == -EINVAL)
+            fprintf(stderr, "The fan level doesn't make a difference in this log, it needs the fan running at a few levels\n");
+        else
+            fprintf(stderr, "Unable to fit the model: %s\n", strerror(-ret));
+        log_free(&log);
+        return 1;
+    }
+
+    // every combination, generously sized: 30 safe temps at most is the widest the curve tab goes
+    n_curves = 71 * 10 * 3 * 11;
+    curves = calloc(n_curves, sizeof(*curves));
+    results = calloc(n_curves, sizeof(*results));
+    if (curves == NULL || results == NULL) {
+        fprintf(stderr, "Unable to allocate the search grid\n");
+        free(curves);
+        free(results);
+        free(model.heat);
+        log_free(&log);
+        return 1;
+    }
+    n_curves = make_grid(&curve_cfg, curves, n_curves);
+
+    recorded(&log, curve_cfg.crit_temp, &now);
+    replay(&log, &model, &curve_cfg, curve_cfg.crit_temp, &base);
+    job = (tune_job) {
+        .log = &log,
+        .model = &model,
+        .curves = curves,
+        .results = results,
+        .n_curves = n_curves,
+        .crit = curve_cfg.crit_temp,
+    };
+    atomic_init(&job.next, 0);
+    start = now_sec();
+    for (i = 0; i < threads; i++) {
+        if ((ret = pthread_create(&tids[i], NULL, tune_thread, &job)) != 0) {
+            fprintf(stderr, "Unable to start search thread: %s\n", strerror(ret));
+            break;
+        }
+    }
+    // with none at all, this thread does the lot
+    if (i == 0) {
+        tune_thread(&job);
+    }
+    threads = i;
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    elapsed = now_sec() - start;
+
+    // no hotter than the log was, give or take the budget
+    allowed = now.crit_time + now.duration * budget / 100.0;
+    best = pick_best(results, n_curves, allowed);
+    if (quiet) {
+        if (best >= 0) {
+            printf("%d:%d:%d:%d:%d:%d:%d\n", curves[best].safe_temp, curves[best].safe_speed, curves[best].delta_temp, curves[best].step,
+                   curves[best].crit_temp, curves[best].crit_speed, (int) (curves[best].throttle_factor * 100 + 0.5));
+        }
+    } else {
+        printf("Log: %d samples, %.1f hours\n", log.n, now.duration / 3600);
+        printf("Model: the fan takes away %.5fC per second, per level, per degree over %.0fC (fitted on %d level changes, residual %.3fC/s)\n",
+               model.cooling, model.ambient, model.events, model.rms);
+        print_result("Recorded", &now, curve_cfg.crit_temp);
+        print_result("Current curve", &base, curve_cfg.crit_temp);
+        printf("Searched %d curves on %d threads in %.3fs\n", n_curves, threads > 0 ? threads : 1, elapsed);
+        if (best >= 0) {
+            print_result("Tuned curve", &results[best], curve_cfg.crit_temp);
+            if (results[best].crit_time > allowed)
+                printf("None of them keep to the critical temp as well as the log did, this one comes closest\n");
+            printf("Curve: %d:%d:%d:%d:%d:%d:%d\n", curves[best].safe_temp, curves[best].safe_speed, curves[best].delta_temp, curves[best].step,
+                   curves[best].crit_temp, curves[best].crit_speed, (int) (curves[best].throttle_factor * 100 + 0.5));
+        }
+    }
+    free(curves);
+    free(results);
+    free(model.heat);
+    log_free(&log);
+    return best >= 0 ? 0 : 1;
+}
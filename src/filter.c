@@ -0,0 +1,138 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Sensor filtering, see filter.h. The window is a fixed ring in the channel, the median sorts a copy
+of it on the stack: a handful of ints, no allocations, nothing that grows with uptime.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+
+// weights are relative, anything past this is a typo
+#define FILTER_WEIGHT_MAX 100
+
+void filter_init(filter_channel *ch) {
+    memset(ch, 0, sizeof(*ch));
+    ch->value = SENSOR_INVALID;
+}
+
+int filter_add_sensor(filter_channel *ch, int slot, int weight) {
+    if (ch->n_sensors >= FILTER_SENSORS_MAX || slot < 0 || slot >= SENSOR_MAX || weight < 1 || weight > FILTER_WEIGHT_MAX) {
+        return -1;
+    }
+    ch->slots[ch->n_sensors] = slot;
+    ch->weights[ch->n_sensors] = weight;
+    ch->n_sensors++;
+    return 0;
+}
+
+const char *filter_resolve(filter_channel *ch, const sensor_set *set, const char *list) {
+    char name[SENSOR_NAME_LEN];
+    const char *end, *star;
+    int len, weight, slot;
+    filter_init(ch);
+    do {
+        end = strchr(list, '+');
+        len = end != NULL ? (int) (end - list) : (int) strlen(list);
+        weight = 1;
+        // a name can't have a * in it, the weight can't have anything else
+        if ((star = memchr(list, '*', len)) != NULL) {
+            weight = atoi(star + 1);
+            len = star - list;
+        }
+        if (len < 1 || len >= SENSOR_NAME_LEN) {
+            return "Expected name[*weight]+name[*weight]...";
+        }
+        snprintf(name, sizeof(name), "%.*s", len, list);
+        if ((slot = sensors_find(set, name)) < 0) {
+            return "No such sensor";
+        }
+        if (filter_add_sensor(ch, slot, weight) != 0) {
+            return "Weights must be between 1 and 100, at most 8 sensors";
+        }
+        list = end + 1;
+    } while (end != NULL);
+    return NULL;
+}
+
+void filter_reset(filter_channel *ch) {
+    ch->head = ch->count = 0;
+    ch->ema = 0;
+    ch->value = SENSOR_INVALID;
+}
+
+int filter_fuse(const filter_config *cfg, const filter_channel *ch, const sensor_sample *sample) {
+    long long sum = 0;
+    int weights = 0, hottest = SENSOR_INVALID, i, mdeg;
+    for (i = 0; i < ch->n_sensors; i++) {
+        mdeg = ch->slots[i] < sample->count ? sample->temps[ch->slots[i]] : SENSOR_INVALID;
+        // the ones we can still read will have to do
+        if (mdeg == SENSOR_INVALID) {
+            continue;
+        }
+        if (mdeg > hottest) {
+            hottest = mdeg;
+        }
+        sum += (long long) mdeg * ch->weights[i];
+        weights += ch->weights[i];
+    }
+    if (weights == 0) {
+        return SENSOR_INVALID;
+    }
+    return cfg->fuse == FILTER_MAX ? hottest : (int) (sum / weights);
+}
+
+static int median(const filter_channel *ch) {
+    int sorted[FILTER_WINDOW_MAX], i, j, mdeg;
+    // insertion sort, there are never more than a few of them
+    for (i = 0; i < ch->count; i++) {
+        mdeg = ch->ring[i];
+        for (j = i; j > 0 && sorted[j - 1] > mdeg; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = mdeg;
+    }
+    if (ch->count % 2 == 1) {
+        return sorted[ch->count / 2];
+    }
+    return (sorted[ch->count / 2 - 1] + sorted[ch->count / 2]) / 2;
+}
+
+int filter_add(const filter_config *cfg, filter_channel *ch, int mdeg) {
+    // going on what we read before the sensor went away is worse than saying we can't read it
+    if (mdeg == SENSOR_INVALID) {
+        filter_reset(ch);
+        return SENSOR_INVALID;
+    }
+    ch->ring[ch->head] = mdeg;
+    ch->head = (ch->head + 1) % cfg->window;
+    if (ch->count < cfg->window) {
+        ch->count++;
+    }
+    switch (cfg->smooth) {
+        case FILTER_EMA:
+            // alpha = 2 / (window + 1), the first reading is where it starts from
+            ch->ema = ch->count == 1 ? mdeg : ch->ema + (mdeg - ch->ema) * 2 / (cfg->window + 1);
+            ch->value = (int) (ch->ema < 0 ? ch->ema - 0.5 : ch->ema + 0.5);
+            break;
+        case FILTER_MEDIAN:
+            ch->value = median(ch);
+            break;
+        default:
+            ch->value = mdeg;
+    }
+    return ch->value;
+}
+
+const char *filter_validate(const filter_config *cfg) {
+    if (cfg->window < 1 || cfg->window > FILTER_WINDOW_MAX) {
+        return "Filter window must be between 1 and 16 readings";
+    }
+    if (cfg->sample_ms != 0 && cfg->sample_ms < FILTER_SAMPLE_MIN_MS) {
+        return "Samples can't be taken more often than every 250ms (0 to only sample on a tick)";
+    }
+    return NULL;
+}
@@ -0,0 +1,66 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Sensor filtering, between the sensor reads and the controllers. Each fan follows a channel: one or
+more sensors, fused into a single reading (the hottest, or a weighted mean), and smoothed over the
+last few readings (an EMA, or the median). A spike of one sample no longer makes the curve step
+the fan up, and back down again on the next tick. The readings can be taken more often than the
+controllers decide, so the window covers the time between two ticks.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "sensors.h"
+
+#define FILTER_SENSORS_MAX 8
+#define FILTER_WINDOW_MAX 16
+// name[*weight]+name[*weight]+...
+#define FILTER_LIST_LEN 128
+// in-between samples, any more often and we'd just read what the EC cached last time
+#define FILTER_SAMPLE_MIN_MS 250
+
+typedef enum _filter_fusion {
+    FILTER_MAX,  // the hottest sensor
+    FILTER_MEAN, // weighted mean of the sensors
+} filter_fusion;
+
+typedef enum _filter_smoothing {
+    FILTER_NONE,   // the last reading, as it is
+    FILTER_EMA,    // exponential moving average, spanning window readings
+    FILTER_MEDIAN, // median of the last window readings
+} filter_smoothing;
+
+typedef struct _filter_config {
+    filter_fusion fuse;
+    filter_smoothing smooth;
+    int window;    // readings, 1 to FILTER_WINDOW_MAX
+    int sample_ms; // take readings in between ticks this often, 0 to only read on a tick
+} filter_config;
+
+typedef struct _filter_channel {
+    int slots[FILTER_SENSORS_MAX], weights[FILTER_SENSORS_MAX];
+    int n_sensors;
+    int ring[FILTER_WINDOW_MAX]; // the last fused readings, millidegrees C
+    int head, count;
+    double ema;
+    int value; // filtered, millidegrees C, SENSOR_INVALID if there's nothing to go on
+} filter_channel;
+
+// a channel without sensors, and without readings
+void filter_init(filter_channel *ch);
+// returns 0, or -1 if the channel is full or the weight isn't positive
+int filter_add_sensor(filter_channel *ch, int slot, int weight);
+// the sensors of a channel as name[*weight]+..., by name or number (see sensors_find)
+// returns NULL if they're all there, or a message saying what's wrong
+const char *filter_resolve(filter_channel *ch, const sensor_set *set, const char *list);
+// forget the readings, keep the sensors
+void filter_reset(filter_channel *ch);
+// the channel's sensors in sample fused into one reading, SENSOR_INVALID if none of them could be read
+int filter_fuse(const filter_config *cfg, const filter_channel *ch, const sensor_sample *sample);
+// add a (fused) reading, returns the filtered value. SENSOR_INVALID starts the window over, and is returned as is
+int filter_add(const filter_config *cfg, filter_channel *ch, int mdeg);
+const char *filter_validate(const filter_config *cfg);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Fan command gate, see gate.h
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <string.h>
+#include "gate.h"
+#include "fan.h"
+
+// longer than this, and a mode is better off with a longer scan interval
+#define GATE_DWELL_MAX 600
+
+void gate_init(fan_gate *gate) {
+    memset(gate, 0, sizeof(*gate));
+    gate_reset(gate);
+}
+
+void gate_reset(fan_gate *gate) {
+    // long enough ago that no dwell time is still running
+    gate->change_ms = -GATE_DWELL_MAX * 1000LL;
+    gate->pending = -1;
+}
+
+int gate_level(fan_gate *gate, int mode, int current, int wanted, bool urgent, long long now_ms) {
+    int level = wanted;
+    if (wanted == current) {
+        gate->pending = -1;
+        return current;
+    }
+    if (urgent && wanted > current) {
+        gate->pending = -1;
+        return wanted;
+    }
+    if (gate->cfg.dwell > 0 && now_ms - gate->change_ms < gate->cfg.dwell * 1000LL) {
+        gate->pending = wanted;
+        gate->held[mode]++;
+        return current;
+    }
+    // auto isn't a speed, going to or from it is one change
+    if (gate->cfg.max_step > 0 && current > FAN_LVL_AUTO && wanted > FAN_LVL_AUTO) {
+        if (wanted > current + gate->cfg.max_step) {
+            level = current + gate->cfg.max_step;
+        } else if (wanted < current - gate->cfg.max_step) {
+            level = current - gate->cfg.max_step;
+        }
+    }
+    gate->pending = level != wanted ? wanted : -1;
+    return level;
+}
+
+void gate_written(fan_gate *gate, int mode, long long now_ms) {
+    gate->change_ms = now_ms;
+    gate->writes[mode]++;
+}
+
+int gate_wait(const fan_gate *gate, long long now_ms) {
+    long long left;
+    if (gate->pending < 0 || gate->cfg.dwell <= 0) {
+        return -1;
+    }
+    left = gate->change_ms + gate->cfg.dwell * 1000LL - now_ms;
+    return left > 0 ? (int) left : 0;
+}
+
+const char *gate_validate(const gate_config *cfg) {
+    if (cfg->dwell < 0 || cfg->dwell > GATE_DWELL_MAX) {
+        return "Dwell time must be between 0 and 600 seconds";
+    }
+    if (cfg->max_step < 0 || cfg->max_step >= FAN_LVL_FULL) {
+        return "Step limit must be between 1 and 7 levels, 0 for none";
+    }
+    return NULL;
+}
@@ -0,0 +1,45 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Fan command gate, between the modes and the fan: every level a mode decides on goes through here.
+A new level has to wait until the last one has been on for the dwell time, and moves the fan a
+limited number of levels at a time. What's held back is remembered, and goes out as soon as the
+dwell time is up. Increases that can't wait (the mode says it's getting critical) go straight
+through. A temperature sitting on the edge of a curve step no longer makes the fan hunt up and down,
+and the EC gets a fraction of the writes.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef GATE_H
+#define GATE_H
+
+#include <stdbool.h>
+
+// one set of counters per control mode, indexed the same way
+#define GATE_MODES 4
+
+typedef struct _gate_config {
+    int dwell;    // seconds a level is held at least, 0 for no dwell time
+    int max_step; // levels the fan moves per change at most, 0 for no limit
+} gate_config;
+
+typedef struct _fan_gate {
+    gate_config cfg;
+    long long change_ms; // when the level was last written
+    int pending;         // the level the mode wants and didn't get yet, -1 if there's none
+    unsigned long writes[GATE_MODES], held[GATE_MODES]; // levels written, and decisions held back, by mode
+} fan_gate;
+
+void gate_init(fan_gate *gate);
+// forget what's held back, and let the next level through whenever it comes (ie a new mode starts)
+void gate_reset(fan_gate *gate);
+// the level to write when mode wants wanted and the fan is at current, at now_ms. Returns current to hold it back
+// urgent lets an increase through as it is, whatever the dwell and step limits say
+int gate_level(fan_gate *gate, int mode, int current, int wanted, bool urgent, long long now_ms);
+// a level was written (or at least tried) at now_ms
+void gate_written(fan_gate *gate, int mode, long long now_ms);
+// ms until a held back level can go out, -1 if there's none (or it's slewing without a dwell time, one step per tick)
+int gate_wait(const fan_gate *gate, long long now_ms);
+const char *gate_validate(const gate_config *cfg);
+
+#endif
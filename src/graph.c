@@ -0,0 +1,181 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+History graph.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <string.h>
+#include "graph.h"
+#include "fan.h"
+
+static int scale_y(const history_graph *graph, int value, int min, int max) {
+    if (value < min) {
+        value = min;
+    } else if (value > max) {
+        value = max;
+    }
+    return (graph->height - 1) - (value - min) * (graph->height - 1) / (max - min);
+}
+
+static int temp_y(const history_graph *graph, int temp) {
+    return scale_y(graph, temp, GRAPH_TEMP_MIN, GRAPH_TEMP_MAX);
+}
+
+// a vertical line from y0 to y1 in column x, that's all a single sample needs
+static void column_line(cairo_t *cr, int x, int y0, int y1) {
+    if (y0 > y1) {
+        int tmp = y0;
+        y0 = y1;
+        y1 = tmp;
+    }
+    cairo_rectangle(cr, x, y0, 1, y1 - y0 + 1);
+    cairo_fill(cr);
+}
+
+// background, with a dot every 10 degrees C
+static void paint_blank(const history_graph *graph, cairo_t *cr, int x) {
+    int temp;
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_rectangle(cr, x, 0, 1, graph->height);
+    cairo_fill(cr);
+    cairo_set_source_rgb(cr, 0.8, 0.8, 0.8);
+    for (temp = GRAPH_TEMP_MIN + 10; temp < GRAPH_TEMP_MAX; temp += 10) {
+        cairo_rectangle(cr, x, temp_y(graph, temp), 1, 1);
+    }
+    cairo_fill(cr);
+}
+
+static void paint_temp(const history_graph *graph, cairo_t *cr, int x, int temp, int prev) {
+    int y = temp_y(graph, temp);
+    column_line(cr, x, y, prev == HISTORY_NO_TEMP ? y : temp_y(graph, prev));
+}
+
+static void paint_sample(const history_graph *graph, cairo_t *cr, unsigned long n) {
+    const fan_history *hist = graph->history;
+    const history_sample *s = history_get(hist, n), *prev = n > 0 ? history_get(hist, n - 1) : NULL;
+    const signed char *temps, *prev_temps;
+    int x = n % graph->width, i, y;
+    paint_blank(graph, cr, x);
+    if (s == NULL) {
+        return;
+    }
+    temps = history_temps(hist, n);
+    prev_temps = prev != NULL ? history_temps(hist, n - 1) : NULL;
+    // join each line to where it was in the previous column
+    cairo_set_source_rgb(cr, 0.2, 0.4, 0.9);
+    y = scale_y(graph, s->level, FAN_LVL_AUTO, FAN_LVL_FULL);
+    column_line(cr, x, y, prev != NULL ? scale_y(graph, prev->level, FAN_LVL_AUTO, FAN_LVL_FULL) : y);
+    if (s->rpm != HISTORY_NO_RPM) {
+        cairo_set_source_rgb(cr, 0.2, 0.7, 0.2);
+        y = scale_y(graph, s->rpm, 0, GRAPH_RPM_MAX);
+        column_line(cr, x, y, prev != NULL && prev->rpm != HISTORY_NO_RPM ? scale_y(graph, prev->rpm, 0, GRAPH_RPM_MAX) : y);
+    }
+    cairo_set_source_rgb(cr, 0.6, 0.6, 0.6);
+    for (i = 0; i < hist->n_temps; i++) {
+        if (!graph->control[i] && temps[i] != HISTORY_NO_TEMP) {
+            paint_temp(graph, cr, x, temps[i], prev_temps != NULL ? prev_temps[i] : HISTORY_NO_TEMP);
+        }
+    }
+    // the temperatures we actually act on go on top
+    cairo_set_source_rgb(cr, 0.9, 0.1, 0.1);
+    for (i = 0; i < hist->n_temps; i++) {
+        if (graph->control[i] && temps[i] != HISTORY_NO_TEMP) {
+            paint_temp(graph, cr, x, temps[i], prev_temps != NULL ? prev_temps[i] : HISTORY_NO_TEMP);
+        }
+    }
+}
+
+// columns for samples from up to (not including) to, these wrap around
+static void queue_columns(history_graph *graph, unsigned long from, unsigned long to) {
+    int x0 = from % graph->width, x1 = to % graph->width;
+    if (to - from >= (unsigned long) graph->width) {
+        gtk_widget_queue_draw(graph->area);
+    } else if (x0 < x1) {
+        gtk_widget_queue_draw_area(graph->area, x0, 0, x1 - x0, graph->height);
+    } else {
+        gtk_widget_queue_draw_area(graph->area, x0, 0, graph->width - x0, graph->height);
+        gtk_widget_queue_draw_area(graph->area, 0, 0, x1, graph->height);
+    }
+}
+
+void graph_update(history_graph *graph) {
+    unsigned long n, from, seq = graph->history->seq;
+    unsigned long visible = graph->width - GRAPH_GAP;
+    cairo_t *cr;
+    // nothing to paint on yet, the configure event paints whatever is in the history by then
+    if (graph->surface == NULL || graph->width <= GRAPH_GAP || seq == 0) {
+        return;
+    }
+    // samples taken within the same second replace the newest one, so always repaint that
+    from = graph->drawn > 0 ? graph->drawn - 1 : 0;
+    if (seq - from > visible) {
+        from = seq - visible;
+    }
+    cr = cairo_create(graph->surface);
+    for (n = from; n < seq; n++) {
+        paint_sample(graph, cr, n);
+    }
+    for (n = seq; n < seq + GRAPH_GAP; n++) {
+        paint_blank(graph, cr, n % graph->width);
+    }
+    cairo_destroy(cr);
+    queue_columns(graph, from, seq + GRAPH_GAP);
+    graph->drawn = seq;
+}
+
+static gboolean graph_configure(GtkWidget *widget, GdkEventConfigure *event, gpointer data) {
+    history_graph *graph = data;
+    cairo_t *cr;
+    int x;
+    if (graph->surface != NULL) {
+        cairo_surface_destroy(graph->surface);
+    }
+    graph->width = gtk_widget_get_allocated_width(widget);
+    graph->height = gtk_widget_get_allocated_height(widget);
+    graph->surface = gdk_window_create_similar_surface(gtk_widget_get_window(widget), CAIRO_CONTENT_COLOR, graph->width, graph->height);
+    // the one time we paint everything: the size changed, so every column moved
+    cr = cairo_create(graph->surface);
+    for (x = 0; x < graph->width; x++) {
+        paint_blank(graph, cr, x);
+    }
+    cairo_destroy(cr);
+    graph->drawn = 0;
+    graph_update(graph);
+    return TRUE;
+}
+
+static gboolean graph_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
+    history_graph *graph = data;
+    if (graph->surface == NULL) {
+        return FALSE;
+    }
+    // cr is clipped to the queued columns, so this copies just those
+    cairo_set_source_surface(cr, graph->surface, 0, 0);
+    cairo_paint(cr);
+    return FALSE;
+}
+
+void graph_init(history_graph *graph, GtkWidget *area, const fan_history *history, const int *slots, int n_slots) {
+    int i;
+    graph->area = area;
+    graph->history = history;
+    memset(graph->control, 0, sizeof(graph->control));
+    for (i = 0; i < n_slots; i++) {
+        if (slots[i] >= 0 && slots[i] < SENSOR_MAX) {
+            graph->control[slots[i]] = true;
+        }
+    }
+    graph->surface = NULL;
+    graph->width = graph->height = 0;
+    graph->drawn = 0;
+    g_signal_connect(G_OBJECT(area), "configure-event", G_CALLBACK(graph_configure), graph);
+    g_signal_connect(G_OBJECT(area), "draw", G_CALLBACK(graph_draw), graph);
+}
+
+void graph_free(history_graph *graph) {
+    if (graph->surface != NULL) {
+        cairo_surface_destroy(graph->surface);
+        graph->surface = NULL;
+    }
+}
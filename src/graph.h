@@ -0,0 +1,39 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+History graph: draws the temperature and fan history on a GtkDrawingArea, one column per sample.
+Like an oscilloscope, new samples sweep from left to right, wrapping around, so adding a sample
+only ever paints its own column.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stdbool.h>
+#include <gtk/gtk.h>
+#include "history.h"
+
+// temperature range the graph covers, anything outside of it is drawn at the edge
+#define GRAPH_TEMP_MIN 20
+#define GRAPH_TEMP_MAX 100
+#define GRAPH_RPM_MAX 8000
+// blank columns ahead of the newest sample, so you can tell where the sweep is
+#define GRAPH_GAP 4
+
+typedef struct _history_graph {
+    GtkWidget *area;
+    const fan_history *history;
+    bool control[SENSOR_MAX]; // temperature slots the controller goes by, drawn in red, the others are drawn in grey
+    cairo_surface_t *surface; // every column painted so far, the draw handler only copies from this
+    int width, height;
+    unsigned long drawn; // samples before this one have been painted
+} history_graph;
+
+// slots are the sensors of the channel the controller acts on (ctrl->filter), whether -t picked them or it's the primary one
+void graph_init(history_graph *graph, GtkWidget *area, const fan_history *history, const int *slots, int n_slots);
+// paint the samples added since the last call, and queue a redraw for just those columns
+void graph_update(history_graph *graph);
+void graph_free(history_graph *graph);
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+The privileged fan helper, see helper.h. The socketpair is SOCK_SEQPACKET, so a command is always
+read whole (or not at all), and one that's too long shows up as such rather than being split.
+Once it has the descriptors, the helper doesn't need root any more: it becomes nobody, without
+capabilities, and a seccomp filter leaves it the handful of system calls the fan calls make.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "helper.h"
+
+// the system calls below are numbered per architecture, anywhere else the helper goes without the filter
+#if defined(__x86_64__)
+#define HELPER_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define HELPER_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#endif
+#define HELPER_CAPS_MAX 64 // the kernel may know of more than our headers do
+
+// proxy side: one command, one reply. Only the control thread talks to the fans (and the trips), so they can't interleave
+static int call(int sock, helper_op op, int unit, int arg) {
+    helper_cmd cmd = { .op = op, .fan = unit, .arg = arg };
+    helper_reply reply;
+    ssize_t n;
+    if (sock < 0) {
+        return -EBADF;
+    }
+    if (send(sock, &cmd, sizeof(cmd), MSG_NOSIGNAL) < 0) {
+        return -errno;
+    }
+    while ((n = recv(sock, &reply, sizeof(reply), 0)) < 0 && errno == EINTR)
+        ;
+    if (n < 0) {
+        return -errno;
+    }
+    // 0 is the helper hanging up on us
+    return n == sizeof(reply) ? reply.ret : -EPIPE;
+}
+
+static int helper_set_level(fan_actuator *fan, int level) {
+    return call(fan->fd, HELPER_SET_LEVEL, fan->unit, level);
+}
+
+static int helper_read_rpm(fan_actuator *fan) {
+    return call(fan->fd, HELPER_READ_RPM, fan->unit, 0);
+}
+
+static int helper_set_watchdog(fan_actuator *fan, int seconds) {
+    return call(fan->fd, HELPER_SET_WATCHDOG, fan->unit, seconds);
+}
+
+static int helper_write_trip(const trip_watch *trips, trip_end end, int mc) {
+    return call(trips->proxy_fd, HELPER_SET_TRIP, end, mc);
+}
+
+// the socket belongs to the helper, not to any one fan
+static void helper_close(fan_actuator *fan) {
+    fan->fd = -1;
+}
+
+static const fan_ops helper_ops = {
+    .name = "helper",
+    .set_level = helper_set_level,
+    .read_rpm = helper_read_rpm,
+    .set_watchdog = helper_set_watchdog,
+    .close = helper_close,
+};
+
+// helper side from here on
+static bool is_kept(int fd, int sock, fan_actuator **fans, int n_fans, const trip_watch *trips) {
+    int i;
+    if (fd <= STDERR_FILENO || fd == sock) {
+        return true;
+    }
+    // the thresholds, not the temperature or the events: waking up on those is the GUI's job
+    if (trips != NULL && (fd == trips->lo_fd || fd == trips->hi_fd)) {
+        return true;
+    }
+    for (i = 0; i < n_fans; i++) {
+        if (fd == fans[i]->fd || fd == fans[i]->enable_fd || fd == fans[i]->rpm_fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// sensors, the GUI's end of the socket, anything else the GUI had open by now: none of our business
+static void close_others(int sock, fan_actuator **fans, int n_fans, const trip_watch *trips) {
+    struct dirent *ent;
+    DIR *d = opendir("/proc/self/fd");
+    int fd;
+    if (d == NULL) {
+        for (fd = STDERR_FILENO + 1; fd < 1024; fd++) {
+            if (!is_kept(fd, sock, fans, n_fans, trips))
+                close(fd);
+        }
+        return;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        fd = atoi(ent->d_name);
+        if (fd != dirfd(d) && !is_kept(fd, sock, fans, n_fans, trips)) {
+            close(fd);
+        }
+    }
+    closedir(d);
+}
+
+#ifdef HELPER_AUDIT_ARCH
+#define ALLOW(nr) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 1), BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+// what serve and the fan calls use: recv and send (recvfrom and sendto underneath), write and pwrite
+// for the levels and the watchdog, pread for the RPM, and exit. Anything else fails with EPERM rather
+// than killing us, so we can still put the fans back on auto
+static int seccomp_allow_list(void) {
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, HELPER_AUDIT_ARCH, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        ALLOW(__NR_recvfrom),
+        ALLOW(__NR_sendto),
+        ALLOW(__NR_read),
+        ALLOW(__NR_write),
+        ALLOW(__NR_pread64),
+        ALLOW(__NR_pwrite64),
+        ALLOW(__NR_rt_sigreturn),
+        ALLOW(__NR_restart_syscall),
+        ALLOW(__NR_exit),
+        ALLOW(__NR_exit_group),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | (EPERM & SECCOMP_RET_DATA)),
+    };
+    struct sock_fprog prog = { .len = sizeof(filter) / sizeof(filter[0]), .filter = filter };
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0) != 0 ? -errno : 0;
+}
+#endif
+
+// the fans are open, root was only needed for that: become uid/gid for good, with no capabilities
+// left to get back and (where we know the system call numbers) nothing to call but what serve does
+static int sandbox(uid_t uid, gid_t gid) {
+    int cap;
+    // needs CAP_SETPCAP, so before the setuid takes it away. Ones this kernel doesn't have are EINVAL
+    for (cap = 0; cap < HELPER_CAPS_MAX; cap++) {
+        if (prctl(PR_CAPBSET_DROP, cap, 0, 0, 0) != 0 && errno != EINVAL) {
+            return -errno;
+        }
+    }
+    if (setgroups(0, NULL) != 0 || setgid(gid) != 0 || setuid(uid) != 0) {
+        return -errno;
+    }
+    // whoever else runs as nobody doesn't get to ptrace us
+    if (prctl(PR_SET_DUMPABLE, 0, 0, 0, 0) != 0 || prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
+        return -errno;
+    }
+#ifdef HELPER_AUDIT_ARCH
+    return seccomp_allow_list();
+#else
+    return 0;
+#endif
+}
+
+// only temperatures a bracket could be at, or what the threshold was before we came along
+static int set_trip(const trip_watch *trips, const helper_cmd *cmd) {
+    int orig;
+    if (trips == NULL || cmd->fan > TRIP_HI) {
+        return -EINVAL;
+    }
+    orig = cmd->fan == TRIP_LO ? trips->lo_orig : trips->hi_orig;
+    if (cmd->arg != orig && (cmd->arg < 0 || cmd->arg > HELPER_TRIP_MC_MAX)) {
+        return -ERANGE;
+    }
+    return trip_write(trips, cmd->fan, cmd->arg);
+}
+
+// the GUI is gone, one way or the other: the thresholds go back to how it found them
+static void restore_trips(const trip_watch *trips) {
+    if (trips != NULL) {
+        trip_write(trips, TRIP_HI, trips->hi_orig);
+        trip_write(trips, TRIP_LO, trips->lo_orig);
+    }
+}
+
+static int run(fan_actuator **fans, int n_fans, const trip_watch *trips, const helper_cmd *cmd) {
+    fan_actuator *fan;
+    if (cmd->op == HELPER_SET_TRIP) {
+        return set_trip(trips, cmd);
+    }
+    if (cmd->fan >= n_fans) {
+        return -EINVAL;
+    }
+    fan = fans[cmd->fan];
+    // the range checks are the fan's own, the same ones the GUI went through
+    switch (cmd->op) {
+        case HELPER_SET_LEVEL:
+            return fan_set_level(fan, cmd->arg);
+        case HELPER_SET_WATCHDOG:
+            return fan_set_watchdog(fan, cmd->arg);
+        case HELPER_READ_RPM:
+            return fan_read_rpm(fan);
+        default:
+            return -EINVAL;
+    }
+}
+
+static void serve(int sock, fan_actuator **fans, int n_fans, const trip_watch *trips) {
+    helper_cmd cmd;
+    helper_reply reply;
+    ssize_t n;
+    int i;
+    for (;;) {
+        // with MSG_TRUNC we get the real length of a command that was too long
+        if ((n = recv(sock, &cmd, sizeof(cmd), MSG_TRUNC)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (n == sizeof(cmd) && cmd.op == HELPER_EXIT) {
+            // the fans are meant to stay as they are, and an armed watchdog would hand them back to the EC
+            for (i = 0; i < n_fans; i++) {
+                fan_set_watchdog(fans[i], 0);
+            }
+            restore_trips(trips);
+            _exit(0);
+        }
+        reply.ret = n == sizeof(cmd) ? run(fans, n_fans, trips, &cmd) : -EINVAL;
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+            break;
+        }
+    }
+    // the GUI crashed or got killed: the EC is a safer bet than whatever level was set last
+    // and with nobody left to feed it, the watchdog has nothing to do
+    for (i = 0; i < n_fans; i++) {
+        fan_set_level(fans[i], FAN_LVL_AUTO);
+        fan_set_watchdog(fans[i], 0);
+    }
+    restore_trips(trips);
+    _exit(0);
+}
+
+int helper_start(fan_helper *helper, fan_actuator **fans, int n_fans, trip_watch *trips) {
+    struct passwd *pw = getpwnam(HELPER_USER);
+    // the kernel's overflow uid, what nobody is pretty much everywhere
+    uid_t uid = pw != NULL ? pw->pw_uid : 65534;
+    gid_t gid = pw != NULL ? pw->pw_gid : 65534;
+    helper_reply reply;
+    int sv[2], ret, i;
+    ssize_t n;
+    pid_t pid;
+    helper->pid = -1;
+    helper->sock = -1;
+    if (n_fans > HELPER_FANS_MAX) {
+        return -EINVAL;
+    }
+    if (trips != NULL && trips->kind == TRIP_NONE) {
+        trips = NULL;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        return -errno;
+    }
+    // or whatever is buffered gets written twice
+    fflush(stdout);
+    fflush(stderr);
+    if ((pid = fork()) < 0) {
+        ret = -errno;
+        close(sv[0]);
+        close(sv[1]);
+        return ret;
+    }
+    if (pid == 0) {
+        close_others(sv[1], fans, n_fans, trips);
+        // ^C and kill $(pidof ...) are meant for the GUI, we quit when it does
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        // the first reply says whether we're locked down, without that the GUI keeps the fans
+        reply.ret = sandbox(uid, gid);
+        if (send(sv[1], &reply, sizeof(reply), MSG_NOSIGNAL) < 0 || reply.ret != 0) {
+            _exit(1);
+        }
+        serve(sv[1], fans, n_fans, trips);
+    }
+    close(sv[1]);
+    while ((n = recv(sv[0], &reply, sizeof(reply), 0)) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(reply) || reply.ret != 0) {
+        ret = n < 0 ? -errno : (n == sizeof(reply) ? reply.ret : -EPIPE);
+        close(sv[0]);
+        waitpid(pid, NULL, 0);
+        return ret;
+    }
+    helper->pid = pid;
+    helper->sock = sv[0];
+    // the helper has the descriptors now, ours become proxies
+    for (i = 0; i < n_fans; i++) {
+        fan_close(fans[i]);
+        fan_init(fans[i], &helper_ops);
+        fans[i]->fd = sv[0];
+        fans[i]->unit = i;
+    }
+    // the thresholds too, the temperature and the events stay with us
+    if (trips != NULL) {
+        close(trips->lo_fd);
+        close(trips->hi_fd);
+        trips->lo_fd = trips->hi_fd = -1;
+        trips->write = helper_write_trip;
+        trips->proxy_fd = sv[0];
+    }
+    return 0;
+}
+
+void helper_stop(fan_helper *helper) {
+    helper_cmd cmd = { .op = HELPER_EXIT };
+    if (helper->pid < 0) {
+        return;
+    }
+    if (send(helper->sock, &cmd, sizeof(cmd), MSG_NOSIGNAL) < 0) {
+        perror("helper stop");
+    }
+    close(helper->sock);
+    waitpid(helper->pid, NULL, 0);
+    helper->pid = -1;
+    helper->sock = -1;
+}
+
+int helper_find_user(const char *name, uid_t *uid, gid_t *gid) {
+    struct passwd *pw;
+    const char *id;
+    char *end;
+    if (name != NULL) {
+        pw = getpwnam(name);
+    } else {
+        if ((id = getenv("SUDO_UID")) == NULL && (id = getenv("PKEXEC_UID")) == NULL) {
+            return -ENOENT;
+        }
+        *uid = strtoul(id, &end, 10);
+        if (end == id || *end != '\0') {
+            return -EINVAL;
+        }
+        pw = getpwuid(*uid);
+    }
+    if (pw == NULL) {
+        return -ENOENT;
+    }
+    *uid = pw->pw_uid;
+    *gid = pw->pw_gid;
+    return 0;
+}
+
+int helper_drop_privileges(uid_t uid, gid_t gid) {
+    struct passwd *pw = getpwuid(uid);
+    // the user's own groups, not root's
+    if ((pw != NULL ? initgroups(pw->pw_name, gid) : setgroups(0, NULL)) != 0) {
+        return -errno;
+    }
+    if (setgid(gid) != 0 || setuid(uid) != 0) {
+        return -errno;
+    }
+    // make sure there's no way back
+    if (uid != 0 && setuid(0) == 0) {
+        return -EPERM;
+    }
+    // GTK looks for its settings (and the X authority) in there
+    if (pw != NULL) {
+        setenv("HOME", pw->pw_dir, 1);
+        setenv("USER", pw->pw_name, 1);
+        setenv("LOGNAME", pw->pw_name, 1);
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Privilege separation for the GUI: writing to the fan takes root, GTK shouldn't have it. A helper
+process is forked off as soon as the fans are open, keeps their descriptors (and nothing else), and
+takes fixed-size commands over a socketpair. The helper then drops root as well (see HELPER_USER), the fans in the GUI
+become proxies that send it those commands, and the GUI drops to the user that started it. A level change is a send and a recv on a
+local socket, no fork, no shell. If the GUI goes away without saying goodbye, the helper puts the
+fans back on auto.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef HELPER_H
+#define HELPER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "fan.h"
+#include "trip.h"
+
+#define HELPER_FANS_MAX 8
+// what the helper runs as once the fans are open, the descriptors are all it needs
+#define HELPER_USER "nobody"
+// no threshold we'd arm is hotter than this (or below 0C), the helper only writes these, or what was there before
+#define HELPER_TRIP_MC_MAX 150000
+
+typedef enum _helper_op {
+    HELPER_SET_LEVEL = 1,
+    HELPER_SET_WATCHDOG,
+    HELPER_READ_RPM,
+    HELPER_SET_TRIP, // a thermal trigger threshold, fan is the trip_end
+    HELPER_EXIT, // leave the fans as they are and quit
+} helper_op;
+
+// the only thing the helper accepts, anything that isn't exactly this size is refused
+typedef struct _helper_cmd {
+    uint8_t op;
+    uint8_t fan;  // index into the fans the helper was started with
+    int32_t arg;  // the level, the watchdog seconds, or the threshold in millidegrees
+} helper_cmd;
+
+typedef struct _helper_reply {
+    int32_t ret;  // what the fan call returned: 0, the RPM, or -errno
+} helper_reply;
+
+typedef struct _fan_helper {
+    pid_t pid;    // -1 if there's no helper
+    int sock;
+} fan_helper;
+
+// fork the helper, it takes over the (open) fans, which are turned into proxies in this process
+// and the thresholds of trips (NULL if there are none), which are then written through it too
+// call this before any threads are started. Returns 0 or -errno (also if the helper couldn't lock
+// itself down), the fans and trips are left alone if it fails
+int helper_start(fan_helper *helper, fan_actuator **fans, int n_fans, trip_watch *trips);
+// tell the helper to quit (leaving the fans alone), and wait for it
+void helper_stop(fan_helper *helper);
+// who to drop to: the user behind sudo or pkexec, or name if it isn't NULL. Returns 0 or -errno
+int helper_find_user(const char *name, uid_t *uid, gid_t *gid);
+// become uid/gid for good, HOME and USER follow. Returns 0 or -errno
+int helper_drop_privileges(uid_t uid, gid_t gid);
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Temperature and fan history ring buffer.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "history.h"
+
+int history_init(fan_history *hist, int n_temps, int capacity) {
+    memset(hist, 0, sizeof(*hist));
+    // always have room for at least one temperature, keeps the indexing simple
+    hist->n_temps = n_temps > 0 ? n_temps : 1;
+    hist->capacity = capacity;
+    hist->samples = calloc(capacity, sizeof(*hist->samples));
+    hist->temps = malloc((size_t) capacity * hist->n_temps);
+    if (hist->samples == NULL || hist->temps == NULL) {
+        history_free(hist);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void history_free(fan_history *hist) {
+    free(hist->samples);
+    free(hist->temps);
+    hist->samples = NULL;
+    hist->temps = NULL;
+    hist->count = hist->capacity = 0;
+}
+
+long long history_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void history_add(fan_history *hist, long long ms, const sensor_sample *sample, int level, int rpm) {
+    history_sample *s;
+    signed char *temps;
+    int i, slot;
+    if (hist->capacity == 0) {
+        return;
+    }
+    if (hist->seq > 0 && hist->samples[(hist->seq - 1) % hist->capacity].ms / 1000 == ms / 1000) {
+        // fast sampling (adaptive): overwrite, so the buffer still covers as many seconds as it has slots
+        slot = (hist->seq - 1) % hist->capacity;
+    } else {
+        slot = hist->seq % hist->capacity;
+        hist->seq++;
+        if (hist->count < hist->capacity) {
+            hist->count++;
+        }
+    }
+    s = &hist->samples[slot];
+    s->ms = ms;
+    s->rpm = rpm;
+    s->level = level;
+    temps = &hist->temps[(size_t) slot * hist->n_temps];
+    for (i = 0; i < hist->n_temps; i++) {
+        int t;
+        if (i >= sample->count || sample->temps[i] == SENSOR_INVALID) {
+            temps[i] = HISTORY_NO_TEMP;
+            continue;
+        }
+        t = SENSOR_C(sample->temps[i]);
+        temps[i] = t < -127 ? -127 : (t > 127 ? 127 : t);
+    }
+}
+
+unsigned long history_first(const fan_history *hist) {
+    return hist->seq - hist->count;
+}
+
+const history_sample *history_get(const fan_history *hist, unsigned long n) {
+    if (n >= hist->seq || n < history_first(hist)) {
+        return NULL;
+    }
+    return &hist->samples[n % hist->capacity];
+}
+
+const signed char *history_temps(const fan_history *hist, unsigned long n) {
+    return &hist->temps[(size_t) (n % hist->capacity) * hist->n_temps];
+}
@@ -0,0 +1,46 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Temperature and fan history: a ring buffer, allocated once, covering at least 24 hours.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "sensors.h"
+
+// samples within the same second share a slot, so this many slots always covers this many seconds
+#define HISTORY_SECONDS (24 * 60 * 60)
+// whole degrees C fit in a signed char, this marks a sensor that had no valid reading
+#define HISTORY_NO_TEMP -128
+#define HISTORY_NO_RPM -1
+
+typedef struct _history_sample {
+    long long ms;        // wall-clock time, ms since epoch
+    int rpm;             // measured fan speed, HISTORY_NO_RPM if we don't know it
+    unsigned char level; // the level we asked for
+} history_sample;
+
+typedef struct _fan_history {
+    history_sample *samples;
+    signed char *temps; // n_temps per sample, same slot as samples
+    int n_temps, capacity;
+    int count;          // slots in use, at most capacity
+    unsigned long seq;  // samples recorded so far, sample n (from 0) lives in slot n % capacity
+} fan_history;
+
+// allocates everything up front, returns 0 or -ENOMEM
+int history_init(fan_history *hist, int n_temps, int capacity);
+void history_free(fan_history *hist);
+long long history_clock_ms(void);
+// record a sample, if the last one was taken in the same second, it's replaced rather than added
+void history_add(fan_history *hist, long long ms, const sensor_sample *sample, int level, int rpm);
+// the oldest sample number still in the buffer, the newest is seq - 1
+unsigned long history_first(const fan_history *hist);
+// sample n, NULL if it isn't in the buffer (anymore)
+const history_sample *history_get(const fan_history *hist, unsigned long n);
+// temperatures (degrees C, or HISTORY_NO_TEMP) for sample n, only valid if history_get returns a sample
+const signed char *history_temps(const fan_history *hist, unsigned long n);
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Feed-forward, see load.h. Like the sensors, both files are opened once and re-read with pread at
+offset 0, parsed by hand: a read is two syscalls, no stdio, no allocations.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "load.h"
+#include "fan.h"
+#include "paths.h"
+
+// the aggregate cpu line is well within this, even with 10 counters of 20 digits
+#define LOAD_STAT_BUF_LEN 256
+#define RAPL_PREFIX "intel-rapl:"
+
+// parse the next unsigned number in buf, returns a pointer past it, NULL if there is none
+static const char *parse_ull(const char *p, const char *end, unsigned long long *out) {
+    unsigned long long val = 0;
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    if (p >= end || *p < '0' || *p > '9') {
+        return NULL;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+        val = val * 10 + (*p - '0');
+        p++;
+    }
+    *out = val;
+    return p;
+}
+
+static int read_ull(int fd, unsigned long long *out) {
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+        return -errno;
+    }
+    return parse_ull(buf, buf + n, out) == NULL ? -EINVAL : 0;
+}
+
+// the package domain, not one of its subzones (intel-rapl:0:0 is the cores of package 0)
+static int open_rapl(load_watch *load, const char *root) {
+    char base[PATH_MAX], path[PATH_MAX], name[16];
+    unsigned long long range;
+    struct dirent *ent;
+    ssize_t n;
+    int fd;
+    DIR *d;
+    if (root_path(base, sizeof(base), root, RAPL_PATH) != 0 || (d = opendir(base)) == NULL) {
+        return -ENOENT;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (strncmp(ent->d_name, RAPL_PREFIX, strlen(RAPL_PREFIX)) != 0 || strchr(ent->d_name + strlen(RAPL_PREFIX), ':') != NULL) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s/name", base, ent->d_name) >= (int) sizeof(path) || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            continue;
+        }
+        n = read(fd, name, sizeof(name) - 1);
+        close(fd);
+        if (n <= 0 || strncmp(name, "package", 7) != 0) {
+            continue;
+        }
+        range = 0;
+        if (snprintf(path, sizeof(path), "%s/%s/max_energy_range_uj", base, ent->d_name) < (int) sizeof(path) && (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+            read_ull(fd, &range);
+            close(fd);
+        }
+        // energy_uj is root only on most kernels, if we can't read it we do without
+        if (snprintf(path, sizeof(path), "%s/%s/energy_uj", base, ent->d_name) < (int) sizeof(path) && (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+            load->energy_fd = fd;
+            load->energy_range = range;
+            break;
+        }
+    }
+    closedir(d);
+    return load->energy_fd >= 0 ? 0 : -ENOENT;
+}
+
+int load_open(load_watch *load, const char *root) {
+    char path[PATH_MAX];
+    memset(load, 0, sizeof(*load));
+    load->energy_fd = -1;
+    load->util = load->watts = LOAD_UNKNOWN;
+    if (root_path(path, sizeof(path), root, LOAD_STAT_PATH) != 0) {
+        return -ENAMETOOLONG;
+    }
+    if ((load->stat_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -errno;
+    }
+    open_rapl(load, root);
+    return 0;
+}
+
+void load_close(load_watch *load) {
+    if (load->stat_fd >= 0)
+        close(load->stat_fd);
+    if (load->energy_fd >= 0)
+        close(load->energy_fd);
+    load->stat_fd = load->energy_fd = -1;
+}
+
+static int read_stat(load_watch *load, unsigned long long *busy, unsigned long long *total) {
+    char buf[LOAD_STAT_BUF_LEN];
+    const char *p, *end;
+    unsigned long long val, idle = 0;
+    ssize_t n = pread(load->stat_fd, buf, sizeof(buf), 0);
+    int i;
+    if (n < 0) {
+        return -errno;
+    }
+    if (n < 4 || memcmp(buf, "cpu ", 4) != 0) {
+        return -EINVAL;
+    }
+    end = buf + n;
+    p = buf + 4;
+    *total = 0;
+    // user nice system idle iowait irq softirq steal, guest time is already counted in user
+    for (i = 0; i < 8 && (p = parse_ull(p, end, &val)) != NULL; i++) {
+        *total += val;
+        if (i == 3 || i == 4) {
+            idle += val;
+        }
+    }
+    if (i < 4) {
+        return -EINVAL;
+    }
+    *busy = *total - idle;
+    return 0;
+}
+
+int load_read(load_watch *load, long long now_ms) {
+    unsigned long long busy, total, energy;
+    long long delta;
+    int ret;
+    if ((ret = read_stat(load, &busy, &total)) != 0) {
+        load->util = LOAD_UNKNOWN;
+        return ret;
+    }
+    if (load->primed && total > load->total) {
+        load->util = (int) ((busy - load->busy) * 100 / (total - load->total));
+    }
+    load->busy = busy;
+    load->total = total;
+    if (load->energy_fd >= 0 && read_ull(load->energy_fd, &energy) == 0) {
+        if (load->primed && now_ms > load->energy_ms) {
+            delta = (long long) energy - load->energy_uj;
+            if (delta < 0) {
+                delta += load->energy_range;
+            }
+            // uJ per ms is mW
+            load->watts = delta >= 0 ? (int) (delta / (now_ms - load->energy_ms) / 1000) : LOAD_UNKNOWN;
+        }
+        load->energy_uj = energy;
+        load->energy_ms = now_ms;
+    }
+    load->primed = true;
+    return 0;
+}
+
+// levels for val on a start..full ramp, anything past start is worth at least one
+static int ramp(int val, int start, int full, int max) {
+    if (val == LOAD_UNKNOWN || start >= full || val <= start) {
+        return 0;
+    }
+    if (val >= full) {
+        return max;
+    }
+    return ((val - start) * max + full - start - 1) / (full - start);
+}
+
+int load_boost(const load_config *cfg, const load_watch *load) {
+    int util = ramp(load->util, cfg->util_start, cfg->util_full, cfg->max_boost);
+    int power = ramp(load->watts, cfg->watts_start, cfg->watts_full, cfg->max_boost);
+    return util > power ? util : power;
+}
+
+const char *load_validate(const load_config *cfg) {
+    if (cfg->util_start < 0 || cfg->util_full > 100 || cfg->util_start >= cfg->util_full) {
+        return "Utilisation ramp must go up, between 0 and 100%";
+    }
+    if (cfg->watts_start < 0 || (cfg->watts_full != 0 && cfg->watts_start >= cfg->watts_full)) {
+        return "Power ramp must go up, or be 0:0 to ignore package power";
+    }
+    if (cfg->max_boost < 1 || cfg->max_boost > FAN_LVL_FULL) {
+        return "Boost must be between 1 and 8 levels";
+    }
+    return NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Feed-forward: the temperature lags the load by seconds, so we look at the load itself (CPU
+utilisation from /proc/stat, package power from the RAPL energy counter) and spin the fan up
+before the heat shows up on the sensors.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef LOAD_H
+#define LOAD_H
+
+#include <stdbool.h>
+
+#define LOAD_STAT_PATH "/proc/stat"
+#define RAPL_PATH "/sys/class/powercap"
+// no reading yet, or nothing to read it from
+#define LOAD_UNKNOWN -1
+
+// the boost ramps up linearly from *_start to *_full, whichever of the two asks for more wins
+typedef struct _load_config {
+    int util_start, util_full;   // CPU busy, percent
+    int watts_start, watts_full; // package power, 0:0 to ignore it
+    int max_boost;               // levels added on top of the curve at (or above) *_full
+} load_config;
+
+typedef struct _load_watch {
+    int stat_fd;
+    int energy_fd;                   // RAPL package energy_uj, -1 if there's none (or we can't read it)
+    long long energy_range;          // where energy_uj wraps around
+    unsigned long long busy, total;  // /proc/stat jiffies at the last read
+    long long energy_uj, energy_ms;  // and the energy counter
+    bool primed;                     // false until we have a previous read to compare with
+    int util;                        // percent busy since the last read, or LOAD_UNKNOWN
+    int watts;                       // average package power since the last read, or LOAD_UNKNOWN
+} load_watch;
+
+// open /proc/stat and the RAPL package counter under root (NULL for /), returns 0 or -errno
+// only /proc/stat is required, without RAPL the power is always LOAD_UNKNOWN
+int load_open(load_watch *load, const char *root);
+void load_close(load_watch *load);
+// update util and watts since the last read, returns 0 or -errno
+int load_read(load_watch *load, long long now_ms);
+// levels to add for the current load
+int load_boost(const load_config *cfg, const load_watch *load);
+// returns NULL if the config is usable, or a message saying what's wrong with it
+const char *load_validate(const load_config *cfg);
+
+#endif
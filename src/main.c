@@ -29,27 +29,23 @@ MA 02111, USA.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <time.h>
+#include <signal.h>
 #include <gtk/gtk.h>
+#include <glib-unix.h>
+#include "core.h"
+#include "graph.h"
+#include "api.h"
+#include "helper.h"
+#include "worker.h"
 
 #define GTK_GUI_FILE "src/gui_new.glade"
-#define FAN_LVL_AUTO 0
-#define FAN_LVL_FULL 8
 // scan interval, critical temp, safe temp, fan speed
 #define AUTO_LBL_FMT "Current Options: %ds - %dC - %dC - %s"
-
-const char *fan_speeds[] = {
-    "Auto",
-    "1",
-    "2",
-    "3",
-    "4",
-    "5",
-    "6",
-    "7",
-    "Full-Speed",
-};
+#define NO_THINKPAD_MSG "YOU ARE NOT RUNNING KERNEL WITH THINKPAD PATCH!"
 
 // The widgets and values we need, slightly better organised in terms of per-control/task
 /*
@@ -79,11 +75,30 @@ typedef struct _fan_curve {
     GtkComboBox *safe_cmb, *crit_cmb, *inc_cmb;
     GtkSpinButton *safe, *crit, *scan_int, *delta;
     GtkScale *throttle_scl;
-    int step, safe_temp, crit_temp, delta_temp, scan, safe_speed, crit_speed; // last values from input
-    int fan_speed; // current fan speed
-    double throttle_factor;
+    GtkEntry *points;
+    fan_ctrl *ctrl; // holds the last values from input, and the curve compiled from them
+    const rpm_map *rpm_map; // what the levels did so far, shown with the curve
 } fan_curve;
 
+typedef struct _fan_pid {
+    GtkLabel *config;
+    GtkComboBox *min_cmb, *max_cmb;
+    GtkSpinButton *target, *scan_int, *kp, *ki, *kd, *dwell;
+    fan_ctrl *ctrl; // holds the last values from input
+} fan_pid;
+
+// what the view last displayed, so we only format and push strings when something changed
+typedef struct _tick_cache {
+    unsigned long seq; // the controller state we last rendered
+    gint64 second; // wall-clock second the time string was formatted for
+    int temp, rpm, mode, lbl_speed, power;
+    int fan_levels[CTRL_FANS_MAX], fan_temps[CTRL_FANS_MAX]; // the other fans
+    const char *lbl_fmt;
+    char time_str[10];
+    char message[100];
+    rpm_map rpm_map; // the learned RPMs we last showed
+} tick_cache;
+
 typedef struct _application {
     // general widgets we can use
     GtkWidget *window;
@@ -94,6 +109,8 @@ typedef struct _application {
     GtkStatusIcon *tray_icon;
     // this is only used for temps/speed, but is a general label show everywhere
     GtkLabel *current_lbl, *close_lbl;
+    // the learned level -> RPM map, under the history
+    GtkLabel *rpm_lbl;
     // speed specific widgets
     GtkLabel *auto_lbl;
     GtkComboBox *auto_cmb;
@@ -102,97 +119,177 @@ typedef struct _application {
     GtkButton *off_btn;
     // everything for the fan curve in its own type
     fan_curve *curve;
-    // manual vs auto mode, was critical Y/N
-    int manual, running, was_crit; // 0 for auto, running indicates current timeout running
-    // speed/temp interval callback thing
-    gint timeout, status_id;
-    // config for auto, used to not access widgets all the time + check if anything changed
-    int temp_safe, temp_crit, scan_interval, fan_speed;
+    // and the PID
+    fan_pid *pid;
+    // the configs from the widgets, validated and compiled here, then posted to the worker. Never touches the hardware
+    fan_ctrl *ctrl;
+    // the control thread, it owns the sensors, the fan, and the control core that runs them
+    fan_worker *worker;
+    ctrl_state state; // the last tick the worker told us about
+    int idle_temp; // CPU temp to show while we're not running, -1 if it couldn't be read
+    // every tick is recorded here, NULL if we couldn't allocate it
+    fan_history *history;
+    // draws the history, if we have any
+    history_graph *graph;
+    tick_cache cache;
+    fan_stats *stats; // only the UI phase, the rest is timed by the worker
+    bool print_stats; // dump the stats on exit
+    int running; // running indicates fan control is active
+    // the control API, NULL if we're not serving it. Answers from state, and the sample of the same tick
+    api_server *api;
+    api_view view;
+    sensor_sample sample;
+    gint status_id;
     // used for minimization
     int visible; // is for minimization
-    // chatty or not
-    bool print_logs;
 } application;
 
 // declare some funcs that are in the wrong place
-int update_temps(gpointer data);
-void change_fan_speed(int new_speed, application *app);
+void reset_tick_cache(application *app);
+void render_state(application *app);
 
 // function to execute when we absolutely, for sure, unequivocally are shutting down
 void exit_app(application *app) {
-    if (app->running) {
-        g_source_remove(app->timeout);
+    fan_ctrl *ctrl = app->worker->ctrl;
+    int ret;
+    // once the control thread is gone, its control core is ours to look at
+    worker_stop(app->worker);
+    // "no" in the close dialog: the fan stays where it is, rather than going back to auto when the watchdog runs out
+    if (app->running && (ret = ctrl_release(ctrl)) != 0)
+        fprintf(stderr, "Unable to disarm the fan watchdog, the fan goes back to auto within %ds: %s\n", ctrl->watchdog, strerror(-ret));
+    if (ctrl->print_logs)
+        printf("Exit, %.1f wakeups per hour\n", sched_wakeups_per_hour(&ctrl->sched));
+    if (ctrl->print_logs)
+        ctrl_gate_dump(ctrl, stdout);
+    if (ctrl->telemetry != NULL) {
+        telemetry_close(ctrl->telemetry);
+        if (ctrl->print_logs)
+            printf("Telemetry: %lu records, %lu dropped, %lu writes, %lu rotations\n", ctrl->telemetry->records,
+                   ctrl->telemetry->dropped, ctrl->telemetry->writes, ctrl->telemetry->rotations);
+    }
+    if (app->print_stats) {
+        ctrl->stats->phases[STATS_UI] = app->stats->phases[STATS_UI];
+        stats_dump(ctrl->stats, stdout);
     }
-    if (app->print_logs)
-        printf("Exit\n");
     gtk_main_quit();
 }
 
-int get_cpu_temp(application *app) {
-    int temp = 0;
-    FILE *temp_input;
-    // get current CPU temp
-    temp_input = fopen("/proc/acpi/ibm/thermal","r");
-    if(temp_input == NULL){
-        gtk_label_set_text(app->current_lbl, "YOU ARE NOT RUNNING KERNEL WITH THINKPAD PATCH!");
-        return -1;
-    }
-    fscanf(temp_input, "temperatures:	%d", &temp);
-    fclose(temp_input);
-    return temp;
+// hand the configs as they are now to the control thread, restart to switch modes (or re-apply the current one)
+static void post_config(application *app, bool restart) {
+    worker_post(app->worker, app->ctrl, app->ctrl->mode, app->running);
+    if (restart) {
+        worker_request(app->worker, WORKER_REQ_RESTART);
+    }
 }
 
 int set_curve_values(fan_curve *curve) {
-    char tmp_string[250];
-    int temp_crit, temp_safe, delta, f_step;
-    gdouble throttle_val;
-    temp_crit = gtk_spin_button_get_value_as_int(curve->crit);
-    temp_safe = gtk_spin_button_get_value_as_int(curve->safe);
-    delta = gtk_spin_button_get_value_as_int(curve->delta);
-    throttle_val = gtk_range_get_value(GTK_RANGE(curve->throttle_scl));
-    if (temp_safe >= temp_crit || (temp_safe + delta) >= temp_crit) {
-        gtk_label_set_text(curve->config, "Save temperature must be < critical temperature - delta");
+    fan_ctrl *ctrl = curve->ctrl;
+    curve_config *cfg = &ctrl->curve_cfg, old = *cfg;
+    char tmp_string[400];
+    const char *err;
+    int len, i, f_step;
+    cfg->safe_temp = gtk_spin_button_get_value_as_int(curve->safe);
+    cfg->crit_temp = gtk_spin_button_get_value_as_int(curve->crit);
+    cfg->delta_temp = gtk_spin_button_get_value_as_int(curve->delta);
+    cfg->scan = gtk_spin_button_get_value_as_int(curve->scan_int);
+    cfg->safe_speed = gtk_combo_box_get_active(curve->safe_cmb);
+    cfg->crit_speed = gtk_combo_box_get_active(curve->crit_cmb);
+    cfg->throttle_factor = gtk_range_get_value(GTK_RANGE(curve->throttle_scl))/100;
+    cfg->step = gtk_combo_box_get_active(curve->inc_cmb) + 1;
+    // points, if given, take precedence over the linear curve
+    cfg->n_points = curve_parse_points(gtk_entry_get_text(curve->points), cfg->points, CURVE_POINTS_MAX);
+    if (cfg->n_points < 0) {
+        *cfg = old;
+        gtk_label_set_text(curve->config, "Curve points should look like 30:1 50:3 65:5 75:8 (max 16)");
         return 0;
     }
-    curve->safe_temp = temp_safe;
-    curve->crit_temp = temp_crit;
-    curve->delta_temp = delta;
-    curve->scan = gtk_spin_button_get_value_as_int(curve->scan_int);
-    curve->safe_speed = gtk_combo_box_get_active(curve->safe_cmb);
-    curve->crit_speed = gtk_combo_box_get_active(curve->crit_cmb);
-    curve->throttle_factor = throttle_val/100;
-    curve->step = gtk_combo_box_get_active(curve->inc_cmb) + 1; // @TODO check for 0
-    f_step = (int) ((double) delta * curve->throttle_factor);
+    // validate and compile the curve once, the ticks just look up the level in the compiled table
+    if ((err = ctrl_compile(ctrl, CTRL_CURVE)) != NULL) {
+        *cfg = old;
+        gtk_label_set_text(curve->config, err);
+        return 0;
+    }
+    f_step = ctrl->curve_table.hysteresis;
     // ok, we have some settings, let's write it out
-    sprintf(tmp_string,
-            "Fan speed @ safe temp %d: %s\nFan speed step %d per %d degrees\nFan speed @ critical temp %d: %s\nScan every %ds\nThrottle factor: %.2f (%d)",
-            temp_safe, fan_speeds[curve->safe_speed], curve->step, curve->delta_temp, temp_crit, fan_speeds[curve->crit_speed], curve->scan, curve->throttle_factor, f_step);
+    if (cfg->n_points > 0) {
+        len = sprintf(tmp_string, "Fan curve:");
+        for (i = 0; i < cfg->n_points; i++) {
+            len += sprintf(tmp_string + len, " %dC: %s", cfg->points[i].temp, fan_speeds[cfg->points[i].level]);
+        }
+        len += sprintf(tmp_string + len, "\nScan every %ds\nThrottle factor: %.2f (%d)", cfg->scan, cfg->throttle_factor, f_step);
+    } else {
+        len = sprintf(tmp_string,
+                "Fan speed @ safe temp %d: %s\nFan speed step %d per %d degrees\nFan speed @ critical temp %d: %s\nScan every %ds\nThrottle factor: %.2f (%d)",
+                cfg->safe_temp, fan_speeds[cfg->safe_speed], cfg->step, cfg->delta_temp, cfg->crit_temp, fan_speeds[cfg->crit_speed], cfg->scan, cfg->throttle_factor, f_step);
+    }
+    // so you know what a level sounds like before picking it
+    len += sprintf(tmp_string + len, "\nRPM per level: ");
+    if (rpm_map_format(curve->rpm_map, tmp_string + len, sizeof(tmp_string) - len) == 0) {
+        snprintf(tmp_string + len, sizeof(tmp_string) - len, "not known yet");
+    }
     gtk_label_set_text(curve->config, tmp_string);
     return 1;
 }
 
+// the other way around: put a curve (ie from -C) in the widgets, set_curve_values picks it up from there
+void show_curve_values(fan_curve *curve, const curve_config *cfg) {
+    gtk_spin_button_set_value(curve->safe, cfg->safe_temp);
+    gtk_spin_button_set_value(curve->crit, cfg->crit_temp);
+    gtk_spin_button_set_value(curve->delta, cfg->delta_temp);
+    gtk_combo_box_set_active(curve->safe_cmb, cfg->safe_speed);
+    gtk_combo_box_set_active(curve->crit_cmb, cfg->crit_speed);
+    gtk_combo_box_set_active(curve->inc_cmb, cfg->step - 1);
+    gtk_range_set_value(GTK_RANGE(curve->throttle_scl), cfg->throttle_factor * 100);
+    // points would take precedence
+    gtk_entry_set_text(curve->points, "");
+}
+
+int set_pid_values(fan_pid *pid) {
+    fan_ctrl *ctrl = pid->ctrl;
+    pid_config *cfg = &ctrl->pid_cfg, old = *cfg;
+    char tmp_string[250];
+    const char *err;
+    cfg->target = gtk_spin_button_get_value_as_int(pid->target);
+    cfg->scan = gtk_spin_button_get_value_as_int(pid->scan_int);
+    cfg->kp = gtk_spin_button_get_value(pid->kp);
+    cfg->ki = gtk_spin_button_get_value(pid->ki);
+    cfg->kd = gtk_spin_button_get_value(pid->kd);
+    cfg->dwell = gtk_spin_button_get_value_as_int(pid->dwell);
+    cfg->min_level = gtk_combo_box_get_active(pid->min_cmb);
+    cfg->max_level = gtk_combo_box_get_active(pid->max_cmb);
+    if ((err = ctrl_compile(ctrl, CTRL_PID)) != NULL) {
+        *cfg = old;
+        gtk_label_set_text(pid->config, err);
+        return 0;
+    }
+    sprintf(tmp_string,
+            "Target temp: %d\nGains: P %.2f, I %.3f, D %.1f\nFan speed between %s and %s, kept at least %ds\nScan every %ds",
+            cfg->target, cfg->kp, cfg->ki, cfg->kd, fan_speeds[cfg->min_level], fan_speeds[cfg->max_level], cfg->dwell, cfg->scan);
+    gtk_label_set_text(pid->config, tmp_string);
+    return 1;
+}
+
 int set_auto_values(application *data) {
+    auto_config *cfg = &data->ctrl->auto_cfg, old = *cfg;
     char tmp_string[250];
-    int temp_crit, temp_safe;
-    temp_crit = gtk_spin_button_get_value_as_int(data->crit);
-    temp_safe = gtk_spin_button_get_value_as_int(data->safe);
-    // check input
-    if (temp_safe >= temp_crit) {
-        gtk_label_set_text(data->auto_lbl, "Safe temperature must be < critical temperature");
+    const char *err;
+    cfg->temp_crit = gtk_spin_button_get_value_as_int(data->crit);
+    cfg->temp_safe = gtk_spin_button_get_value_as_int(data->safe);
+    cfg->fan_speed = gtk_combo_box_get_active(data->auto_cmb);
+    cfg->scan_interval = gtk_spin_button_get_value_as_int(data->auto_int);
+    // check input, and compile it into the table the ticks use
+    if ((err = ctrl_compile(data->ctrl, CTRL_AUTO)) != NULL) {
+        *cfg = old;
+        gtk_label_set_text(data->auto_lbl, err);
         return 0;
     }
-    // update profile now that we know the temps make sense
-    data->temp_crit = temp_crit;
-    data->temp_safe = temp_safe;
-    data->fan_speed = gtk_combo_box_get_active(data->auto_cmb);
-    data->scan_interval = gtk_spin_button_get_value_as_int(data->auto_int);
     sprintf(
         tmp_string,
         "Current options: Safe: %d, Critical: %d, Scan interval: %d\nFan speed when critical: %s",
-        data->temp_safe,
-        data->temp_crit,
-        data->scan_interval,
-        fan_speeds[data->fan_speed]
+        cfg->temp_safe,
+        cfg->temp_crit,
+        cfg->scan_interval,
+        fan_speeds[cfg->fan_speed]
     );
     gtk_label_set_text(data->auto_lbl, tmp_string);
     if (!data->running) {
@@ -204,25 +301,26 @@ int set_auto_values(application *data) {
 }
 
 void set_manual_values(application *data) {
-    data->fan_speed = gtk_combo_box_get_active(data->man_cmb);
-    data->scan_interval = gtk_spin_button_get_value_as_int(data->man_int);
+    data->ctrl->manual_cfg.fan_speed = gtk_combo_box_get_active(data->man_cmb);
+    data->ctrl->manual_cfg.scan_interval = gtk_spin_button_get_value_as_int(data->man_int);
 }
 
 // close application
 void window_destroy(GtkWidget *object, gpointer data) {
     char tmp_str[100];
     application *app = data;
-    // remove timeout if running
+    int level = app->state.res.level;
+    // stop fan control if running
     if (app->running) {
-        if (app->fan_speed == 0) {
+        if (level == FAN_LVL_AUTO) {
             // fan speed is already in auto, we don't need to prompt to set it to auto, just silently exit
-            if (app->print_logs)
+            if (app->ctrl->print_logs)
                 printf("Fan already in auto, timout removed, exit\n");
             exit_app(app);
             return;
         }
         // show close dialog
-        sprintf(tmp_str, "Current fan speed: %s (%d)", fan_speeds[app->fan_speed], app->fan_speed);
+        sprintf(tmp_str, "Current fan speed: %s (%d)", fan_speeds[level], level);
         gtk_label_set_text(app->close_lbl, tmp_str);
         gtk_widget_show(GTK_WIDGET(app->close));
         return;
@@ -240,62 +338,62 @@ void hide_window(GtkStatusIcon *status_icon, gpointer user_data) {
     }
     gtk_widget_show(GTK_WIDGET(app->window));
     app->visible = 1;
+    // whatever happened while we were in the tray, in one go
+    render_state(app);
 }
 
 void apply_fan_curve(GtkWidget *object, gpointer data) {
     application *app = data;
     fan_curve *curve = app->curve;
-    // all values that may change
-    int old_scan;
-    old_scan = curve->scan;
     if (!set_curve_values(curve)) {
         fprintf(stderr, "Curve input is incorrect");
         return;
     }
     // first check if we are already running a curve:
-    if (app->running && app->manual == 2) {
-        // we are already running the curve. If the interval hasn't changed, then the next callback will apply the new curve values
-        // so we don't really need to check any of the other values anyway
-        if (old_scan != curve->scan) {
-            // new interval, set the timeout
-            g_source_remove(app->timeout);
-            // we do want update_temps to handle this stuff better, this callback will probably be changed
-            app->timeout = g_timeout_add_seconds(app->scan_interval, update_temps, data);
-            return;
-        }
-        // we can just ignore this, the change will be picked up next time the callback is invoked
+    if (app->running && app->ctrl->mode == CTRL_CURVE) {
+        // we are already running the curve, the control thread picks up the new values on its next tick
+        // if the interval has changed, it counts the new one from now
+        post_config(app, false);
         return;
     }
-    // now, are we running?
-    if (app->running) {
-        // yes, remove timeout
-        g_source_remove(app->timeout);
-    } else {
-        app->fan_speed = FAN_LVL_AUTO; // assume auto -> this is most likely the value on startup
+    if (!app->running) {
         gtk_widget_set_sensitive(app->off_btn, TRUE);
     }
-    // either way, now we are running, in mode 2
+    // either way, now we are running the curve
     app->running = 1;
-    app->manual = 2;
-    if (update_temps(data)) {
-        // set timeout
-        app->timeout = g_timeout_add_seconds(app->curve->scan, update_temps, data);
+    app->ctrl->mode = CTRL_CURVE;
+    // labels may have been changed by the apply, make sure the next tick redraws them
+    reset_tick_cache(app);
+    post_config(app, true);
+}
+
+void apply_pid(GtkWidget *object, gpointer data) {
+    application *app = data;
+    if (!set_pid_values(app->pid)) {
+        fprintf(stderr, "PID input is incorrect");
+        return;
+    }
+    if (!app->running) {
+        gtk_widget_set_sensitive(app->off_btn, TRUE);
     }
+    app->running = 1;
+    app->ctrl->mode = CTRL_PID;
+    reset_tick_cache(app);
+    // always restart: gains that don't match what the integral built up on would kick the fan
+    post_config(app, true);
 }
 
 // apply new auto config
 void apply_auto_speed(GtkWidget *object, gpointer data) {
-    int old_safe, old_crit, old_fan_speed, old_interval;
+    auto_config old, *cfg;
     char config_str[80];
     application *app = data;
     if (data == NULL) {
         fprintf(stderr, "NO DATA POINTER PASSED");
         return;
     }
-    old_safe = app->temp_safe;
-    old_crit = app->temp_crit;
-    old_fan_speed = app->fan_speed;
-    old_interval = app->scan_interval;
+    cfg = &app->ctrl->auto_cfg;
+    old = *cfg;
     // get the values we want to apply:
     // let's see if the old profile was actually changed
     if (!set_auto_values(app)) {
@@ -303,220 +401,169 @@ void apply_auto_speed(GtkWidget *object, gpointer data) {
         return;
     }
     // should we actually do anything? if we are running, not in manual, and no values were changed, we are done
-    if (app->running && !app->manual && old_safe == app->temp_safe && old_crit == app->temp_crit && old_fan_speed == app->fan_speed && old_interval == app->scan_interval) {
+    if (app->running && app->ctrl->mode == CTRL_AUTO && old.temp_safe == cfg->temp_safe && old.temp_crit == cfg->temp_crit && old.fan_speed == cfg->fan_speed && old.scan_interval == cfg->scan_interval) {
         return;
     }
     // now we know something has changed, and so we MUST do something
-    if (app->running) {
-        // we were running, so clear the timeout
-        g_source_remove(app->timeout);
-    } else {
+    if (!app->running) {
         gtk_widget_set_sensitive(app->off_btn, TRUE);
     }
-    sprintf(config_str, AUTO_LBL_FMT, app->scan_interval, app->temp_crit, app->temp_safe, fan_speeds[app->fan_speed]);
+    sprintf(config_str, AUTO_LBL_FMT, cfg->scan_interval, cfg->temp_crit, cfg->temp_safe, fan_speeds[cfg->fan_speed]);
     gtk_label_set_text(app->auto_lbl, config_str);
     // if we were able to apply the new profile successfully...
     app->running = 1;
-    app->manual = 0;
-    if (update_temps(data)) {
-        app->timeout = g_timeout_add_seconds(app->scan_interval, update_temps, data);
-    }
+    app->ctrl->mode = CTRL_AUTO;
+    // labels may have been changed by the apply, make sure the next tick redraws them
+    reset_tick_cache(app);
+    post_config(app, true);
 }
 
 // apply manual fan speed
 void apply_manual_speed(GtkWidget *object, gpointer data) {
     application *app = data;
-    int old_fan_speed = app->fan_speed;
-    int old_interval = app->scan_interval; // check if we need to update this
+    manual_config old = app->ctrl->manual_cfg, *cfg = &app->ctrl->manual_cfg; // check if we need to update this
     // get current values from input
     set_manual_values(app);
     // first, make sure we aren't already running in manual mode, and nothing has changed
-    if (app->running && app->manual && app->fan_speed == old_fan_speed && app->scan_interval == old_interval) {
+    if (app->running && app->ctrl->mode == CTRL_MANUAL && cfg->fan_speed == old.fan_speed && cfg->scan_interval == old.scan_interval) {
         return;
     }
-    if (app->running) {
-        // remove timeout...
-        g_source_remove(app->timeout);
-    } else {
+    if (!app->running) {
         // we were not yet running fan control, we are now, so enable the stop button
         gtk_widget_set_sensitive( app->off_btn, TRUE);
     }
-    // first up, let's change the fan speed
-    change_fan_speed(app->fan_speed, app);
-    // mark as running, manually
+    // mark as running, manually, the control thread changes the fan speed
     app->running = 1;
-    app->manual = 1;
-    if (update_temps(data)) {
-        app->timeout = g_timeout_add_seconds(app->scan_interval, update_temps, data);
-    }
-}
-
-void change_fan_speed(int new_speed, application *app) {
-    char speed_str[15], tmp_str[80];
-    switch(new_speed) {
-        case 0:
-            strncpy(speed_str, "auto", 5);
-            break;
-        case FAN_LVL_FULL:
-            strncpy(speed_str, "full-speed", 11);
-            break;
-        default:
-            sprintf(speed_str, "%d", new_speed);
-    }
-    sprintf(tmp_str, "echo level %s > /proc/acpi/ibm/fan", speed_str);
-    system(tmp_str);
-    if (app->print_logs)
-        printf("Fan speed set to %s - config specified: %s\n", fan_speeds[new_speed], fan_speeds[app->fan_speed]); // this is a bit of an odd message when in curve mode
+    app->ctrl->mode = CTRL_MANUAL;
+    // labels may have been changed by the apply, make sure the next tick redraws them
+    reset_tick_cache(app);
+    post_config(app, true);
 }
 
 static void
 curve_value_changed(GtkScale *scale, gpointer obj) {
-    fan_curve *curve = obj;
+    application *app = obj;
+    fan_ctrl *ctrl = app->curve->ctrl;
     gdouble value = gtk_range_get_value(GTK_RANGE(scale));
-    curve->throttle_factor = value/100;
-    // printf("New value is %f\n", value);
+    ctrl->curve_cfg.throttle_factor = value/100;
+    // the decrement threshold applies straight away, if the applied config is somehow invalid, the old table is kept
+    if (ctrl_compile(ctrl, CTRL_CURVE) == NULL) {
+        post_config(app, false);
+    }
 }
 
-int curve_fan_speed_for_temp(fan_curve *curve, int temp) {
-    int speed, step, max, bracket, f_step;
-    // If the temperature drops below a certain threshold, we don't want to instantly throttle down
-    // we want to make sure we drop below said temp by a given factor
-    // safe temperature can do whatever, we just ramp down, no factor applied
-    f_step = (int) ((double) curve->delta_temp * curve->throttle_factor);
-    speed = curve->safe_speed;
-    step = curve->step;
-    bracket = curve->safe_temp;
-    max = curve->crit_temp;
-    // for critical, or safe temps, we don't check the factor.
-    if (temp >= max) {
-        // critical speed reached, return here
-        return curve->crit_speed;
-    } else if (temp <= bracket) {
-        // bracket is safe temp here, so we know whether or not we can throttle down immediately
-        return speed;
-    }
-    // now the temp measured should be increased by the factor
-    temp += f_step;
-    while(bracket < temp) {
-        bracket += curve->delta_temp;
-        speed += step;
-        // step is above full
-        if (speed > FAN_LVL_FULL) {
-            fprintf(stderr, "looks like it was possible to hit full fan speed before hitting critical temp\n");
-            return FAN_LVL_FULL;
-        }
-    }
-    return speed;
+void reset_tick_cache(application *app) {
+    memset(&app->cache, 0, sizeof(app->cache));
 }
 
-// timeout callback, keeps being called while  we are actually running
-int update_temps(gpointer data) {
-    application *app = data; // this gives us access to the components, mode, and so on
+// format a wall-clock time (usec since epoch, as returned by g_get_real_time) as HH:MM:SS
+static void format_clock(gint64 usec, char *buf, size_t len) {
+    struct tm tm;
+    time_t secs = usec / G_USEC_PER_SEC;
+    localtime_r(&secs, &tm);
+    strftime(buf, len, "%H:%M:%S", &tm);
+}
+
+// label formats per control event, take the fan level and the message
+static const char *event_fmts[] = {
+    [CTRL_STEADY] = "Fan level - %s\n%s",
+    [CTRL_LEVEL_UP] = "Fan level up - %s\n%s",
+    [CTRL_LEVEL_DOWN] = "Fan level down- %s\n%s",
+    [CTRL_CRIT_ENTER] = "Temperature is critical, Fan level set to %s\n%s",
+    [CTRL_CRIT_LEAVE] = "Temperature is safe, Fan level set to %s\n%s",
+    [CTRL_SAFE] = "SAFE - Fan level:  %s\n%s",
+    [CTRL_CRIT] = "CRITICAL - Fan level: %s\n%s",
+    [CTRL_FAN_STALLED] = "FAN STALLED at level %s!\n%s",
+    [CTRL_FAN_MISMATCH] = "Fan speed is off for level %s\n%s",
+};
+
+// bring the status bar, label and graph in line with the state the controller last published
+// only touches what would actually look different
+void render_state(application *app) {
+    const ctrl_state *state = &app->state;
+    const ctrl_result *res = &state->res;
+    tick_cache *cache = &app->cache;
     char tmp_string[250] = {'\0'};
-    char time_str[10] = {'\0'};
-    char message[100] = {'\0'};
-    FILE *sys_in;
-    // get current CPU temp
-    int temp = get_cpu_temp(app);
-    if (temp == -1) {
-        return FALSE;
-    }
-    // get current timestamp
-    sys_in = popen("date '+%H:%M:%S'","r");
-    fgets(time_str, 9, sys_in);
-    pclose(sys_in);
-
-    sprintf(message, "CPU Temp: %d C, Checked at %s", temp, time_str);
-    if (app->manual == 1) {
-        // full message for status bar:
-        sprintf(tmp_string, "Manual control is active! - %s", message);
-    } else if (app->manual == 2) {
-        sprintf(tmp_string, "Curve control is active! - %s", message);
-    } else {
-        sprintf(tmp_string, "Automatic control - %s", message);
-    }
-    // push temp to status bar
-    gtk_statusbar_remove(app->status_bar, 0, app->status_id);
-    app->status_id = gtk_statusbar_push(app->status_bar, 0, tmp_string);
-    if (app->manual == 1) {
-        sprintf(tmp_string,"Fan level - %s\n%s", fan_speeds[app->fan_speed], message);
-    } else if (app->manual == 2) {
-        // this is where we handle the fan curve stuff, starting with the simple things:
-        if ((temp + app->curve->delta_temp) <= app->curve->safe_temp) {
-            // on or below safe + 1 delta
-            if (app->fan_speed != app->curve->safe_speed) {
-                change_fan_speed(app->curve->safe_speed, app);
-                app->fan_speed = app->curve->safe_speed;
-            }
-            sprintf(tmp_string,"Fan level - %s\n%s", fan_speeds[app->fan_speed], message);
-        } else if (temp >= app->curve->crit_temp) {
-            if (app->fan_speed != app->curve->crit_speed) {
-                change_fan_speed(app->curve->crit_speed, app);
-                app->fan_speed = app->curve->crit_speed;
-            }
-            sprintf(tmp_string,"Fan level - %s\n%s", fan_speeds[app->fan_speed], message);
+    const char *lbl_fmt;
+    gint64 second;
+    int len, i;
+    bool message_changed = false;
+    if (state->seq == cache->seq) {
+        return;
+    }
+    cache->seq = state->seq;
+    // no need to format the time of the tick again if it's still the same second
+    second = state->ms / 1000;
+    if (second != cache->second) {
+        format_clock(second * G_USEC_PER_SEC, cache->time_str, sizeof(cache->time_str));
+        cache->second = second;
+        message_changed = true;
+    }
+    if (message_changed || res->temp != cache->temp || res->rpm != cache->rpm || state->mode != cache->mode || state->power != cache->power
+        || memcmp(state->fan_levels, cache->fan_levels, sizeof(int) * state->n_fans) != 0
+        || memcmp(state->fan_temps, cache->fan_temps, sizeof(int) * state->n_fans) != 0) {
+        cache->temp = res->temp;
+        cache->rpm = res->rpm;
+        cache->mode = state->mode;
+        cache->power = state->power;
+        memcpy(cache->fan_levels, state->fan_levels, sizeof(int) * state->n_fans);
+        memcpy(cache->fan_temps, state->fan_temps, sizeof(int) * state->n_fans);
+        if (res->rpm != RPM_UNKNOWN) {
+            sprintf(cache->message, "CPU Temp: %d C, Fan: %d RPM, Checked at %s", res->temp, res->rpm, cache->time_str);
         } else {
-            app->curve->fan_speed = curve_fan_speed_for_temp(app->curve, temp);
-            // and here's where we need to calculate the steps, and corresponding fan speed
-            if (app->curve->fan_speed == app->fan_speed) {
-                // no changes in fan speed
-                sprintf(tmp_string,"Fan level - %s\n%s", fan_speeds[app->fan_speed], message);
-            } else {
-                if (app->curve->fan_speed < app->fan_speed) {
-                    sprintf(tmp_string,"Fan level down- %s\n%s", fan_speeds[app->curve->fan_speed], message);
-                } else {
-                    sprintf(tmp_string,"Fan level up - %s\n%s", fan_speeds[app->curve->fan_speed], message);
-                }
-                change_fan_speed(app->curve->fan_speed, app);
-                app->fan_speed = app->curve->fan_speed;
-            }
+            sprintf(cache->message, "CPU Temp: %d C, Checked at %s", res->temp, cache->time_str);
         }
-    } else {
-        if (temp >= app->temp_crit && !app->was_crit) {
-            // we are just now running too hot, ramp up fans
-            change_fan_speed(app->fan_speed, app);
-            app->was_crit = 1;
-            sprintf(tmp_string, "Temperature is critical, Fan level set to %s\n%s", fan_speeds[app->fan_speed], message);
-        } else if (app->was_crit) {
-            // cooled down to below crit, but we WERE running at crit speed -> move back to auto
-            change_fan_speed(FAN_LVL_AUTO, app);
-            app->was_crit = 0;
-            sprintf(tmp_string, "Temperature is safe, Fan level set to %s\n%s", fan_speeds[FAN_LVL_AUTO], message);
-        } else if (!app->was_crit) {
-            // we're below critical
-            sprintf(tmp_string,"SAFE - Fan level:  %s\n%s", fan_speeds[FAN_LVL_AUTO], message);
+        if (state->mode == CTRL_MANUAL) {
+            // full message for status bar:
+            sprintf(tmp_string, "Manual control is active! - %s", cache->message);
+        } else if (state->mode == CTRL_CURVE) {
+            sprintf(tmp_string, "Curve control is active! - %s", cache->message);
+        } else if (state->mode == CTRL_PID) {
+            sprintf(tmp_string, "PID control is active! - %s", cache->message);
         } else {
-            // still above critical
-            sprintf(tmp_string,"CRITICAL - Fan level: %s\n%s", fan_speeds[app->fan_speed], message);
+            sprintf(tmp_string, "Automatic control - %s", cache->message);
+        }
+        len = strlen(tmp_string);
+        for (i = 0; i < state->n_fans; i++) {
+            len += sprintf(tmp_string + len, ", Fan %d: %s (%d C)", i + 2,
+                           state->fan_levels[i] < 0 ? "?" : fan_speeds[state->fan_levels[i]], state->fan_temps[i]);
         }
+        if (state->power == POWER_BATTERY) {
+            sprintf(tmp_string + len, " (battery profile)");
+        }
+        // push temp to status bar
+        gtk_statusbar_remove(app->status_bar, 0, app->status_id);
+        app->status_id = gtk_statusbar_push(app->status_bar, 0, tmp_string);
+        message_changed = true;
+    }
+    // set label accordingly, but only if it would actually say something different
+    lbl_fmt = event_fmts[res->event];
+    if (message_changed || lbl_fmt != cache->lbl_fmt || res->level != cache->lbl_speed) {
+        cache->lbl_fmt = lbl_fmt;
+        cache->lbl_speed = res->level;
+        sprintf(tmp_string, lbl_fmt, fan_speeds[res->level], cache->message);
+        gtk_label_set_text(app->current_lbl, tmp_string);
+    }
+    if (memcmp(&state->rpm_map, &cache->rpm_map, sizeof(rpm_map)) != 0) {
+        cache->rpm_map = state->rpm_map;
+        len = sprintf(tmp_string, "Fan RPM per level: ");
+        if (rpm_map_format(&state->rpm_map, tmp_string + len, sizeof(tmp_string) - len) > 0) {
+            gtk_label_set_text(app->rpm_lbl, tmp_string);
+        }
+    }
+    // paint the columns for the ticks we haven't shown yet
+    if (app->history != NULL) {
+        graph_update(app->graph);
     }
-    // set label accordingly
-    gtk_label_set_text(app->current_lbl, tmp_string);
-    return TRUE;
-}
-
-static GtkStatusIcon *create_tray_icon() {
-    GtkStatusIcon *tray_icon = gtk_status_icon_new();
-
-    // g_signal_connect(G_OBJECT(tray_icon), "popup-menu",G_CALLBACK(tray_icon_on_menu), NULL);
-    gtk_status_icon_set_from_file(tray_icon, "data/icon.png");
-    // gtk_status_icon_set_tooltip(tray_icon, "ThinkPad Fan Control .:: level - auto ::.");
-    gtk_status_icon_set_visible(tray_icon, TRUE);
-
-    return tray_icon;
 }
 
-void notebook_switch(GtkNotebook *nb, GtkWidget *page, guint page_num, gpointer data) {
-    application *app = data;
-    if (app->running) {
-        // we're running - so we don't have to update the label
-        return;
-    }
+// the label while fan control isn't running: what the page does, and the last CPU temp we got
+static void show_idle_label(application *app, int page_num) {
     char current_txt[80];
     const char *lbl_fmt = "%s\nCPU temp: %d"; // max should be below 80
-    int temp = get_cpu_temp(app);
+    int temp = app->idle_temp;
     if (temp == -1) {
-        // error, the label has been set with the error message, we're done
+        gtk_label_set_text(app->current_lbl, NO_THINKPAD_MSG);
         return;
     }
     switch (page_num) {
@@ -529,24 +576,108 @@ void notebook_switch(GtkNotebook *nb, GtkWidget *page, guint page_num, gpointer
         case 2:
             sprintf(current_txt, lbl_fmt, "Apply the configured fan curve", temp);
             break;
+        case 3:
+            sprintf(current_txt, lbl_fmt, "Apply to hold the target temperature", temp);
+            break;
+        case 4:
+            sprintf(current_txt, lbl_fmt, "History is recorded while fan control is running", temp);
+            break;
         default:
             sprintf(current_txt, lbl_fmt, "", temp);
     }
     gtk_label_set_text(app->current_lbl, current_txt);
 }
 
-void stop_fan_monitor(GtkWidget *object, gpointer data) {
+// called on the GTK thread for everything the control thread sends us
+static void worker_message(const worker_msg *msg, gpointer data) {
     application *app = data;
-    if (app->running) {
-        g_source_remove(app->timeout);
+    unsigned long long ui_start;
+    switch (msg->event) {
+        case WORKER_TICK:
+            if (!app->running) {
+                // queued before we stopped, the idle label is showing by now
+                break;
+            }
+            app->state = msg->state;
+            if (app->api != NULL) {
+                app->sample = msg->sample;
+                api_publish(app->api, &app->view);
+            }
+            if (app->history != NULL) {
+                history_add(app->history, msg->state.ms, &msg->sample, msg->state.res.level, msg->state.res.rpm);
+            }
+            // while we're in the tray, nobody is looking: skip the view, hide_window catches up when we're shown again
+            if (app->visible) {
+                ui_start = stats_now_ns();
+                render_state(app);
+                stats_record(app->stats, STATS_UI, stats_now_ns() - ui_start);
+            }
+            break;
+        case WORKER_READ_FAILED:
+            gtk_label_set_text(app->current_lbl, NO_THINKPAD_MSG);
+            break;
+        case WORKER_TEMP:
+            app->idle_temp = msg->state.res.temp;
+            if (!app->running) {
+                show_idle_label(app, gtk_notebook_get_current_page(app->main_nb));
+            }
+            break;
+        case WORKER_STATS:
+            // the worker timed everything but the UI
+            msg->stats->phases[STATS_UI] = app->stats->phases[STATS_UI];
+            stats_dump(msg->stats, stdout);
+            g_free(msg->stats);
+            break;
     }
-    if (app->fan_speed != FAN_LVL_AUTO) {
-        app->fan_speed = FAN_LVL_AUTO;
-        change_fan_speed(FAN_LVL_AUTO, app);
+}
+
+static gboolean dump_stats(gpointer data) {
+    application *app = data;
+    // the counters belong to the control thread, it sends us a copy
+    worker_request(app->worker, WORKER_REQ_STATS);
+    return G_SOURCE_CONTINUE;
+}
+
+// kill (or ^C in the terminal) shouldn't leave the fan on whatever level we set last
+static gboolean quit_signal(gpointer data) {
+    application *app = data;
+    if (app->ctrl->print_logs)
+        printf("Signal received, fan back to auto, exit\n");
+    app->running = 0;
+    post_config(app, false);
+    exit_app(app);
+    return G_SOURCE_REMOVE;
+}
+
+static GtkStatusIcon *create_tray_icon() {
+    GtkStatusIcon *tray_icon = gtk_status_icon_new();
+
+    // g_signal_connect(G_OBJECT(tray_icon), "popup-menu",G_CALLBACK(tray_icon_on_menu), NULL);
+    gtk_status_icon_set_from_file(tray_icon, "data/icon.png");
+    // gtk_status_icon_set_tooltip(tray_icon, "ThinkPad Fan Control .:: level - auto ::.");
+    gtk_status_icon_set_visible(tray_icon, TRUE);
+
+    return tray_icon;
+}
+
+void notebook_switch(GtkNotebook *nb, GtkWidget *page, guint page_num, gpointer data) {
+    application *app = data;
+    if (app->running) {
+        // we're running - so we don't have to update the label
+        return;
     }
+    show_idle_label(app, page_num);
+    // the label is updated again when the control thread has a fresh temperature for us
+    worker_request(app->worker, WORKER_REQ_READ);
+}
+
+void stop_fan_monitor(GtkWidget *object, gpointer data) {
+    application *app = data;
     // this may not always be needed, but still, doesn't hurt
     app->running = 0;
-    app->manual = 0;
+    app->ctrl->mode = CTRL_AUTO;
+    // back to auto
+    post_config(app, false);
     // set the labels to whatever values we need them to be for the text to be relevant
     notebook_switch(app->main_nb, NULL, gtk_notebook_get_current_page(app->main_nb), app); // the page is irrelevant, we can safely pass in NULL
     // disable button
@@ -556,7 +687,9 @@ void stop_fan_monitor(GtkWidget *object, gpointer data) {
 void dialog_yes(GtkButton *close_y, gpointer data) {
     application *app = data;
     gtk_widget_hide(GTK_WIDGET(app->close));
-    change_fan_speed(FAN_LVL_AUTO, app);
+    // put the fan back on auto, the control thread does that before it quits
+    app->running = 0;
+    post_config(app, false);
     exit_app(app);
 }
 
@@ -569,24 +702,101 @@ void dialog_no(GtkButton *close_n, gpointer data) {
 void dialog_close(GtkButton *close_c, gpointer data) {
     application *app = data;
     gtk_widget_hide(GTK_WIDGET(app->close));
-    // no call to exit_app, timeout (if any) remains active
+    // no call to exit_app, fan control (if any) remains active
     // just hide the close dialog widget, and carry on
 }
 
+// a mode command from the API compiled into app->ctrl, like apply does from the widgets (which don't follow)
+static void gui_api_mode(void *data, ctrl_mode mode, bool running) {
+    application *app = data;
+    if (!running) {
+        stop_fan_monitor(GTK_WIDGET(app->off_btn), app);
+        return;
+    }
+    if (!app->running) {
+        gtk_widget_set_sensitive(GTK_WIDGET(app->off_btn), TRUE);
+    }
+    app->ctrl->mode = mode;
+    app->running = 1;
+    reset_tick_cache(app);
+    post_config(app, true);
+    if (app->ctrl->print_logs)
+        printf("API: running %s control\n", ctrl_mode_name(mode));
+}
+
+static gboolean api_ready(gint fd, GIOCondition condition, gpointer data) {
+    application *app = data;
+    api_check(app->api, &app->view, app->ctrl, gui_api_mode, app);
+    return G_SOURCE_CONTINUE;
+}
+
 void print_help(char const *bin) {
     printf("%s Usage:\n\
             -v : Verbose, print logs to stdout (default false)\n\
-            -h : Help - display this message\n", bin);
+            -p <path> : Control a hwmon pwm channel (e.g. /sys/class/hwmon/hwmon3/pwm1) instead of %s\n\
+            -f <fan> : Another fan on a curve of its own, pwm_path:sensors:points, the sensors by name or number as name[*weight]+... (e.g. /sys/class/hwmon/hwmon3/pwm2:GPU:40:1,60:4,75:8), up to %d times\n\
+            -t <filter> : Fuse and smooth the temperatures, fuse:smooth:window:sample_ms[:sensors], fuse is max or mean, smooth none, ema or median (e.g. max:median:5:1000:thinkpad0+coretemp/temp1*2)\n\
+            -C <curve> : Fill in the curve tab, safe:safe_level:delta:step:critical:critical_level:throttle%% (e.g. what fan_tune came up with)\n\
+            -g <gate> : Hold fan levels for at least dwell seconds, and move at most max_step levels at a time, dwell:max_step (e.g. 10:2), increases near critical always go through\n\
+            -m : Mock fan, don't touch the hardware (for testing the UI)\n\
+            -r <dir> : Look for procfs and sysfs files under <dir> instead of / (ie a tree made by fan_fixture)\n\
+            -s : Print tick timings and counters on exit (they're also printed on SIGUSR1)\n\
+            -a <ms> : Adaptive sampling, check temps between every <ms> and the scan interval, depending on how fast they change\n\
+            -e : Wake up when a thermal trip point (or hwmon alarm) we set is crossed, rather than polling, if there are writable ones\n\
+            -W <seconds> : thinkpad_acpi fan watchdog, the EC takes over if we stop checking for this long (default %d, 0 for off)\n\
+            -R <file> : Keep the learned level to RPM map in <file>, loaded on start and saved on exit\n\
+            -b <profile> : On battery, override the settings with key=value;... (scan, adaptive, level, safe, crit, curve, points, pid), e.g. \"scan=20;points=45:1,70:4,80:8\"\n\
+            -F <load> : Curve control adds levels for CPU load, util_start%%:util_full%%:watts_start:watts_full:max_boost (e.g. 50:90:10:25:3)\n\
+            -u <path> : Serve the control and telemetry API on this Unix socket (e.g. %s, with sudo it's made as your user, so pick a directory you can write to)\n\
+            -L <log> : Append every tick to a binary telemetry log, path[:max_mb[:files[:batch[:flush_s]]]] (default 16MB, 4 files, every 64 ticks or 60s), read it with fan_log\n\
+            -U <user> : Started as root, run the GUI as <user>, and leave the fan to a helper process (default: the user behind sudo or pkexec)\n\
+            -h : Help - display this message\n", bin, FAN_PROC_PATH, CTRL_FANS_MAX, FAN_WATCHDOG_MAX, API_SOCKET_PATH);
 }
 
 int main(int argc, char** argv) {
-    bool print_logs = false;
-    int c;
+    bool print_logs = false, mock_fan = false, print_stats = false, use_trips = false, use_load = false;
+    int c, ret, adaptive_ms = 0, watchdog = FAN_WATCHDOG_MAX, n_fans = 0, i;
+    char const *pwm_path = NULL, *root = NULL, *invalid, *rpm_path = NULL, *battery = NULL, *api_path = NULL, *user = NULL;
+    fan_actuator fan, *helper_fans[HELPER_FANS_MAX], fans[CTRL_FANS_MAX];
+    fan_spec fan_specs[CTRL_FANS_MAX];
+    sensor_set sensors;
+    fan_ctrl ctrl, config;
+    fan_worker worker;
+    fan_history history;
+    fan_stats stats, ui_stats;
+    trip_watch trips;
+    load_config load_cfg;
+    load_watch load;
+    filter_config filter_cfg;
+    curve_config curve_cfg;
+    bool use_curve = false;
+    filter_channel chan;
+    char filter_sensors[FILTER_LIST_LEN] = "";
+    bool use_filter = false;
+    gate_config gate_cfg = { 0 };
+    rpm_watch rpm;
+    power_watch power;
+    api_server api;
+    bool serving = false;
+    fan_telemetry telemetry;
+    telemetry_config tel_cfg = {
+        .path = "",
+        .max_mb = 16,
+        .files = 4,
+        .batch = 64,
+        .flush_s = 60,
+    };
+    fan_helper helper = { .pid = -1 };
+    uid_t uid;
+    gid_t gid;
+    ctrl_profile check;
+    bool have_history = false;
+    history_graph graph;
     GError *err = NULL;
     GtkWidget *window;
     GtkDialog *close;
     GtkNotebook *main_nb;
-    GtkButton *exit_btn, *minimize_btn, *man_speed_btn, *auto_speed_btn, *close_y, *close_n, *close_c, *curve_apply_btn, *off_btn;
+    GtkButton *exit_btn, *minimize_btn, *man_speed_btn, *auto_speed_btn, *close_y, *close_n, *close_c, *curve_apply_btn, *pid_apply_btn, *off_btn;
     GtkBuilder *builder;
     GtkStatusIcon *tray_icon;
     GtkStatusbar *status_bar;
@@ -596,11 +806,105 @@ int main(int argc, char** argv) {
     guint status_id;
     char const* bin = argv[0];
 
-    while ((c = getopt(argc, argv, "vh")) != -1) {
+    while ((c = getopt(argc, argv, "vhmp:f:a:r:seF:R:W:b:u:L:U:t:g:C:")) != -1) {
         switch (c) {
             case 'v':
                 print_logs = true;
                 break;
+            case 's':
+                print_stats = true;
+                break;
+            case 'e':
+                use_trips = true;
+                break;
+            case 'F':
+                if (ctrl_parse_load(optarg, &load_cfg) != 0 || (invalid = load_validate(&load_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid feed-forward config `%s'.\n", optarg);
+                    return 1;
+                }
+                use_load = true;
+                break;
+            case 't':
+                if (ctrl_parse_filter(optarg, &filter_cfg, filter_sensors, sizeof(filter_sensors)) != 0 || (invalid = filter_validate(&filter_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid filter `%s'.\n", optarg);
+                    return 1;
+                }
+                use_filter = true;
+                break;
+            case 'C':
+                if (ctrl_parse_curve(optarg, &curve_cfg) != 0) {
+                    fprintf(stderr, "Invalid curve `%s'.\n", optarg);
+                    return 1;
+                }
+                use_curve = true;
+                break;
+            case 'g':
+                if (ctrl_parse_gate(optarg, &gate_cfg) != 0) {
+                    fprintf(stderr, "Invalid command gate `%s', expected dwell:max_step.\n", optarg);
+                    return 1;
+                }
+                if ((invalid = gate_validate(&gate_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid command gate `%s': %s\n", optarg, invalid);
+                    return 1;
+                }
+                break;
+            case 'R':
+                rpm_path = optarg;
+                break;
+            case 'b':
+                memset(&check, 0, sizeof(check));
+                if (ctrl_parse_profile(optarg, &check) != 0) {
+                    fprintf(stderr, "Invalid battery profile `%s'.\n", optarg);
+                    return 1;
+                }
+                battery = optarg;
+                break;
+            case 'u':
+                api_path = optarg;
+                break;
+            case 'L':
+                if (ctrl_parse_telemetry(optarg, &tel_cfg) != 0) {
+                    fprintf(stderr, "Invalid telemetry log `%s', expected path[:max_mb[:files[:batch[:flush_s]]]].\n", optarg);
+                    return 1;
+                }
+                if ((invalid = telemetry_validate(&tel_cfg)) != NULL) {
+                    fprintf(stderr, "Invalid telemetry log `%s': %s\n", optarg, invalid);
+                    return 1;
+                }
+                break;
+            case 'U':
+                user = optarg;
+                break;
+            case 'W':
+                watchdog = atoi(optarg);
+                if (watchdog < 0 || watchdog > FAN_WATCHDOG_MAX) {
+                    fprintf(stderr, "Watchdog must be between 0 and %d seconds.\n", FAN_WATCHDOG_MAX);
+                    return 1;
+                }
+                break;
+            case 'm':
+                mock_fan = true;
+                break;
+            case 'p':
+                pwm_path = optarg;
+                break;
+            case 'f':
+                if (n_fans >= CTRL_FANS_MAX) {
+                    fprintf(stderr, "No more than %d other fans.\n", CTRL_FANS_MAX);
+                    return 1;
+                }
+                if (ctrl_parse_fan(optarg, &fan_specs[n_fans]) != 0) {
+                    fprintf(stderr, "Invalid fan `%s'.\n", optarg);
+                    return 1;
+                }
+                n_fans++;
+                break;
+            case 'r':
+                root = optarg;
+                break;
+            case 'a':
+                adaptive_ms = atoi(optarg);
+                break;
             case 'h':
                 print_help(bin);
                 return 0;
@@ -616,6 +920,120 @@ int main(int argc, char** argv) {
                 abort();
         }
     }
+    // open the fan once, we keep the descriptor around for the lifetime of the application
+    if ((ret = fan_open(&fan, root, pwm_path, mock_fan)) != 0) {
+        // not fatal, we can still show temperatures, but changing the fan speed is going to fail
+        fprintf(stderr, "Unable to open %s fan: %s\n", fan.ops->name, strerror(-ret));
+    }
+    // find all temperature sensors once, the list doesn't change while we're running
+    if (sensors_discover(&sensors, root) == 0) {
+        fprintf(stderr, "No temperature sensors found\n");
+    }
+    // the control thread runs this one
+    ctrl_init(&ctrl, &fan, &sensors);
+    ctrl.print_logs = print_logs;
+    ctrl.watchdog = watchdog;
+    ctrl_set_adaptive(&ctrl, adaptive_ms);
+    ctrl.gate.cfg = gate_cfg;
+    if (use_filter) {
+        ctrl.filter_cfg = filter_cfg;
+        // like a fan we can't open, the modes go by the primary sensor instead
+        if (filter_sensors[0] != '\0' && (invalid = filter_resolve(&ctrl.filter, &sensors, filter_sensors)) != NULL) {
+            fprintf(stderr, "Invalid sensors `%s', using the primary one: %s\n", filter_sensors, invalid);
+            filter_init(&ctrl.filter);
+            filter_add_sensor(&ctrl.filter, sensors.primary, 1);
+        }
+    }
+    // like the main fan, one we can't open isn't fatal, it's just left alone
+    for (i = 0; i < n_fans; i++) {
+        fan_spec *spec = &fan_specs[i];
+        if ((invalid = filter_resolve(&chan, &sensors, spec->sensors)) != NULL) {
+            fprintf(stderr, "Invalid sensors `%s' for fan %s: %s\n", spec->sensors, spec->pwm_path, invalid);
+        } else if ((ret = fan_open(&fans[ctrl.n_fans], root, spec->pwm_path, mock_fan)) != 0) {
+            fprintf(stderr, "Unable to open fan %s: %s\n", spec->pwm_path, strerror(-ret));
+        } else if ((invalid = ctrl_add_fan(&ctrl, &fans[ctrl.n_fans], &chan, spec->points, spec->n_points)) != NULL) {
+            fprintf(stderr, "Invalid curve for fan %s: %s\n", spec->pwm_path, invalid);
+            fan_close(&fans[ctrl.n_fans]);
+        }
+    }
+    if (use_trips) {
+        if ((ret = trip_open(&trips, root)) != 0) {
+            fprintf(stderr, "No writable thermal trip points or hwmon alarms, polling: %s\n", strerror(-ret));
+        } else {
+            ctrl.trips = &trips;
+        }
+    }
+    // GTK shouldn't run as root: the fans (and the trip points we write) go to a helper, the rest of us drops root
+    if (geteuid() == 0) {
+        if (helper_find_user(user, &uid, &gid) != 0 || uid == 0) {
+            fprintf(stderr, "Running the GUI as root, start it with sudo (or -U <user>) to leave the fan to a helper\n");
+        } else {
+            helper_fans[0] = &fan;
+            for (i = 0; i < ctrl.n_fans; i++) {
+                helper_fans[i + 1] = ctrl.fans[i].fan;
+            }
+            if ((ret = helper_start(&helper, helper_fans, ctrl.n_fans + 1, ctrl.trips)) != 0)
+                fprintf(stderr, "Unable to start the fan helper, running the GUI as root: %s\n", strerror(-ret));
+        }
+    }
+    if (use_load) {
+        if ((ret = load_open(&load, root)) != 0) {
+            fprintf(stderr, "Unable to read the CPU load, going by temperature alone: %s\n", strerror(-ret));
+        } else {
+            ctrl.load_cfg = load_cfg;
+            ctrl.load = &load;
+        }
+    }
+    // the profiles are set up by the control thread, every time the settings are applied
+    if (battery != NULL) {
+        if ((ret = power_open(&power, root)) != 0) {
+            fprintf(stderr, "No AC adapter to follow, the profile is the same on battery: %s\n", strerror(-ret));
+        } else {
+            ctrl.power = &power;
+            ctrl.battery = battery;
+        }
+    }
+    // check every level change took, if the fan can tell us how fast it's going
+    rpm_init(&rpm);
+    if (rpm_path != NULL && (ret = rpm_map_load(&rpm.map, rpm_path)) != 0 && ret != -ENOENT)
+        fprintf(stderr, "Unable to load the RPM map from %s: %s\n", rpm_path, strerror(-ret));
+    if (fan_read_rpm(&fan) >= 0) {
+        ctrl.rpm = &rpm;
+    }
+    ctrl.state.rpm_map = rpm.map;
+    // the widgets compile into this one, it never touches the hardware
+    ctrl_init(&config, NULL, NULL);
+    config.print_logs = print_logs;
+    // cheap enough to always collect, so SIGUSR1 has something to show
+    stats_init(&stats);
+    stats_init(&ui_stats);
+    ctrl.stats = &stats;
+    // allocated once, 24 hours worth of samples
+    if ((ret = history_init(&history, sensors.n_temps, HISTORY_SECONDS)) != 0) {
+        fprintf(stderr, "Unable to allocate history: %s\n", strerror(-ret));
+    } else {
+        have_history = true;
+    }
+    // everything that needs root is open by now, and what we'd write to with it is the helper's
+    if (helper.pid > 0 && (ret = helper_drop_privileges(uid, gid)) != 0) {
+        fprintf(stderr, "Unable to drop privileges: %s\n", strerror(-ret));
+        return 1;
+    }
+    // the socket and the log are ours to write to, so they're made as the user we run as
+    if (api_path != NULL) {
+        if ((ret = api_open(&api, api_path)) != 0) {
+            fprintf(stderr, "Unable to serve the API on %s: %s\n", api_path, strerror(-ret));
+        } else {
+            serving = true;
+        }
+    }
+    if (tel_cfg.path[0] != '\0') {
+        if ((ret = telemetry_open(&telemetry, &tel_cfg, &sensors)) != 0) {
+            fprintf(stderr, "Unable to open the telemetry log %s: %s\n", tel_cfg.path, strerror(-ret));
+        } else {
+            ctrl.telemetry = &telemetry;
+        }
+    }
     gtk_init(&argc, &argv);
 
     tray_icon = create_tray_icon();
@@ -657,6 +1075,20 @@ int main(int argc, char** argv) {
         .scan_int = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "grad_int_sbtn")),
         .delta = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "grad_temp_inc_sbtn")),
         .throttle_scl = GTK_SCALE(gtk_builder_get_object(builder, "grad_throttle_scale")),
+        .points = GTK_ENTRY(gtk_builder_get_object(builder, "grad_points_entry")),
+        .ctrl = &config,
+    };
+    fan_pid pid = {
+        .config = GTK_LABEL(gtk_builder_get_object(builder, "pid_config_lbl")),
+        .min_cmb = GTK_COMBO_BOX(gtk_builder_get_object(builder, "pid_min_speed_cmb")),
+        .max_cmb = GTK_COMBO_BOX(gtk_builder_get_object(builder, "pid_max_speed_cmb")),
+        .target = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "pid_target_sbtn")),
+        .scan_int = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "pid_int_sbtn")),
+        .kp = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "pid_kp_sbtn")),
+        .ki = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "pid_ki_sbtn")),
+        .kd = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "pid_kd_sbtn")),
+        .dwell = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "pid_dwell_sbtn")),
+        .ctrl = &config,
     };
     // everything we might need in the callbacks, passed as gpointer
     application app = {
@@ -676,14 +1108,37 @@ int main(int argc, char** argv) {
         .safe = safe_sbtn,
         .status_id = status_id,
         .running = 0,
-        .visible = 0,
-        .was_crit = 0,
-        .manual = 0,
-        .timeout = 0,
+        .visible = 1, // the window is shown before we hand over to gtk
         .curve = &curve,
+        .pid = &pid,
+        .rpm_lbl = GTK_LABEL(gtk_builder_get_object(builder, "history_rpm_lbl")),
+        // the curve label shows it, with whatever we know from -R until the first tick tells us more
+        .state.rpm_map = rpm.map,
+        .state.power = -1,
+        .ctrl = &config,
+        .worker = &worker,
+        // nothing else reads the sensors until the control thread is started
+        .idle_temp = sensors_read(&sensors, &ctrl.sample),
+        .history = have_history ? &history : NULL,
+        .graph = &graph,
+        .stats = &ui_stats,
+        .print_stats = print_stats,
         .off_btn = off_btn,
-        .print_logs = print_logs,
     };
+    if (serving) {
+        app.api = &api;
+        app.view = (api_view) { .state = &app.state, .sample = &app.sample, .sensors = &sensors };
+        // clients are served from the main loop, between the widgets
+        g_unix_fd_add(api.epoll_fd, G_IO_IN, api_ready, &app);
+    }
+    // the curve label doesn't follow the ticks, what we knew when it was applied will do
+    curve.rpm_map = &app.state.rpm_map;
+    graph_init(&graph, GTK_WIDGET(gtk_builder_get_object(builder, "history_area")), &history, ctrl.filter.slots, ctrl.filter.n_sensors);
+    // from here on, only the control thread touches ctrl, the sensors and the fan
+    if ((ret = worker_start(&worker, &ctrl, worker_message, &app)) != 0) {
+        fprintf(stderr, "Unable to start the control thread: %s\n", strerror(-ret));
+        return 1;
+    }
 
     // Get buttons
     exit_btn = GTK_BUTTON(gtk_builder_get_object(builder, "exit_btn"));
@@ -691,12 +1146,13 @@ int main(int argc, char** argv) {
     man_speed_btn = GTK_BUTTON(gtk_builder_get_object(builder, "man_apply_btn"));
     auto_speed_btn = GTK_BUTTON(gtk_builder_get_object(builder, "auto_ctrl_apply_btn"));
     curve_apply_btn = GTK_BUTTON(gtk_builder_get_object(builder, "grad_apply_btn"));
+    pid_apply_btn = GTK_BUTTON(gtk_builder_get_object(builder, "pid_apply_btn"));
     close_y = GTK_BUTTON(gtk_builder_get_object(builder, "close_auto_yes_btn"));
     close_n = GTK_BUTTON(gtk_builder_get_object(builder, "close_auto_no_btn"));
     close_c = GTK_BUTTON(gtk_builder_get_object(builder, "close_auto_cancel_btn"));
 
-    // format throttle scale, pass in the curve struct so we can update the factor field
-    g_signal_connect(G_OBJECT(curve.throttle_scl), "value-changed", G_CALLBACK(curve_value_changed), &curve);
+    // format throttle scale, pass in the app so the new factor can be posted to the control thread
+    g_signal_connect(G_OBJECT(curve.throttle_scl), "value-changed", G_CALLBACK(curve_value_changed), &app);
     // connect signals
     // minimize, hide window, tray icon stuff
     g_signal_connect(G_OBJECT(tray_icon), "activate", G_CALLBACK(hide_window), &app);
@@ -707,6 +1163,7 @@ int main(int argc, char** argv) {
     g_signal_connect(G_OBJECT(man_speed_btn), "clicked", G_CALLBACK(apply_manual_speed), &app);
     g_signal_connect(G_OBJECT(auto_speed_btn), "clicked", G_CALLBACK(apply_auto_speed), &app);
     g_signal_connect(G_OBJECT(curve_apply_btn), "clicked", G_CALLBACK(apply_fan_curve), &app);
+    g_signal_connect(G_OBJECT(pid_apply_btn), "clicked", G_CALLBACK(apply_pid), &app);
     // button is only enabled if the app state is set to running
     g_signal_connect(G_OBJECT(off_btn), "clicked", G_CALLBACK(stop_fan_monitor), &app);
     // Exit button click
@@ -717,13 +1174,24 @@ int main(int argc, char** argv) {
     g_signal_connect(G_OBJECT(close_c), "clicked", G_CALLBACK(dialog_close), &app);
     // handle closing of the window
     g_signal_connect(G_OBJECT(window), "destroy", G_CALLBACK(window_destroy), &app);
+    // kill -USR1 prints the tick stats
+    g_unix_signal_add(SIGUSR1, dump_stats, &app);
+    // and these put the fan back on auto before we go, like the close dialog does
+    g_unix_signal_add(SIGTERM, quit_signal, &app);
+    g_unix_signal_add(SIGINT, quit_signal, &app);
 
     // connect signals && unref builder
     gtk_builder_connect_signals(builder, &app); // AFAIK, we don't really need this
     g_object_unref(G_OBJECT(builder));
     
     // set curve values
-    set_curve_values(&curve);
+    if (use_curve) {
+        show_curve_values(&curve, &curve_cfg);
+    }
+    if (!set_curve_values(&curve) && use_curve) {
+        fprintf(stderr, "Invalid curve: %s\n", gtk_label_get_text(curve.config));
+    }
+    set_pid_values(&pid);
     if (!set_auto_values(&app)) {
         fprintf(stderr, "DEFAULT PROFILE VALUES ARE WRONG");
     }
@@ -734,5 +1202,25 @@ int main(int argc, char** argv) {
 
     // hand over to gtk
     gtk_main();
+    // the control thread is gone, the map is ours
+    if (ctrl.rpm != NULL && rpm_path != NULL && (ret = rpm_map_save(&rpm.map, rpm_path)) != 0)
+        fprintf(stderr, "Unable to save the RPM map to %s: %s\n", rpm_path, strerror(-ret));
+    if (ctrl.trips != NULL)
+        trip_close(&trips);
+    if (ctrl.load != NULL)
+        load_close(&load);
+    if (ctrl.power != NULL)
+        power_close(&power);
+    if (serving)
+        api_close(&api);
+    graph_free(&graph);
+    history_free(&history);
+    for (i = 0; i < ctrl.n_fans; i++) {
+        fan_close(&fans[i]);
+    }
+    fan_close(&fan);
+    // the fans are as the control thread left them, the helper doesn't touch them on the way out
+    helper_stop(&helper);
+    sensors_close(&sensors);
     return 0;
 }
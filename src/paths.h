@@ -0,0 +1,20 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Everything we touch in procfs and sysfs lives under a root, which is / unless we were told
+otherwise (ie a fake tree built by fan_fixture).
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef PATHS_H
+#define PATHS_H
+
+#include <stdio.h>
+
+// root + path into buf, NULL or "" root is the real thing. Fails rather than returning a truncated path
+static inline int root_path(char *buf, size_t len, const char *root, const char *path) {
+    int n = snprintf(buf, len, "%s%s", root != NULL ? root : "", path);
+    return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+#endif
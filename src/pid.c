@@ -0,0 +1,81 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+PID control, see pid.h. The derivative is taken on the temperature rather than the error, so a new
+target doesn't kick the fan, and the integral is clamped (not accumulated while the output is
+saturated in the same direction) so it doesn't wind up while the fan is already at full speed.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <string.h>
+#include "pid.h"
+#include "fan.h"
+
+const char *pid_validate(const pid_config *cfg) {
+    if (cfg->target < 30 || cfg->target > 100) {
+        return "Target temperature must be between 30 and 100";
+    }
+    if (cfg->kp < 0 || cfg->ki < 0 || cfg->kd < 0) {
+        return "Gains can't be negative";
+    }
+    if (cfg->min_level < FAN_LVL_AUTO || cfg->max_level > FAN_LVL_FULL || cfg->min_level >= cfg->max_level) {
+        return "Minimum level must be below maximum level, both between 0 (auto) and 8";
+    }
+    if (cfg->scan < 1 || cfg->dwell < 0) {
+        return "Scan interval must be > 0, dwell time >= 0";
+    }
+    return NULL;
+}
+
+void pid_reset(pid_state *pid) {
+    memset(pid, 0, sizeof(*pid));
+}
+
+int pid_update(const pid_config *cfg, pid_state *pid, int temp, long long now_ms, int current) {
+    double err = temp - cfg->target, dt, deriv = 0, out, integral, off;
+    int level;
+    if (!pid->primed) {
+        pid->primed = true;
+        pid->prev_temp = temp;
+        pid->prev_ms = now_ms;
+        // pretend we've been here a while, so the first change isn't held up by the dwell time
+        pid->change_ms = now_ms - cfg->dwell * 1000LL;
+        dt = 0;
+    } else {
+        dt = (now_ms - pid->prev_ms) / 1000.0;
+    }
+    if (dt > 0) {
+        deriv = (temp - pid->prev_temp) / dt;
+    }
+    pid->prev_temp = temp;
+    pid->prev_ms = now_ms;
+    // anti-windup: only keep the new integral if it doesn't push a saturated output further out
+    integral = pid->integral + err * dt;
+    out = cfg->min_level + cfg->kp * err + cfg->ki * integral + cfg->kd * deriv;
+    if (!((out > cfg->max_level && err > 0) || (out < cfg->min_level && err < 0))) {
+        pid->integral = integral;
+    }
+    out = cfg->min_level + cfg->kp * err + cfg->ki * pid->integral + cfg->kd * deriv;
+    pid->output = out;
+    // quantise, with a bit of hysteresis around the level we're at
+    off = out - current;
+    if (current < cfg->min_level || current > cfg->max_level || off > 0.5 + PID_QUANT_HYST || off < -0.5 - PID_QUANT_HYST) {
+        level = (int) (out < 0 ? out - 0.5 : out + 0.5);
+    } else {
+        level = current;
+    }
+    if (level < cfg->min_level) {
+        level = cfg->min_level;
+    } else if (level > cfg->max_level) {
+        level = cfg->max_level;
+    }
+    if (level == current) {
+        return current;
+    }
+    // every change is an EC write, hold on to a level for a while, unless it's getting too hot
+    if (now_ms - pid->change_ms < cfg->dwell * 1000LL && !(level > current && err >= PID_URGENT_C)) {
+        return current;
+    }
+    pid->change_ms = now_ms;
+    return level;
+}
@@ -0,0 +1,41 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+PID control: hold a target temperature by picking a fan level, rather than following a curve.
+The output is quantised to the fan levels, with anti-windup and a minimum time between changes.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef PID_H
+#define PID_H
+
+#include <stdbool.h>
+
+// how far past the next level the output has to be before we switch, so it doesn't toggle between two
+#define PID_QUANT_HYST 0.25
+// this many degrees over target and we don't wait for the dwell time to step up
+#define PID_URGENT_C 5
+
+typedef struct _pid_config {
+    int target;           // degrees C to hold
+    double kp, ki, kd;    // levels per degree, per degree second, per degree/second
+    int min_level, max_level;
+    int dwell;            // seconds to keep a level before changing it again
+    int scan;             // seconds between samples
+} pid_config;
+
+typedef struct _pid_state {
+    double integral;      // degree seconds, kept within what min_level..max_level can use
+    double prev_temp;
+    double output;        // last (unquantised) output, in levels
+    long long prev_ms, change_ms;
+    bool primed;          // false until we have a previous sample
+} pid_state;
+
+// returns NULL if the config is usable, or a message saying what's wrong with it
+const char *pid_validate(const pid_config *cfg);
+void pid_reset(pid_state *pid);
+// feed it a sample taken at now_ms, returns the level to run at, given the one we're at
+int pid_update(const pid_config *cfg, pid_state *pid, int temp, long long now_ms, int current);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Power source, see power.h. Battery supplies are left alone, they only say whether the AC is there
+through their status, and that's the adapter's job.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "power.h"
+#include "paths.h"
+
+#define UEVENT_BUF_LEN 4096
+
+static int uevent_open(void) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    int ret, fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+// only AC adapters and USB ports (that's where USB-C chargers show up) say whether there's power
+static bool is_charger(const char *base, const char *name) {
+    char path[PATH_MAX], type[16];
+    ssize_t n;
+    int fd;
+    if (snprintf(path, sizeof(path), "%s/%s/type", base, name) >= (int) sizeof(path) || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return false;
+    }
+    n = read(fd, type, sizeof(type) - 1);
+    close(fd);
+    if (n <= 0) {
+        return false;
+    }
+    type[n] = '\0';
+    return strncmp(type, "Mains", 5) == 0 || strncmp(type, "USB", 3) == 0;
+}
+
+static power_source read_source(const power_watch *power) {
+    char val[4];
+    int i;
+    for (i = 0; i < power->n_supplies; i++) {
+        if (pread(power->online_fds[i], val, sizeof(val), 0) > 0 && val[0] == '1') {
+            return POWER_AC;
+        }
+    }
+    return POWER_BATTERY;
+}
+
+int power_open(power_watch *power, const char *root) {
+    char base[PATH_MAX], path[PATH_MAX];
+    struct dirent *ent;
+    int fd;
+    DIR *d;
+    memset(power, 0, sizeof(*power));
+    power->uevent_fd = -1;
+    if (root_path(base, sizeof(base), root, POWER_SUPPLY_PATH) != 0 || (d = opendir(base)) == NULL) {
+        return -ENOENT;
+    }
+    while ((ent = readdir(d)) != NULL && power->n_supplies < POWER_SUPPLIES_MAX) {
+        if (ent->d_name[0] == '.' || !is_charger(base, ent->d_name)) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s/online", base, ent->d_name) < (int) sizeof(path) && (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+            power->online_fds[power->n_supplies++] = fd;
+        }
+    }
+    closedir(d);
+    if (power->n_supplies == 0) {
+        return -ENOENT;
+    }
+    if ((power->uevent_fd = uevent_open()) < 0) {
+        int ret = power->uevent_fd;
+        power_close(power);
+        return ret;
+    }
+    power->source = read_source(power);
+    return 0;
+}
+
+void power_close(power_watch *power) {
+    int i;
+    for (i = 0; i < power->n_supplies; i++) {
+        close(power->online_fds[i]);
+    }
+    if (power->uevent_fd >= 0) {
+        close(power->uevent_fd);
+    }
+    power->n_supplies = 0;
+    power->uevent_fd = -1;
+}
+
+const char *power_name(power_source source) {
+    return source == POWER_AC ? "AC" : "battery";
+}
+
+int power_pollfds(const power_watch *power, struct pollfd *pfds) {
+    if (power->uevent_fd < 0) {
+        return 0;
+    }
+    pfds[0].fd = power->uevent_fd;
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    return 1;
+}
+
+// drain the uevent socket, true if any of it was about a power supply
+static bool uevent_power(int fd) {
+    char buf[UEVENT_BUF_LEN];
+    const char *p, *end;
+    bool ours = false;
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        // action@devpath, then KEY=value strings, all of them NUL terminated
+        for (p = buf, end = buf + n; p < end; p += strlen(p) + 1) {
+            if (strcmp(p, "SUBSYSTEM=power_supply") == 0) {
+                ours = true;
+                break;
+            }
+        }
+    }
+    // the socket overflowed, whatever we missed might have been it
+    if (n < 0 && errno == ENOBUFS) {
+        ours = true;
+    }
+    return ours;
+}
+
+bool power_check(power_watch *power, const struct pollfd *pfds) {
+    power_source source;
+    if (power->uevent_fd < 0 || !(pfds[0].revents & (POLLIN | POLLERR)) || !uevent_power(power->uevent_fd)) {
+        return false;
+    }
+    // the battery sends these all the time as it drains, it's only news if the source changed
+    if ((source = read_source(power)) == power->source) {
+        return false;
+    }
+    power->source = source;
+    power->changes++;
+    return true;
+}
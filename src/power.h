@@ -0,0 +1,40 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Power source: are we on AC or on battery. The online attributes of the AC adapters (and USB-C
+chargers) are opened once, and only re-read when the kernel sends a power_supply uevent.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdbool.h>
+#include <poll.h>
+
+#define POWER_SUPPLY_PATH "/sys/class/power_supply"
+#define POWER_SUPPLIES_MAX 8
+
+typedef enum _power_source {
+    POWER_BATTERY = 0,
+    POWER_AC = 1,
+} power_source;
+
+typedef struct _power_watch {
+    int uevent_fd;                     // kobject uevents, we only care about the power_supply ones
+    int online_fds[POWER_SUPPLIES_MAX]; // online of every Mains and USB supply
+    int n_supplies;
+    power_source source;               // AC if any of them is online
+    unsigned long changes;             // times the source changed since we opened it
+} power_watch;
+
+// find the supplies under root (NULL for /), returns 0, or -ENOENT if there are none (ie a desktop)
+int power_open(power_watch *power, const char *root);
+void power_close(power_watch *power);
+const char *power_name(power_source source);
+// fill in the pollfd for the uevent socket, returns how many were used
+int power_pollfds(const power_watch *power, struct pollfd *pfds);
+// after poll: drain the uevents, returns true if the power source changed
+bool power_check(power_watch *power, const struct pollfd *pfds);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+RPM feedback, see rpm.h.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "rpm.h"
+
+void rpm_init(rpm_watch *w) {
+    int i;
+    memset(w, 0, sizeof(*w));
+    for (i = 0; i <= FAN_LVL_FULL; i++) {
+        w->map.rpm[i] = RPM_UNKNOWN;
+    }
+    w->level = -1;
+    w->last = w->prev = RPM_UNKNOWN;
+}
+
+void rpm_commanded(rpm_watch *w, int level, long long now_ms) {
+    if (level != w->level) {
+        w->retries = 0;
+    }
+    w->level = level;
+    w->since_ms = now_ms;
+    w->settled = false;
+}
+
+// still on its way: wait until it stops changing (within 5%), or it's had enough time
+static bool settling(const rpm_watch *w, int rpm, long long now_ms) {
+    long long elapsed = now_ms - w->since_ms;
+    if (elapsed >= RPM_SETTLE_MS) {
+        return false;
+    }
+    return elapsed < RPM_SETTLE_MIN_MS || w->prev == RPM_UNKNOWN || abs(rpm - w->prev) * 20 > rpm;
+}
+
+rpm_check rpm_update(rpm_watch *w, int rpm, long long now_ms) {
+    rpm_check bad;
+    int expect;
+    w->prev = w->last;
+    w->last = rpm < 0 ? RPM_UNKNOWN : rpm;
+    // the EC runs auto, whatever it does is fine by us
+    if (rpm < 0 || w->level <= FAN_LVL_AUTO) {
+        return RPM_NONE;
+    }
+    if (!w->settled && settling(w, rpm, now_ms)) {
+        return RPM_NONE;
+    }
+    w->settled = true;
+    expect = w->map.rpm[w->level];
+    if (rpm < RPM_STALL) {
+        bad = RPM_STALLED;
+    } else if (expect != RPM_UNKNOWN && abs(rpm - expect) * 100 > expect * RPM_TOLERANCE) {
+        bad = RPM_MISMATCH;
+    } else {
+        // learn slowly, so one odd reading doesn't move it much
+        w->map.rpm[w->level] = expect == RPM_UNKNOWN ? rpm : (expect * 3 + rpm) / 4;
+        w->retries = 0;
+        w->alarm = false;
+        return RPM_NONE;
+    }
+    // maybe the write got lost, or something else (the watchdog?) changed the level behind our back
+    if (w->retries < RPM_RETRIES) {
+        w->retries++;
+        w->retried++;
+        return RPM_RETRY;
+    }
+    if (bad == RPM_MISMATCH) {
+        // it's what this level does now, complain once and go with it
+        w->map.rpm[w->level] = rpm;
+        w->mismatches++;
+        return RPM_MISMATCH;
+    }
+    // a stall is reported once, until the fan gets going again
+    if (w->alarm) {
+        return RPM_NONE;
+    }
+    w->alarm = true;
+    w->stalls++;
+    return RPM_STALLED;
+}
+
+int rpm_map_format(const rpm_map *map, char *buf, size_t len) {
+    int i, n = 0, ret;
+    buf[0] = '\0';
+    for (i = FAN_LVL_AUTO + 1; i <= FAN_LVL_FULL; i++) {
+        if (map->rpm[i] == RPM_UNKNOWN) {
+            continue;
+        }
+        ret = snprintf(buf + n, len - n, "%s%d:%d", n > 0 ? " " : "", i, map->rpm[i]);
+        if (ret < 0 || (size_t) ret >= len - n) {
+            break;
+        }
+        n += ret;
+    }
+    return n;
+}
+
+int rpm_map_load(rpm_map *map, const char *path) {
+    char line[64];
+    int level, rpm;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -errno;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%d %d", &level, &rpm) == 2 && level > FAN_LVL_AUTO && level <= FAN_LVL_FULL && rpm >= 0) {
+            map->rpm[level] = rpm;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int rpm_map_save(const rpm_map *map, const char *path) {
+    int i, ret = 0;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return -errno;
+    }
+    for (i = FAN_LVL_AUTO + 1; i <= FAN_LVL_FULL; i++) {
+        if (map->rpm[i] != RPM_UNKNOWN) {
+            fprintf(fp, "%d %d\n", i, map->rpm[i]);
+        }
+    }
+    if (fclose(fp) != 0) {
+        ret = -errno;
+    }
+    return ret;
+}
@@ -0,0 +1,62 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+RPM feedback: after every level change, check that the fan got there. Learns what each level does on
+this machine as it goes, rewrites a level that didn't take, and raises the alarm on a fan that
+stalled, or settled nowhere near where the level took it before.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef RPM_H
+#define RPM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "fan.h"
+
+#define RPM_UNKNOWN -1
+// a level change has this long to show up in the RPM, after this it's settled no matter what
+#define RPM_SETTLE_MS 10000
+// but at least this long, the EC takes its time to get going
+#define RPM_SETTLE_MIN_MS 2000
+// a fan that's told to run, reading below this, has stopped
+#define RPM_STALL 200
+// percent off the learned RPM of a level that counts as a mismatch
+#define RPM_TOLERANCE 20
+// rewrites of the level before we raise the alarm
+#define RPM_RETRIES 2
+
+typedef struct _rpm_map {
+    int rpm[FAN_LVL_FULL + 1]; // settled RPM per level, RPM_UNKNOWN until we've seen it (auto never is)
+} rpm_map;
+
+typedef enum _rpm_check {
+    RPM_NONE,     // nothing to do
+    RPM_RETRY,    // write the level again
+    RPM_STALLED,  // alarm: told to spin, it doesn't
+    RPM_MISMATCH, // alarm: settled well away from what the level did before
+} rpm_check;
+
+typedef struct _rpm_watch {
+    rpm_map map;
+    int level;           // last level written, -1 before the first one
+    long long since_ms;  // when it was written
+    int last, prev;      // last two readings, RPM_UNKNOWN if they failed
+    bool settled;
+    int retries;         // rewrites of the current level so far
+    bool alarm;          // raised, until a level settles where it should
+    unsigned long stalls, mismatches, retried;
+} rpm_watch;
+
+void rpm_init(rpm_watch *w);
+// a level was written (or rewritten) at now_ms
+void rpm_commanded(rpm_watch *w, int level, long long now_ms);
+// a reading (or -errno if it failed) taken at now_ms, returns what to do about it
+rpm_check rpm_update(rpm_watch *w, int rpm, long long now_ms);
+// "1:2100 2:2600 ..." for the levels we know, returns the length
+int rpm_map_format(const rpm_map *map, char *buf, size_t len);
+// "level rpm" per line, load returns 0 or -errno, unknown levels are left alone
+int rpm_map_load(rpm_map *map, const char *path);
+int rpm_map_save(const rpm_map *map, const char *path);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Adaptive sampling scheduler.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <string.h>
+#include <time.h>
+#include "sched.h"
+
+// how much weight a new dT/dt gets in the smoothed rate
+#define SCHED_RATE_WEIGHT 0.5
+// below this, we consider the temperature stable (degrees per second)
+#define SCHED_RATE_STABLE 0.01
+
+long long sched_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void sched_init(fan_sched *sched, int min_ms) {
+    memset(sched, 0, sizeof(*sched));
+    sched->min_ms = min_ms;
+    sched->interval = min_ms;
+    sched->start_ms = sched_now_ms();
+}
+
+void sched_sample(fan_sched *sched, int temp) {
+    long long now = sched_now_ms();
+    if (sched->wakeups > 0 && now > sched->last_ms) {
+        double rate = (double) (temp - sched->temp) * 1000 / (now - sched->last_ms);
+        sched->rate = SCHED_RATE_WEIGHT * rate + (1 - SCHED_RATE_WEIGHT) * sched->rate;
+    }
+    sched->temp = temp;
+    sched->last_ms = now;
+    sched->wakeups++;
+}
+
+// degrees to go until we hit a point on the curve that changes the level, -1 if there's nothing in that direction
+static int breakpoint_distance(const fan_sched *sched, const fan_table *table, int level) {
+    int up = curve_next_up(table, sched->temp), down = curve_next_down(table, sched->temp, level);
+    int up_dist = up < CURVE_TEMPS ? up - sched->temp : -1;
+    int down_dist = down >= 0 ? sched->temp - down : -1;
+    if (sched->rate > SCHED_RATE_STABLE) {
+        return up_dist;
+    }
+    if (sched->rate < -SCHED_RATE_STABLE) {
+        return down_dist;
+    }
+    // stable: whichever is closest
+    if (up_dist < 0 || (down_dist >= 0 && down_dist < up_dist)) {
+        return down_dist;
+    }
+    return up_dist;
+}
+
+int sched_next(fan_sched *sched, const fan_table *table, int level, int max_ms) {
+    long long ms = max_ms;
+    double rate = sched->rate < 0 ? -sched->rate : sched->rate;
+    if (table != NULL) {
+        int dist = breakpoint_distance(sched, table, level);
+        if (dist >= 0 && dist <= 1) {
+            // right next to a threshold, keep a close eye on it
+            ms = sched->min_ms;
+        } else if (dist > 1 && rate > SCHED_RATE_STABLE) {
+            // sample at least twice before we'd get there at the current rate
+            long long eta = (long long) (dist / rate * 1000) / 2;
+            if (eta < ms) {
+                ms = eta;
+            }
+        }
+    }
+    // back off gradually while stable, drop down straight away if needed
+    if (ms > (long long) sched->interval * 2) {
+        ms = (long long) sched->interval * 2;
+    }
+    if (ms < sched->min_ms) {
+        ms = sched->min_ms;
+    }
+    if (ms > max_ms) {
+        ms = max_ms;
+    }
+    sched->interval = (int) ms;
+    return sched->interval;
+}
+
+double sched_wakeups_per_hour(const fan_sched *sched) {
+    long long elapsed = sched_now_ms() - sched->start_ms;
+    if (elapsed <= 0) {
+        return 0;
+    }
+    return (double) sched->wakeups * 3600000 / elapsed;
+}
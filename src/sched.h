@@ -0,0 +1,32 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Adaptive sampling: picks the time of the next sample from how fast the temperature is changing,
+and how far away the next point on the curve is.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "curve.h"
+
+typedef struct _fan_sched {
+    int min_ms;            // 0 means adaptive sampling is off
+    int interval;          // last interval handed out, in ms
+    int temp;              // last temperature sampled
+    double rate;           // smoothed dT/dt, degrees per second
+    long long last_ms, start_ms;
+    unsigned long wakeups; // samples taken since start_ms
+} fan_sched;
+
+long long sched_now_ms(void);
+void sched_init(fan_sched *sched, int min_ms);
+// record a sample, counts as a wakeup
+void sched_sample(fan_sched *sched, int temp);
+// ms until the next sample should be taken, never more than max_ms
+// table can be NULL (ie manual mode), in which case we only back off
+int sched_next(fan_sched *sched, const fan_table *table, int level, int max_ms);
+double sched_wakeups_per_hour(const fan_sched *sched);
+
+#endif
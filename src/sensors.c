@@ -0,0 +1,266 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Temperature sensors. We look for thinkpad_acpi, thermal zones, and hwmon temp inputs once, keep the
+descriptors open, and re-read them with pread at offset 0 on every tick. Parsing is done by hand,
+so a tick is one syscall per source, no stdio, no allocations.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "sensors.h"
+#include "paths.h"
+
+#define SENSOR_BUF_LEN 128
+
+// parse the next (optionally negative) integer in buf, returns a pointer past it, NULL if there is none
+static const char *parse_int(const char *p, const char *end, int *out) {
+    int neg = 0, val = 0;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p >= end || *p < '0' || *p > '9') {
+        return NULL;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+        val = val * 10 + (*p - '0');
+        p++;
+    }
+    *out = neg ? -val : val;
+    return p;
+}
+
+// read a short sysfs attribute (name, type, label) into buf, trailing newline stripped
+static int read_attr(const char *path, char *buf, size_t len) {
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    n = read(fd, buf, len - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+// dir/name[suffix] into buf, fails rather than opening a truncated path
+static int join_path(char *buf, size_t len, const char *dir, const char *name, int name_len, const char *suffix) {
+    int n = snprintf(buf, len, "%s/%.*s%s", dir, name_len, name, suffix);
+    return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+static sensor_source *add_source(sensor_set *set, sensor_kind kind, const char *path, int count) {
+    sensor_source *src;
+    int fd;
+    if (set->n_sources >= SENSOR_SOURCES_MAX || set->n_temps + count > SENSOR_MAX) {
+        return NULL;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    src = &set->sources[set->n_sources++];
+    src->kind = kind;
+    src->fd = fd;
+    src->first = set->n_temps;
+    src->count = count;
+    set->n_temps += count;
+    return src;
+}
+
+static int name_prefix(const struct dirent *ent, const char *prefix) {
+    return strncmp(ent->d_name, prefix, strlen(prefix)) == 0;
+}
+
+static int is_thermal_zone(const struct dirent *ent) {
+    return name_prefix(ent, "thermal_zone");
+}
+
+static int is_hwmon(const struct dirent *ent) {
+    return name_prefix(ent, "hwmon");
+}
+
+static int is_temp_input(const struct dirent *ent) {
+    size_t len = strlen(ent->d_name);
+    return name_prefix(ent, "temp") && len > 6 && strcmp(ent->d_name + len - 6, "_input") == 0;
+}
+
+static void discover_thinkpad(sensor_set *set, const char *root) {
+    char path[PATH_MAX];
+    sensor_source *src;
+    int i;
+    if (root_path(path, sizeof(path), root, THERMAL_PROC_PATH) != 0 || (src = add_source(set, SENSOR_THINKPAD, path, SENSOR_THINKPAD_TEMPS)) == NULL) {
+        return;
+    }
+    for (i = 0; i < src->count; i++) {
+        snprintf(set->names[src->first + i], SENSOR_NAME_LEN, "thinkpad%d", i);
+    }
+    // first thinkpad temperature is the CPU, this is what we've always acted on
+    set->primary = src->first;
+}
+
+static void discover_thermal_zones(sensor_set *set, const char *root) {
+    struct dirent **ents;
+    char base[PATH_MAX], path[PATH_MAX], type[SENSOR_NAME_LEN];
+    sensor_source *src;
+    int i, n;
+    if (root_path(base, sizeof(base), root, THERMAL_ZONE_PATH) != 0 || (n = scandir(base, &ents, is_thermal_zone, alphasort)) < 0) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        const char *zone = ents[i]->d_name;
+        if (join_path(path, sizeof(path), base, zone, INT_MAX, "/type") != 0 || read_attr(path, type, sizeof(type)) != 0) {
+            snprintf(type, sizeof(type), "%.*s", SENSOR_NAME_LEN - 1, zone);
+        }
+        if (join_path(path, sizeof(path), base, zone, INT_MAX, "/temp") == 0 && (src = add_source(set, SENSOR_THERMAL_ZONE, path, 1)) != NULL) {
+            snprintf(set->names[src->first], SENSOR_NAME_LEN, "%s", type);
+            // no thinkpad_acpi, the package temperature is the next best thing
+            if (set->primary < 0 && strcmp(type, "x86_pkg_temp") == 0) {
+                set->primary = src->first;
+            }
+        }
+        free(ents[i]);
+    }
+    free(ents);
+}
+
+static void discover_hwmon_temps(sensor_set *set, const char *dir) {
+    struct dirent **ents;
+    char path[PATH_MAX], hw_name[12], label[SENSOR_NAME_LEN];
+    sensor_source *src;
+    int i, n;
+    if (join_path(path, sizeof(path), dir, "name", INT_MAX, "") != 0 || read_attr(path, hw_name, sizeof(hw_name)) != 0) {
+        snprintf(hw_name, sizeof(hw_name), "hwmon");
+    }
+    if ((n = scandir(dir, &ents, is_temp_input, alphasort)) < 0) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        // tempN_input -> tempN_label, if there is one
+        const char *input = ents[i]->d_name;
+        int num_len = strlen(input) - 6;
+        if (join_path(path, sizeof(path), dir, input, num_len, "_label") != 0 || read_attr(path, label, sizeof(label)) != 0) {
+            snprintf(label, sizeof(label), "%.*s", num_len < SENSOR_NAME_LEN ? num_len : SENSOR_NAME_LEN - 1, input);
+        }
+        if (join_path(path, sizeof(path), dir, input, INT_MAX, "") == 0 && (src = add_source(set, SENSOR_HWMON, path, 1)) != NULL) {
+            // name/label, e.g. coretemp/Core 0, truncated to fit
+            snprintf(set->names[src->first], SENSOR_NAME_LEN, "%.8s/%.14s", hw_name, label);
+        }
+        free(ents[i]);
+    }
+    free(ents);
+}
+
+static void discover_hwmon(sensor_set *set, const char *root) {
+    struct dirent **ents;
+    char base[PATH_MAX], dir[PATH_MAX];
+    int i, n;
+    if (root_path(base, sizeof(base), root, HWMON_PATH) != 0 || (n = scandir(base, &ents, is_hwmon, alphasort)) < 0) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (join_path(dir, sizeof(dir), base, ents[i]->d_name, INT_MAX, "") == 0) {
+            discover_hwmon_temps(set, dir);
+        }
+        free(ents[i]);
+    }
+    free(ents);
+}
+
+int sensors_discover(sensor_set *set, const char *root) {
+    memset(set, 0, sizeof(*set));
+    set->primary = -1;
+    discover_thinkpad(set, root);
+    discover_thermal_zones(set, root);
+    discover_hwmon(set, root);
+    if (set->primary < 0 && set->n_temps > 0) {
+        set->primary = 0;
+    }
+    return set->n_temps;
+}
+
+int sensors_find(const sensor_set *set, const char *name) {
+    char *end;
+    long slot = strtol(name, &end, 10);
+    int i;
+    if (*name != '\0' && *end == '\0') {
+        return slot >= 0 && slot < set->n_temps ? (int) slot : -1;
+    }
+    for (i = 0; i < set->n_temps; i++) {
+        if (strcmp(set->names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void read_source(sensor_source *src, int *temps) {
+    char buf[SENSOR_BUF_LEN];
+    const char *p, *end;
+    int i, val;
+    ssize_t n = pread(src->fd, buf, sizeof(buf), 0);
+    for (i = 0; i < src->count; i++) {
+        temps[i] = SENSOR_INVALID;
+    }
+    if (n <= 0) {
+        return;
+    }
+    p = buf;
+    end = buf + n;
+    if (src->kind == SENSOR_THINKPAD) {
+        // temperatures:	47 0 0 0 0 0 0 0
+        p = memchr(buf, ':', n);
+        if (p == NULL) {
+            return;
+        }
+        p++;
+        for (i = 0; i < src->count && (p = parse_int(p, end, &val)) != NULL; i++) {
+            temps[i] = (val == -128 || val == 0) ? SENSOR_INVALID : val * 1000;
+        }
+        return;
+    }
+    // sysfs: a single value in millidegrees
+    if (parse_int(p, end, &val) != NULL) {
+        temps[0] = val;
+    }
+}
+
+int sensors_read(sensor_set *set, sensor_sample *sample) {
+    int i;
+    sample->count = set->n_temps;
+    sample->failed = 0;
+    for (i = 0; i < set->n_sources; i++) {
+        sensor_source *src = &set->sources[i];
+        read_source(src, &sample->temps[src->first]);
+        // the first slot of a source is always populated if the read worked
+        if (sample->temps[src->first] == SENSOR_INVALID) {
+            sample->failed++;
+        }
+    }
+    if (set->primary < 0 || sample->temps[set->primary] == SENSOR_INVALID) {
+        return -1;
+    }
+    return SENSOR_C(sample->temps[set->primary]);
+}
+
+void sensors_close(sensor_set *set) {
+    int i;
+    for (i = 0; i < set->n_sources; i++) {
+        close(set->sources[i].fd);
+    }
+    set->n_sources = set->n_temps = 0;
+}
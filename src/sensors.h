@@ -0,0 +1,59 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Temperature sensors: discovered once, read through persistent descriptors.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef SENSORS_H
+#define SENSORS_H
+
+#include <limits.h>
+
+#define THERMAL_PROC_PATH "/proc/acpi/ibm/thermal"
+#define THERMAL_ZONE_PATH "/sys/class/thermal"
+#define HWMON_PATH "/sys/class/hwmon"
+
+#define SENSOR_SOURCES_MAX 40
+#define SENSOR_MAX 48
+#define SENSOR_NAME_LEN 24
+// thinkpad_acpi reports 8 temperatures, unused slots are -128 (or 0 on some models)
+#define SENSOR_THINKPAD_TEMPS 8
+// temps are in millidegrees C, this marks a sensor that is absent or failed to read
+#define SENSOR_INVALID INT_MIN
+#define SENSOR_C(mdeg) ((mdeg) / 1000)
+
+typedef enum _sensor_kind {
+    SENSOR_THINKPAD,
+    SENSOR_THERMAL_ZONE,
+    SENSOR_HWMON,
+} sensor_kind;
+
+typedef struct _sensor_source {
+    sensor_kind kind;
+    int fd;
+    int first, count; // slots in the sample this source fills
+} sensor_source;
+
+typedef struct _sensor_set {
+    sensor_source sources[SENSOR_SOURCES_MAX];
+    char names[SENSOR_MAX][SENSOR_NAME_LEN]; // per temperature slot, for display purposes
+    int n_sources, n_temps;
+    int primary; // slot the controllers act on (the CPU temp), -1 if nothing was found
+} sensor_set;
+
+typedef struct _sensor_sample {
+    int temps[SENSOR_MAX]; // millidegrees C, or SENSOR_INVALID
+    int count;
+    int failed; // number of sources that could not be read
+} sensor_sample;
+
+// find and open all sensors under root (NULL for /), returns the number of temperature slots found
+int sensors_discover(sensor_set *set, const char *root);
+// slot of the sensor called name, or numbered name (as in the order they were discovered), -1 if there's no such sensor
+int sensors_find(const sensor_set *set, const char *name);
+// fill the sample, returns the primary temperature in degrees C, -1 if it couldn't be read
+int sensors_read(sensor_set *set, sensor_sample *sample);
+void sensors_close(sensor_set *set);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Tick statistics.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+static const char *phase_names[STATS_PHASES] = {
+    [STATS_READ] = "read",
+    [STATS_DECIDE] = "decide",
+    [STATS_WRITE] = "write",
+    [STATS_UI] = "ui",
+};
+
+unsigned long long stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_init(fan_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void stats_record(fan_stats *stats, stats_phase phase, unsigned long long ns) {
+    stats_hist *hist = &stats->phases[phase];
+    unsigned long long us = ns / 1000;
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && us >= (1ULL << bucket)) {
+        bucket++;
+    }
+    hist->buckets[bucket]++;
+    if (hist->count == 0 || ns < hist->min_ns) {
+        hist->min_ns = ns;
+    }
+    if (ns > hist->max_ns) {
+        hist->max_ns = ns;
+    }
+    hist->sum_ns += ns;
+    hist->count++;
+}
+
+void stats_deadline(fan_stats *stats, long long late_ms, long long slack_ms) {
+    if (late_ms > slack_ms) {
+        stats->missed_deadlines++;
+    }
+}
+
+// upper bound (in us) of the bucket the given percentile falls in
+static unsigned long long percentile(const stats_hist *hist, int pct) {
+    unsigned long seen = 0, target = (hist->count * pct + 99) / 100;
+    int i;
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return 1ULL << i;
+}
+
+void stats_dump(const fan_stats *stats, FILE *out) {
+    int p, i;
+    fprintf(out, "Ticks: %lu, level changes: %lu, read failures: %lu, write failures: %lu, missed deadlines: %lu\n",
+            stats->ticks, stats->level_changes, stats->read_failures, stats->write_failures, stats->missed_deadlines);
+    fprintf(out, "%-8s %8s %10s %10s %10s %10s %10s\n", "phase", "count", "min us", "avg us", "max us", "p50 <us", "p99 <us");
+    for (p = 0; p < STATS_PHASES; p++) {
+        const stats_hist *hist = &stats->phases[p];
+        if (hist->count == 0) {
+            fprintf(out, "%-8s %8d\n", phase_names[p], 0);
+            continue;
+        }
+        fprintf(out, "%-8s %8lu %10.1f %10.1f %10.1f %10llu %10llu\n", phase_names[p], hist->count,
+                hist->min_ns / 1000.0, (double) hist->sum_ns / hist->count / 1000, hist->max_ns / 1000.0,
+                percentile(hist, 50), percentile(hist, 99));
+    }
+    // the raw histograms, just the buckets that have something in them
+    for (p = 0; p < STATS_PHASES; p++) {
+        const stats_hist *hist = &stats->phases[p];
+        if (hist->count == 0) {
+            continue;
+        }
+        fprintf(out, "%-8s", phase_names[p]);
+        for (i = 0; i < STATS_BUCKETS; i++) {
+            if (hist->buckets[i] == 0) {
+                continue;
+            }
+            if (i == STATS_BUCKETS - 1) {
+                fprintf(out, " >=%lluus:%lu", 1ULL << (i - 1), hist->buckets[i]);
+            } else {
+                fprintf(out, " <%lluus:%lu", 1ULL << i, hist->buckets[i]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    fflush(out);
+}
@@ -0,0 +1,43 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Tick statistics: how long each phase of a tick takes, in fixed power of two histograms,
+and counters for the things that shouldn't happen (too often).
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+// bucket n holds durations < 2^n us, the last one everything slower (>= 2^19us, about half a second)
+#define STATS_BUCKETS 21
+
+typedef enum _stats_phase {
+    STATS_READ,   // reading the sensors
+    STATS_DECIDE, // picking a level
+    STATS_WRITE,  // writing it to the fan
+    STATS_UI,     // updating whatever the front end shows
+    STATS_PHASES,
+} stats_phase;
+
+typedef struct _stats_hist {
+    unsigned long count, buckets[STATS_BUCKETS];
+    unsigned long long sum_ns, min_ns, max_ns;
+} stats_hist;
+
+typedef struct _fan_stats {
+    stats_hist phases[STATS_PHASES];
+    unsigned long ticks, level_changes, read_failures, write_failures, missed_deadlines;
+    unsigned long long write_ns; // time spent writing during the current tick, not part of the decision
+} fan_stats;
+
+unsigned long long stats_now_ns(void);
+void stats_init(fan_stats *stats);
+void stats_record(fan_stats *stats, stats_phase phase, unsigned long long ns);
+// a tick ran late_ms after it was supposed to, anything over slack_ms counts as a missed deadline
+void stats_deadline(fan_stats *stats, long long late_ms, long long slack_ms);
+void stats_dump(const fan_stats *stats, FILE *out);
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Telemetry log, see telemetry.h. The ring has one writer and one reader, like the worker's queue:
+the control loop moves head, the writer thread moves tail, an eventfd wakes the writer up.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+
+size_t telemetry_record_size(int n_temps) {
+    return (sizeof(telemetry_record) + n_temps + 7) & ~(size_t) 7;
+}
+
+static void wake(fan_telemetry *tel) {
+    uint64_t one = 1;
+    // the eventfd is a counter, this never blocks
+    if (write(tel->wake_fd, &one, sizeof(one)) < 0) {
+        perror("telemetry wake");
+    }
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    ssize_t n;
+    while (len > 0) {
+        if ((n = write(fd, p, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// path, path.1, path.2, ...
+static void file_name(const fan_telemetry *tel, int n, char *buf, size_t size) {
+    if (n == 0) {
+        snprintf(buf, size, "%s", tel->cfg.path);
+    } else {
+        snprintf(buf, size, "%s.%d", tel->cfg.path, n);
+    }
+}
+
+static int open_new(fan_telemetry *tel) {
+    int ret;
+    if ((tel->fd = open(tel->cfg.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        return -errno;
+    }
+    if ((ret = write_all(tel->fd, &tel->header, sizeof(tel->header))) != 0) {
+        close(tel->fd);
+        tel->fd = -1;
+        return ret;
+    }
+    tel->size = sizeof(tel->header);
+    return 0;
+}
+
+// the oldest one goes, the others move up one, and we start a new one
+static int rotate(fan_telemetry *tel) {
+    char from[PATH_MAX + 12], to[PATH_MAX + 12]; // .n on the end
+    int i;
+    if (tel->fd >= 0) {
+        close(tel->fd);
+        tel->fd = -1;
+    }
+    for (i = tel->cfg.files - 1; i > 0; i--) {
+        file_name(tel, i - 1, from, sizeof(from));
+        file_name(tel, i, to, sizeof(to));
+        // there might not be that many yet
+        if (rename(from, to) != 0 && errno != ENOENT) {
+            return -errno;
+        }
+    }
+    return open_new(tel);
+}
+
+// carry on with the file that's there, if it's one of ours and it has the same sensors
+static int open_existing(fan_telemetry *tel) {
+    telemetry_header header;
+    struct stat st;
+    off_t records;
+    if ((tel->fd = open(tel->cfg.path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        return -errno;
+    }
+    if (fstat(tel->fd, &st) != 0) {
+        return -errno;
+    }
+    if (st.st_size == 0) {
+        close(tel->fd);
+        return open_new(tel);
+    }
+    if (st.st_size < (off_t) sizeof(header) || pread(tel->fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(&header, &tel->header, sizeof(header)) != 0) {
+        // the sensors changed (or it's something else altogether), it's kept as the previous file
+        return rotate(tel);
+    }
+    // a record that was cut short, we died halfway through writing it
+    records = (st.st_size - sizeof(header)) / tel->header.record_size;
+    tel->size = sizeof(header) + records * tel->header.record_size;
+    if (tel->size != st.st_size && ftruncate(tel->fd, tel->size) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+// writer thread: everything in the ring goes to the file, a contiguous stretch of it per write
+static void drain(fan_telemetry *tel) {
+    unsigned int tail = atomic_load_explicit(&tel->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&tel->head, memory_order_acquire);
+    unsigned int from, n;
+    size_t size = tel->header.record_size;
+    int ret;
+    while (tail != head) {
+        from = tail & (TELEMETRY_RING - 1);
+        n = head - tail;
+        // up to the end of the ring, the rest is the next write
+        if (n > TELEMETRY_RING - from) {
+            n = TELEMETRY_RING - from;
+        }
+        ret = tel->fd < 0 ? -EBADF : write_all(tel->fd, tel->ring + from * size, n * size);
+        if (ret == 0) {
+            tel->size += n * size;
+            tel->writes++;
+        } else {
+            // say so once, the disk isn't going to be any less full next time
+            if (tel->errors++ == 0) {
+                fprintf(stderr, "Unable to write telemetry to %s, dropping records: %s\n", tel->cfg.path, strerror(-ret));
+            }
+            // half a record would throw off every one after it
+            if (tel->fd >= 0 && ftruncate(tel->fd, tel->size) != 0) {
+                close(tel->fd);
+                tel->fd = -1;
+            }
+        }
+        tail += n;
+        atomic_store_explicit(&tel->tail, tail, memory_order_release);
+        if (tel->fd >= 0 && tel->size >= (off_t) tel->cfg.max_mb << 20) {
+            if ((ret = rotate(tel)) != 0 && tel->errors++ == 0) {
+                fprintf(stderr, "Unable to rotate telemetry log %s: %s\n", tel->cfg.path, strerror(-ret));
+            }
+            tel->rotations++;
+        }
+    }
+}
+
+static void *writer(void *data) {
+    fan_telemetry *tel = data;
+    uint64_t n;
+    bool stop = false;
+    while (!stop) {
+        if (read(tel->wake_fd, &n, sizeof(n)) < 0 && errno == EINTR) {
+            continue;
+        }
+        // look before draining, whatever was added before the stop is written
+        stop = atomic_load(&tel->stop);
+        drain(tel);
+    }
+    return NULL;
+}
+
+int telemetry_open(fan_telemetry *tel, const telemetry_config *cfg, const sensor_set *set) {
+    int ret, i;
+    memset(tel, 0, sizeof(*tel));
+    tel->cfg = *cfg;
+    tel->fd = tel->wake_fd = -1;
+    // zeroed, so the unused names compare equal when we append
+    memcpy(tel->header.magic, TELEMETRY_MAGIC, sizeof(tel->header.magic));
+    tel->header.version = TELEMETRY_VERSION;
+    tel->header.header_size = sizeof(tel->header);
+    tel->header.n_temps = set->n_temps;
+    tel->header.record_size = telemetry_record_size(set->n_temps);
+    for (i = 0; i < set->n_temps; i++) {
+        memcpy(tel->header.names[i], set->names[i], SENSOR_NAME_LEN);
+    }
+    // one allocation up front, nothing grows while we're running
+    if ((tel->ring = calloc(TELEMETRY_RING, tel->header.record_size)) == NULL) {
+        return -ENOMEM;
+    }
+    if ((tel->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        ret = -errno;
+        telemetry_close(tel);
+        return ret;
+    }
+    if ((ret = open_existing(tel)) != 0) {
+        telemetry_close(tel);
+        return ret;
+    }
+    if ((ret = pthread_create(&tel->thread, NULL, writer, tel)) != 0) {
+        telemetry_close(tel);
+        return -ret;
+    }
+    tel->running = true;
+    return 0;
+}
+
+void telemetry_close(fan_telemetry *tel) {
+    if (tel->running) {
+        atomic_store(&tel->stop, true);
+        wake(tel);
+        pthread_join(tel->thread, NULL);
+        tel->running = false;
+    }
+    if (tel->fd >= 0) {
+        close(tel->fd);
+    }
+    if (tel->wake_fd >= 0) {
+        close(tel->wake_fd);
+    }
+    free(tel->ring);
+    tel->ring = NULL;
+    tel->fd = tel->wake_fd = -1;
+}
+
+void telemetry_add(fan_telemetry *tel, long long ms, const sensor_sample *sample, int temp, int level, int rpm, int mode, int event, int power) {
+    unsigned int head = atomic_load_explicit(&tel->head, memory_order_relaxed);
+    telemetry_record *r;
+    int i, t;
+    if (head - atomic_load_explicit(&tel->tail, memory_order_acquire) == TELEMETRY_RING) {
+        tel->dropped++;
+        return;
+    }
+    r = (telemetry_record *) (tel->ring + (size_t) (head & (TELEMETRY_RING - 1)) * tel->header.record_size);
+    r->ms = ms;
+    r->temp = temp;
+    r->rpm = rpm < 0 ? -1 : (rpm > INT16_MAX ? INT16_MAX : rpm);
+    r->level = level;
+    r->mode = mode;
+    r->event = event;
+    r->power = power;
+    for (i = 0; i < (int) tel->header.n_temps; i++) {
+        if (i >= sample->count || sample->temps[i] == SENSOR_INVALID) {
+            r->temps[i] = TELEMETRY_NO_TEMP;
+            continue;
+        }
+        t = SENSOR_C(sample->temps[i]);
+        r->temps[i] = t < -127 ? -127 : (t > 127 ? 127 : t);
+    }
+    atomic_store_explicit(&tel->head, head + 1, memory_order_release);
+    tel->records++;
+    // the first one the writer hasn't been told about
+    if (head == tel->handed) {
+        tel->batch_ms = ms;
+    }
+    if (head + 1 - tel->handed >= (unsigned int) tel->cfg.batch || ms - tel->batch_ms >= tel->cfg.flush_s * 1000LL) {
+        tel->handed = head + 1;
+        wake(tel);
+    }
+}
+
+const char *telemetry_validate(const telemetry_config *cfg) {
+    if (cfg->path[0] == '\0') {
+        return "Telemetry needs a file";
+    }
+    if (cfg->max_mb < 1 || cfg->max_mb > 4096) {
+        return "Telemetry files must be between 1 and 4096MB";
+    }
+    if (cfg->files < 1 || cfg->files > 16) {
+        return "Keep between 1 and 16 telemetry files";
+    }
+    if (cfg->batch < 1 || cfg->batch > TELEMETRY_RING / 2) {
+        return "Telemetry batches must be between 1 and 2048 records";
+    }
+    if (cfg->flush_s < 1 || cfg->flush_s > 3600) {
+        return "Telemetry must be flushed every 1 to 3600 seconds";
+    }
+    return NULL;
+}
@@ -0,0 +1,84 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Telemetry log: every tick as a fixed size binary record, appended to a file that's rotated once it
+gets too big. The control loop only copies the record into a ring, a thread of our own does the
+writing, a batch at a time. A disk that's slow (or full) costs records, never a late tick.
+The file starts with a header naming the sensors, the records follow it, see fan_log for reading them.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "sensors.h"
+
+#define TELEMETRY_MAGIC "TPFANLOG"
+// also tells the byte order: read on a machine the other way round, it's not 1
+#define TELEMETRY_VERSION 1
+// records, must be a power of two
+#define TELEMETRY_RING 4096
+#define TELEMETRY_NO_TEMP -128
+
+typedef struct _telemetry_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size; // the first record starts here
+    uint32_t record_size; // a multiple of 8, so they're all aligned in a mapping
+    uint32_t n_temps;
+    char names[SENSOR_MAX][SENSOR_NAME_LEN]; // n_temps of them are used, in the order of temps
+} telemetry_header;
+
+typedef struct _telemetry_record {
+    int64_t ms;     // wall-clock time, ms since epoch
+    int16_t temp;   // what the mode went by (filtered), degrees C, -1 if it couldn't be read
+    int16_t rpm;    // fan speed, -1 if we don't know it
+    uint8_t level;  // level the fan is on
+    uint8_t mode;   // ctrl_mode
+    uint8_t event;  // ctrl_event
+    int8_t power;   // POWER_AC or POWER_BATTERY, -1 if we don't follow the power source
+    int8_t temps[]; // n_temps, degrees C, TELEMETRY_NO_TEMP if a sensor couldn't be read
+} telemetry_record;
+
+typedef struct _telemetry_config {
+    char path[PATH_MAX];
+    int max_mb;  // rotate once the file is this big
+    int files;   // keep this many, counting the current one: path, path.1, ...
+    int batch;   // hand the records to the writer once there are this many
+    int flush_s; // ... or the oldest is this many seconds old
+} telemetry_config;
+
+typedef struct _fan_telemetry {
+    telemetry_config cfg;
+    telemetry_header header;
+    int fd, wake_fd;
+    off_t size;
+    unsigned char *ring; // TELEMETRY_RING records
+    atomic_uint head, tail; // control loop -> writer
+    atomic_bool stop;
+    pthread_t thread;
+    bool running; // the writer thread was started
+    // only touched by the control loop
+    unsigned int handed;   // head as the writer was last told about it
+    long long batch_ms;    // when the oldest record it wasn't told about was added
+    unsigned long records, dropped;
+    // only touched by the writer, until telemetry_close
+    unsigned long writes, rotations, errors;
+} fan_telemetry;
+
+// opens (or appends to) cfg->path, with the sensors of set, and starts the writer. Returns 0 or -errno
+int telemetry_open(fan_telemetry *tel, const telemetry_config *cfg, const sensor_set *set);
+// writes whatever is left, stops the writer, closes the file
+void telemetry_close(fan_telemetry *tel);
+// one tick, temps out of sample. Never blocks: if the writer is that far behind, the record is dropped
+void telemetry_add(fan_telemetry *tel, long long ms, const sensor_sample *sample, int temp, int level, int rpm, int mode, int event, int power);
+const char *telemetry_validate(const telemetry_config *cfg);
+// the size of a record with n_temps sensors
+size_t telemetry_record_size(int n_temps);
+
+#endif
@@ -0,0 +1,501 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Thermal triggers, see trip.h. We only ever touch trip points no cooling device is bound to, and
+never critical or hot ones: moving those would change what the kernel itself does when it runs hot.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/thermal.h>
+#include "trip.h"
+#include "curve.h"
+#include "paths.h"
+
+#define TRIP_ZONE_TRIPS 16 // we don't look any further than trip_point_15
+#define UEVENT_BUF_LEN 4096
+#define GENL_BUF_LEN 8192
+
+// fails rather than handing back a truncated path
+static int make_path(char *buf, size_t len, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(buf, len, fmt, ap);
+    va_end(ap);
+    return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+static int read_mc(int fd) {
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return SENSOR_INVALID;
+    }
+    buf[n] = '\0';
+    return atoi(buf);
+}
+
+static int write_mc(int fd, int mc) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%d\n", mc);
+    if (pwrite(fd, buf, len, 0) != len) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int read_str(const char *path, char *buf, size_t len) {
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    n = read(fd, buf, len - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+static void close_fds(trip_watch *trips) {
+    int i;
+    if (trips->temp_fd >= 0)
+        close(trips->temp_fd);
+    if (trips->lo_fd >= 0)
+        close(trips->lo_fd);
+    if (trips->hi_fd >= 0)
+        close(trips->hi_fd);
+    for (i = 0; i < trips->n_fds; i++) {
+        close(trips->fds[i]);
+    }
+    trips->temp_fd = trips->lo_fd = trips->hi_fd = trips->genl_fd = -1;
+    trips->n_fds = 0;
+    trips->kind = TRIP_NONE;
+}
+
+static int uevent_open(void) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    int ret, fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+#define NLA_NEXT(nla) ((struct nlattr *) ((char *) (nla) + NLA_ALIGN((nla)->nla_len)))
+#define NLA_OK(nla, end) ((char *) (nla) + sizeof(struct nlattr) <= (end) && (nla)->nla_len >= sizeof(struct nlattr) && (char *) (nla) + (nla)->nla_len <= (end))
+
+// the attribute of this type in [nla, end), NULL if there's none
+static const struct nlattr *nla_find(const struct nlattr *nla, const char *end, int type) {
+    for (; NLA_OK(nla, end); nla = NLA_NEXT(nla)) {
+        if ((nla->nla_type & NLA_TYPE_MASK) == type) {
+            return nla;
+        }
+    }
+    return NULL;
+}
+
+#define NLA_DATA(nla) ((const char *) (nla) + NLA_HDRLEN)
+#define NLA_END(nla) ((const char *) (nla) + (nla)->nla_len)
+
+// the id of the thermal family's event group, asked of the generic netlink controller, or -errno
+static int genl_event_group(int fd) {
+    struct {
+        struct nlmsghdr nlh;
+        struct genlmsghdr genl;
+        struct nlattr nla;
+        char name[NLA_ALIGN(sizeof(THERMAL_GENL_FAMILY_NAME))];
+    } req = {
+        .nlh = { .nlmsg_len = sizeof(req), .nlmsg_type = GENL_ID_CTRL, .nlmsg_flags = NLM_F_REQUEST },
+        .genl = { .cmd = CTRL_CMD_GETFAMILY, .version = 1 },
+        .nla = { .nla_len = NLA_HDRLEN + sizeof(THERMAL_GENL_FAMILY_NAME), .nla_type = CTRL_ATTR_FAMILY_NAME },
+        .name = THERMAL_GENL_FAMILY_NAME,
+    };
+    char buf[GENL_BUF_LEN];
+    const struct nlmsghdr *nlh = (const struct nlmsghdr *) buf;
+    const struct nlattr *groups, *group, *attr;
+    ssize_t n;
+    if (send(fd, &req, sizeof(req), 0) < 0 || (n = recv(fd, buf, sizeof(buf), 0)) < 0) {
+        return -errno;
+    }
+    // an older kernel doesn't have the family, and says so with an error
+    if (!NLMSG_OK(nlh, (size_t) n) || nlh->nlmsg_type != GENL_ID_CTRL) {
+        return -ENOENT;
+    }
+    groups = nla_find((const struct nlattr *) ((const char *) NLMSG_DATA(nlh) + GENL_HDRLEN), (const char *) nlh + nlh->nlmsg_len, CTRL_ATTR_MCAST_GROUPS);
+    if (groups == NULL) {
+        return -ENOENT;
+    }
+    // nested: one nest per group, each with a name and an id
+    for (group = (const struct nlattr *) NLA_DATA(groups); NLA_OK(group, NLA_END(groups)); group = NLA_NEXT(group)) {
+        attr = nla_find((const struct nlattr *) NLA_DATA(group), NLA_END(group), CTRL_ATTR_MCAST_GRP_NAME);
+        if (attr == NULL || strncmp(NLA_DATA(attr), THERMAL_GENL_EVENT_GROUP_NAME, attr->nla_len - NLA_HDRLEN) != 0) {
+            continue;
+        }
+        if ((attr = nla_find((const struct nlattr *) NLA_DATA(group), NLA_END(group), CTRL_ATTR_MCAST_GRP_ID)) != NULL) {
+            return *(const __u32 *) NLA_DATA(attr);
+        }
+    }
+    return -ENOENT;
+}
+
+// trip crossings under the governors that don't send uevents (step_wise, ie all of them but user_space)
+// are only announced on the thermal generic netlink family, returns the socket or -errno
+static int genl_open(void) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+    int ret, group, fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        ret = -errno;
+    } else if ((group = genl_event_group(fd)) < 0) {
+        ret = group;
+    } else if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        ret = -errno;
+    } else {
+        return fd;
+    }
+    close(fd);
+    return ret;
+}
+
+// trips a cooling device is bound to (cdevN_trip_point), as a bitmask
+static unsigned int bound_trips(const char *dir) {
+    struct dirent *ent;
+    char path[PATH_MAX], val[16];
+    unsigned int mask = 0;
+    size_t len;
+    int trip;
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return ~0u;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        len = strlen(ent->d_name);
+        if (strncmp(ent->d_name, "cdev", 4) != 0 || len < 11 || strcmp(ent->d_name + len - 11, "_trip_point") != 0) {
+            continue;
+        }
+        if (make_path(path, sizeof(path), "%s/%s", dir, ent->d_name) == 0 && read_str(path, val, sizeof(val)) == 0) {
+            trip = atoi(val);
+            if (trip >= 0 && trip < TRIP_ZONE_TRIPS) {
+                mask |= 1u << trip;
+            }
+        }
+    }
+    closedir(d);
+    return mask;
+}
+
+// two trip points of this zone we can move, returns 0 and fills in trips if there are
+static int open_zone(trip_watch *trips, const char *base, const char *zone) {
+    char dir[PATH_MAX], path[PATH_MAX], type[SENSOR_NAME_LEN];
+    unsigned int bound;
+    int k, fd, fds[2], n = 0;
+    if (make_path(dir, sizeof(dir), "%s/%s", base, zone) != 0) {
+        return -ENAMETOOLONG;
+    }
+    bound = bound_trips(dir);
+    for (k = 0; k < TRIP_ZONE_TRIPS && n < 2; k++) {
+        if (make_path(path, sizeof(path), "%s/trip_point_%d_type", dir, k) != 0 || read_str(path, type, sizeof(type)) != 0) {
+            break;
+        }
+        if (bound & (1u << k) || strcmp(type, "critical") == 0 || strcmp(type, "hot") == 0) {
+            continue;
+        }
+        // read-only trips can't be opened for writing, not even by root
+        if (make_path(path, sizeof(path), "%s/trip_point_%d_temp", dir, k) == 0 && (fd = open(path, O_RDWR | O_CLOEXEC)) >= 0) {
+            fds[n++] = fd;
+        }
+    }
+    if (n < 2 || make_path(path, sizeof(path), "%s/temp", dir) != 0 || (trips->temp_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        while (n > 0) {
+            close(fds[--n]);
+        }
+        return -ENOENT;
+    }
+    trips->kind = TRIP_ZONE;
+    trips->lo_fd = fds[0];
+    trips->hi_fd = fds[1];
+    if (make_path(path, sizeof(path), "%s/type", dir) != 0 || read_str(path, trips->name, sizeof(trips->name)) != 0) {
+        snprintf(trips->name, sizeof(trips->name), "%.*s", SENSOR_NAME_LEN - 1, zone);
+    }
+    snprintf(trips->devname, sizeof(trips->devname), "%.*s", (int) sizeof(trips->devname) - 1, zone);
+    trips->zone_id = atoi(zone + 12);
+    return 0;
+}
+
+static int find_zone(trip_watch *trips, const char *root) {
+    struct dirent **ents;
+    char base[PATH_MAX], path[PATH_MAX], type[SENSOR_NAME_LEN];
+    int i, n, pass, ret = -ENOENT;
+    if (root_path(base, sizeof(base), root, THERMAL_ZONE_PATH) != 0 || (n = scandir(base, &ents, NULL, alphasort)) < 0) {
+        return -ENOENT;
+    }
+    // the package temperature first: it's what the CPU temperature follows, and its trips are there for us to move
+    for (pass = 0; pass < 2 && ret != 0; pass++) {
+        for (i = 0; i < n && ret != 0; i++) {
+            if (strncmp(ents[i]->d_name, "thermal_zone", 12) != 0) {
+                continue;
+            }
+            if (pass == 0 && (make_path(path, sizeof(path), "%s/%s/type", base, ents[i]->d_name) != 0 || read_str(path, type, sizeof(type)) != 0 || strcmp(type, "x86_pkg_temp") != 0)) {
+                continue;
+            }
+            ret = open_zone(trips, base, ents[i]->d_name);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        free(ents[i]);
+    }
+    free(ents);
+    return ret;
+}
+
+// tempN_min/max we can write, and their alarms to poll
+static int open_hwmon_temp(trip_watch *trips, const char *dir, const char *input) {
+    char path[PATH_MAX], hw_name[12];
+    int num_len = strlen(input) - 6; // tempN_input -> tempN
+    int fd;
+    if (make_path(path, sizeof(path), "%s/%.*s_min", dir, num_len, input) != 0 || (trips->lo_fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+        return -ENOENT;
+    }
+    if (make_path(path, sizeof(path), "%s/%.*s_max", dir, num_len, input) != 0 || (trips->hi_fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+        close_fds(trips);
+        return -ENOENT;
+    }
+    if (make_path(path, sizeof(path), "%s/%s", dir, input) != 0 || (trips->temp_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        close_fds(trips);
+        return -ENOENT;
+    }
+    if (make_path(path, sizeof(path), "%s/%.*s_min_alarm", dir, num_len, input) == 0 && (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        trips->fds[trips->n_fds++] = fd;
+    }
+    if (make_path(path, sizeof(path), "%s/%.*s_max_alarm", dir, num_len, input) == 0 && (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        trips->fds[trips->n_fds++] = fd;
+    }
+    if (trips->n_fds < 2) {
+        close_fds(trips);
+        return -ENOENT;
+    }
+    // sysfs_notify only wakes up pollers that have read the attribute since the last notification
+    read_mc(trips->fds[0]);
+    read_mc(trips->fds[1]);
+    trips->kind = TRIP_HWMON;
+    trips->events = POLLPRI;
+    if (make_path(path, sizeof(path), "%s/name", dir) != 0 || read_str(path, hw_name, sizeof(hw_name)) != 0) {
+        snprintf(hw_name, sizeof(hw_name), "hwmon");
+    }
+    snprintf(trips->name, sizeof(trips->name), "%.8s/%.*s", hw_name, num_len < 14 ? num_len : 14, input);
+    return 0;
+}
+
+static int find_hwmon(trip_watch *trips, const char *root) {
+    struct dirent **hwmons, **temps;
+    char base[PATH_MAX], dir[PATH_MAX];
+    size_t len;
+    int i, j, n, m, ret = -ENOENT;
+    if (root_path(base, sizeof(base), root, HWMON_PATH) != 0 || (n = scandir(base, &hwmons, NULL, alphasort)) < 0) {
+        return -ENOENT;
+    }
+    for (i = 0; i < n; i++) {
+        if (ret != 0 && strncmp(hwmons[i]->d_name, "hwmon", 5) == 0 && make_path(dir, sizeof(dir), "%s/%s", base, hwmons[i]->d_name) == 0 && (m = scandir(dir, &temps, NULL, alphasort)) >= 0) {
+            for (j = 0; j < m; j++) {
+                len = strlen(temps[j]->d_name);
+                if (ret != 0 && strncmp(temps[j]->d_name, "temp", 4) == 0 && len > 6 && strcmp(temps[j]->d_name + len - 6, "_input") == 0) {
+                    ret = open_hwmon_temp(trips, dir, temps[j]->d_name);
+                }
+                free(temps[j]);
+            }
+            free(temps);
+        }
+        free(hwmons[i]);
+    }
+    free(hwmons);
+    return ret;
+}
+
+int trip_open(trip_watch *trips, const char *root) {
+    int fd;
+    memset(trips, 0, sizeof(*trips));
+    trips->temp_fd = trips->lo_fd = trips->hi_fd = trips->genl_fd = trips->proxy_fd = -1;
+    trips->write = trip_write;
+    if (find_zone(trips, root) == 0) {
+        // trip crossings are announced as change uevents for the zone under user_space,
+        // and as thermal netlink events under the others, we don't know which one it has
+        if ((fd = uevent_open()) < 0) {
+            close_fds(trips);
+            return fd;
+        }
+        trips->fds[trips->n_fds++] = fd;
+        // a kernel without thermal netlink (before 5.10) only has the uevents, those will do
+        // and a made up tree (-r) has nothing to do with the kernel's zones
+        if (root == NULL && (fd = genl_open()) >= 0) {
+            trips->fds[trips->n_fds++] = trips->genl_fd = fd;
+        }
+        trips->events = POLLIN;
+    } else if (find_hwmon(trips, root) != 0) {
+        return -ENOENT;
+    }
+    trips->lo_orig = read_mc(trips->lo_fd);
+    trips->hi_orig = read_mc(trips->hi_fd);
+    return 0;
+}
+
+int trip_write(const trip_watch *trips, trip_end end, int mc) {
+    return write_mc(end == TRIP_LO ? trips->lo_fd : trips->hi_fd, mc);
+}
+
+void trip_disarm(trip_watch *trips) {
+    if (!trips->armed) {
+        return;
+    }
+    // back to how we found them, they don't wake anyone up then
+    trips->write(trips, TRIP_HI, trips->hi_orig);
+    trips->write(trips, TRIP_LO, trips->lo_orig);
+    trips->armed = false;
+}
+
+void trip_close(trip_watch *trips) {
+    if (trips->kind == TRIP_NONE) {
+        return;
+    }
+    trip_disarm(trips);
+    close_fds(trips);
+}
+
+int trip_arm(trip_watch *trips, int temp, int lo, int hi) {
+    int cur, offset, lo_mc, hi_mc, ret;
+    if (trips->kind == TRIP_NONE) {
+        return -ENOENT;
+    }
+    if (lo < 0 && hi >= CURVE_TEMPS) {
+        // nothing to watch (ie manual mode), polling will do
+        trip_disarm(trips);
+        return 0;
+    }
+    if ((cur = read_mc(trips->temp_fd)) == SENSOR_INVALID) {
+        trip_disarm(trips);
+        return -EIO;
+    }
+    // the sensor we watch doesn't have to be the one we act on (thinkpad_acpi's CPU temp vs the package temp)
+    // so shift the bracket by how far apart they are now, in whole degrees so we don't rewrite it every tick
+    offset = (cur - temp * 1000) / 1000 * 1000;
+    // an end we don't care about keeps its original value
+    lo_mc = lo < 0 ? trips->lo_orig : (lo + 1) * 1000 + offset;
+    hi_mc = hi >= CURVE_TEMPS ? trips->hi_orig : hi * 1000 + offset;
+    if (trips->armed && lo_mc == trips->lo_mc && hi_mc == trips->hi_mc) {
+        return 0;
+    }
+    // some hwmon drivers insist on min < max at all times, so move whichever end keeps it that way first
+    if (trips->armed && hi_mc > trips->hi_mc) {
+        ret = trips->write(trips, TRIP_HI, hi_mc);
+        ret = ret == 0 ? trips->write(trips, TRIP_LO, lo_mc) : ret;
+    } else {
+        ret = trips->write(trips, TRIP_LO, lo_mc);
+        ret = ret == 0 ? trips->write(trips, TRIP_HI, hi_mc) : ret;
+    }
+    if (ret != 0) {
+        // half written, or not at all: don't rely on it, put back what we can and poll
+        trips->armed = true;
+        trip_disarm(trips);
+        return ret;
+    }
+    trips->armed = true;
+    trips->lo = lo;
+    trips->hi = hi;
+    trips->lo_mc = lo_mc;
+    trips->hi_mc = hi_mc;
+    return 0;
+}
+
+int trip_pollfds(const trip_watch *trips, struct pollfd *pfds) {
+    int i;
+    for (i = 0; i < trips->n_fds; i++) {
+        pfds[i].fd = trips->fds[i];
+        pfds[i].events = trips->events;
+        pfds[i].revents = 0;
+    }
+    return trips->n_fds;
+}
+
+// drain the uevent socket, true if any of it was about our zone
+static bool uevent_ours(trip_watch *trips, int fd) {
+    char buf[UEVENT_BUF_LEN];
+    const char *dev;
+    bool ours = false;
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        // the first string is action@devpath, ie change@/devices/virtual/thermal/thermal_zone0
+        if (strncmp(buf, "change@", 7) == 0 && (dev = strrchr(buf, '/')) != NULL && strcmp(dev + 1, trips->devname) == 0) {
+            ours = true;
+        }
+    }
+    return ours;
+}
+
+// drain the thermal netlink socket, true if a trip of our zone was crossed
+static bool genl_ours(trip_watch *trips, int fd) {
+    char buf[GENL_BUF_LEN];
+    const struct nlmsghdr *nlh;
+    const struct genlmsghdr *genl;
+    const struct nlattr *attr;
+    bool ours = false;
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        for (nlh = (const struct nlmsghdr *) buf; NLMSG_OK(nlh, (size_t) n); nlh = NLMSG_NEXT(nlh, n)) {
+            genl = NLMSG_DATA(nlh);
+            if (genl->cmd != THERMAL_GENL_EVENT_TZ_TRIP_UP && genl->cmd != THERMAL_GENL_EVENT_TZ_TRIP_DOWN) {
+                continue;
+            }
+            attr = nla_find((const struct nlattr *) ((const char *) genl + GENL_HDRLEN), (const char *) nlh + nlh->nlmsg_len, THERMAL_GENL_ATTR_TZ_ID);
+            if (attr != NULL && *(const __u32 *) NLA_DATA(attr) == (__u32) trips->zone_id) {
+                ours = true;
+            }
+        }
+    }
+    return ours;
+}
+
+bool trip_check(trip_watch *trips, const struct pollfd *pfds) {
+    bool hit = false;
+    int i;
+    for (i = 0; i < trips->n_fds; i++) {
+        if (!(pfds[i].revents & (trips->events | POLLERR))) {
+            continue;
+        }
+        if (pfds[i].fd == trips->genl_fd) {
+            hit |= genl_ours(trips, pfds[i].fd);
+        } else if (trips->kind == TRIP_ZONE) {
+            hit |= uevent_ours(trips, pfds[i].fd);
+        } else {
+            // read it to re-arm the notification, whatever the value
+            read_mc(pfds[i].fd);
+            hit = true;
+        }
+    }
+    if (!hit || !trips->armed) {
+        return false;
+    }
+    trips->crossings++;
+    return true;
+}
@@ -0,0 +1,69 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+Thermal triggers: rather than polling, program a writable thermal zone trip point (or a hwmon
+min/max alarm) just outside the temperatures where the controller would change its mind, and
+sleep until the kernel tells us one of them was crossed.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef TRIP_H
+#define TRIP_H
+
+#include <stdbool.h>
+#include <poll.h>
+#include "sensors.h"
+
+// with thresholds armed, and once one of them has woken us up, still check this often,
+// in case an event got lost or the sensors drift apart
+#define TRIP_BACKSTOP_MS 60000
+#define TRIP_FDS_MAX 2
+
+typedef enum _trip_kind {
+    TRIP_NONE,  // nothing writable, poll like we always did
+    TRIP_ZONE,  // two trip points of a thermal zone, crossings come in as uevents or thermal netlink events
+    TRIP_HWMON, // tempN_min and tempN_max, crossings raise the alarm attributes
+} trip_kind;
+
+typedef enum _trip_end {
+    TRIP_LO,
+    TRIP_HI,
+} trip_end;
+
+typedef struct _trip_watch {
+    trip_kind kind;
+    char name[SENSOR_NAME_LEN]; // thermal zone type, or hwmon name/tempN, for the logs
+    char devname[16];           // thermal_zoneN, to pick our uevents out of all the others
+    int zone_id;                // and the N, for the netlink events
+    int genl_fd;                // thermal netlink event socket (also in fds), -1 if the kernel has none
+    int temp_fd;                // the temperature the thresholds apply to
+    int lo_fd, hi_fd;           // the thresholds we write
+    int lo_orig, hi_orig;       // what they were set to before we came along, put back on close
+    // writes a threshold: trip_write, or in the GUI a proxy for the fan helper, which has lo_fd and hi_fd then
+    int (*write)(const struct _trip_watch *trips, trip_end end, int mc);
+    int proxy_fd;               // the helper's socket, for the proxy
+    int fds[TRIP_FDS_MAX];      // what to poll: the uevent socket, or the alarm attributes
+    short events;
+    int n_fds;
+    bool armed;
+    int lo, hi;                 // armed bracket, in degrees C of the sensor we act on
+    int lo_mc, hi_mc;           // and what was written, in millidegrees of the watched sensor
+    unsigned long crossings;    // times a threshold woke us up, until then we don't count on them
+} trip_watch;
+
+// look for writable thresholds under root (NULL for /), returns 0, or -ENOENT if there are none
+int trip_open(trip_watch *trips, const char *root);
+// put the thresholds back the way we found them
+void trip_close(trip_watch *trips);
+// wake us up once the sensor we act on (now at temp) drops to lo or reaches hi
+// lo < 0 and hi >= CURVE_TEMPS means there's nothing to watch. Returns 0, or -errno (and disarms)
+int trip_arm(trip_watch *trips, int temp, int lo, int hi);
+void trip_disarm(trip_watch *trips);
+// write one of the thresholds as is, millidegrees of the watched sensor. Returns 0 or -errno
+int trip_write(const trip_watch *trips, trip_end end, int mc);
+// fill in the pollfds for the watch, returns how many were used
+int trip_pollfds(const trip_watch *trips, struct pollfd *pfds);
+// after poll: consume whatever woke us up, returns true if one of our thresholds was crossed
+bool trip_check(trip_watch *trips, const struct pollfd *pfds);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+The control thread of the GUI, see worker.h
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "worker.h"
+
+static void worker_wake(fan_worker *w) {
+    uint64_t one = 1;
+    // the eventfd is a counter, this never blocks
+    if (write(w->wake_fd, &one, sizeof(one)) < 0) {
+        perror("worker wake");
+    }
+}
+
+// GTK thread: hand everything that's queued to the callback
+static gboolean worker_dispatch(gpointer data) {
+    fan_worker *w = data;
+    worker_msg msg;
+    unsigned int tail, head;
+    // clear the flag before draining, anything pushed after this schedules another dispatch
+    atomic_store(&w->dispatch_pending, false);
+    tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&w->head, memory_order_acquire);
+    while (tail != head) {
+        // copy it out first, the slot is the worker's again as soon as tail moves
+        msg = w->queue[tail & (WORKER_QUEUE_SIZE - 1)];
+        atomic_store_explicit(&w->tail, ++tail, memory_order_release);
+        w->func(&msg, w->data);
+        head = atomic_load_explicit(&w->head, memory_order_acquire);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// worker thread: queue a message for the GTK thread, drops it if the GTK thread is that far behind
+static bool worker_send(fan_worker *w, const worker_msg *msg) {
+    unsigned int head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&w->tail, memory_order_acquire) == WORKER_QUEUE_SIZE) {
+        w->dropped++;
+        return false;
+    }
+    w->queue[head & (WORKER_QUEUE_SIZE - 1)] = *msg;
+    atomic_store_explicit(&w->head, head + 1, memory_order_release);
+    // one idle callback drains everything, no need to add another while it's pending
+    if (!atomic_exchange(&w->dispatch_pending, true)) {
+        g_idle_add(worker_dispatch, w);
+    }
+    return true;
+}
+
+static void worker_apply(fan_worker *w, worker_config *cfg) {
+    fan_ctrl *ctrl = w->ctrl;
+    int old_scan = ctrl_scan_interval(ctrl);
+    const char *err;
+    ctrl->auto_cfg = cfg->auto_cfg;
+    ctrl->manual_cfg = cfg->manual_cfg;
+    ctrl->curve_cfg = cfg->curve_cfg;
+    ctrl->pid_cfg = cfg->pid_cfg;
+    ctrl->auto_table = cfg->auto_table;
+    ctrl->curve_table = cfg->curve_table;
+    // what was posted is the AC profile, on battery it's the battery one that applies
+    if (ctrl->power != NULL && (err = ctrl_set_profiles(ctrl, cfg->mode)) != NULL) {
+        fprintf(stderr, "Invalid battery profile, using the AC one: %s\n", err);
+    }
+    w->mode = cfg->mode;
+    w->running = cfg->running;
+    if (!cfg->running) {
+        ctrl_stop(ctrl);
+        w->ticking = false;
+        // not ticking, nothing to wake up for
+        if (ctrl->trips != NULL) {
+            trip_disarm(ctrl->trips);
+        }
+    } else if (w->ticking && ctrl->sched.min_ms == 0 && ctrl_scan_interval(ctrl) != old_scan) {
+        // same mode, new scan interval: start counting from now (and not past the watchdog)
+        w->next = sched_now_ms() + ctrl_next_interval(ctrl);
+    }
+    g_free(cfg);
+}
+
+static void worker_tick(fan_worker *w) {
+    fan_ctrl *ctrl = w->ctrl;
+    worker_msg msg = { .event = WORKER_TICK };
+    ctrl_result res;
+    if (ctrl_tick(ctrl, &res) == -1) {
+        msg.event = WORKER_READ_FAILED;
+        w->ticking = false;
+        worker_send(w, &msg);
+        return;
+    }
+    w->next += ctrl_next_interval(ctrl);
+    msg.state = ctrl->state;
+    msg.sample = ctrl->sample;
+    worker_send(w, &msg);
+}
+
+static gpointer worker_run(gpointer data) {
+    fan_worker *w = data;
+    fan_ctrl *ctrl = w->ctrl;
+    worker_config *cfg;
+    worker_msg msg;
+    unsigned int req;
+    long long now, late;
+    uint64_t count;
+    int n_pfds, n_trips;
+    // the wake up eventfd, the thermal triggers, and the power source, if there are any
+    struct pollfd pfds[1 + TRIP_FDS_MAX + 1] = { { .fd = w->wake_fd, .events = POLLIN } };
+    while (1) {
+        // requests before the config: any config posted before a request is picked up in the same go,
+        // so a restart never runs an older mode, and a quit right after a stop still puts the fan on auto
+        req = atomic_exchange(&w->requests, 0);
+        if ((cfg = atomic_exchange(&w->pending, NULL)) != NULL) {
+            worker_apply(w, cfg);
+        }
+        if (req & WORKER_REQ_RESTART && w->running) {
+            ctrl_start(ctrl, w->mode);
+            w->ticking = true;
+            w->next = sched_now_ms();
+        }
+        if (req & WORKER_REQ_READ) {
+            memset(&msg, 0, sizeof(msg));
+            msg.event = WORKER_TEMP;
+            msg.state.res.temp = sensors_read(ctrl->sensors, &ctrl->sample);
+            worker_send(w, &msg);
+        }
+        if (req & WORKER_REQ_STATS && ctrl->stats != NULL) {
+            memset(&msg, 0, sizeof(msg));
+            msg.event = WORKER_STATS;
+            msg.stats = g_new0(fan_stats, 1);
+            *msg.stats = *ctrl->stats;
+            if (!worker_send(w, &msg)) {
+                g_free(msg.stats);
+            }
+        }
+        if (req & WORKER_REQ_QUIT) {
+            break;
+        }
+        now = sched_now_ms();
+        if (w->ticking && now >= w->next) {
+            late = now - w->next;
+            if (ctrl->stats != NULL) {
+                stats_deadline(ctrl->stats, late, WORKER_SLACK_MS);
+            }
+            if (late > 0) {
+                // don't try to catch up with ticks we've missed
+                w->next = now;
+            }
+            worker_tick(w);
+            continue;
+        }
+        // sleep until the next tick, a thermal trigger goes off, the power source changes, or the GTK thread wants something
+        n_trips = ctrl->trips != NULL ? trip_pollfds(ctrl->trips, pfds + 1) : 0;
+        n_pfds = 1 + n_trips + (ctrl->power != NULL ? power_pollfds(ctrl->power, pfds + 1 + n_trips) : 0);
+        if (poll(pfds, n_pfds, w->ticking ? (int) ctrl_sample_timeout(ctrl, w->next - now) : -1) < 0 && errno != EINTR) {
+            perror("worker poll");
+            break;
+        }
+        // in-between samples only go into the filters, the tick is still a while off
+        if (w->ticking) {
+            ctrl_sample(ctrl);
+        }
+        if (pfds[0].revents & POLLIN && read(w->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("worker wake");
+        }
+        if (n_trips > 0 && trip_check(ctrl->trips, pfds + 1) && w->ticking) {
+            w->next = sched_now_ms();
+        }
+        // the other profile starts straight away, if we're running at all
+        if (n_pfds > 1 + n_trips && ctrl_power_check(ctrl, pfds + 1 + n_trips) && w->ticking) {
+            ctrl_start(ctrl, w->mode);
+            w->next = sched_now_ms();
+        }
+    }
+    if (w->dropped > 0 && ctrl->print_logs)
+        printf("Control thread dropped %lu messages\n", w->dropped);
+    return NULL;
+}
+
+int worker_start(fan_worker *w, fan_ctrl *ctrl, worker_func func, gpointer data) {
+    memset(w, 0, sizeof(*w));
+    w->ctrl = ctrl;
+    w->func = func;
+    w->data = data;
+    atomic_init(&w->pending, NULL);
+    atomic_init(&w->requests, 0);
+    atomic_init(&w->head, 0);
+    atomic_init(&w->tail, 0);
+    atomic_init(&w->dispatch_pending, false);
+    if ((w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        return -errno;
+    }
+    w->thread = g_thread_new("fan-control", worker_run, w);
+    return 0;
+}
+
+void worker_stop(fan_worker *w) {
+    worker_config *cfg;
+    if (w->thread == NULL) {
+        return;
+    }
+    worker_request(w, WORKER_REQ_QUIT);
+    g_thread_join(w->thread);
+    w->thread = NULL;
+    close(w->wake_fd);
+    // posted after the thread's last look, nobody is going to apply it
+    if ((cfg = atomic_exchange(&w->pending, NULL)) != NULL) {
+        g_free(cfg);
+    }
+}
+
+void worker_post(fan_worker *w, const fan_ctrl *ctrl, ctrl_mode mode, bool running) {
+    worker_config *cfg = g_new0(worker_config, 1), *old;
+    cfg->mode = mode;
+    cfg->running = running;
+    cfg->auto_cfg = ctrl->auto_cfg;
+    cfg->manual_cfg = ctrl->manual_cfg;
+    cfg->curve_cfg = ctrl->curve_cfg;
+    cfg->pid_cfg = ctrl->pid_cfg;
+    cfg->auto_table = ctrl->auto_table;
+    cfg->curve_table = ctrl->curve_table;
+    // the worker never saw the one we replaced, so it's still ours to free
+    if ((old = atomic_exchange(&w->pending, cfg)) != NULL) {
+        g_free(old);
+    }
+    worker_wake(w);
+}
+
+void worker_request(fan_worker *w, unsigned int req) {
+    atomic_fetch_or(&w->requests, req);
+    worker_wake(w);
+}
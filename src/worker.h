@@ -0,0 +1,86 @@
+/*
+ThinkPad Fan Control
+Copyright 2022, Elias Van Ootegem <elias@vega.xyz>
+
+The control thread of the GUI: owns the sensors, the fan and the control core, so a busy EC never
+stalls the GTK main loop. Config goes in as immutable snapshots, results come out through a
+single producer/single consumer queue that is drained on the GTK thread.
+Distributed under the terms of the GNU General Public License version 2, see main.c and LICENCE
+*/
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <gtk/gtk.h>
+#include "core.h"
+
+// must be a power of two
+#define WORKER_QUEUE_SIZE 64
+// how late a tick can be before we count it as a missed deadline
+#define WORKER_SLACK_MS 50
+
+// requests from the GTK thread that don't carry any data
+#define WORKER_REQ_RESTART 0x1 // (re)start the mode of the last config and tick straight away
+#define WORKER_REQ_READ    0x2 // read the sensors once, for when we're not running
+#define WORKER_REQ_STATS   0x4 // send a copy of the tick stats
+#define WORKER_REQ_QUIT    0x8
+
+typedef enum _worker_event {
+    WORKER_TICK,        // a tick ran: state and sample are set
+    WORKER_READ_FAILED, // couldn't read the CPU temperature, no more ticks until the next restart
+    WORKER_TEMP,        // answer to WORKER_REQ_READ, state.res.temp is the temperature or -1
+    WORKER_STATS,       // answer to WORKER_REQ_STATS, stats is a copy the receiver has to g_free
+} worker_event;
+
+typedef struct _worker_msg {
+    worker_event event;
+    ctrl_state state;
+    sensor_sample sample;
+    fan_stats *stats;
+} worker_msg;
+
+// everything the worker needs to run a mode, never changed once it's posted
+typedef struct _worker_config {
+    ctrl_mode mode;
+    bool running; // false puts the fan back on auto
+    auto_config auto_cfg;
+    manual_config manual_cfg;
+    curve_config curve_cfg;
+    pid_config pid_cfg;
+    fan_table auto_table, curve_table;
+} worker_config;
+
+typedef void (*worker_func)(const worker_msg *msg, gpointer data);
+
+typedef struct _fan_worker {
+    fan_ctrl *ctrl; // belongs to the control thread between worker_start and worker_stop
+    GThread *thread;
+    int wake_fd;
+    // GTK -> worker
+    _Atomic(worker_config *) pending;
+    atomic_uint requests;
+    // worker -> GTK
+    worker_msg queue[WORKER_QUEUE_SIZE];
+    atomic_uint head, tail;
+    atomic_bool dispatch_pending;
+    unsigned long dropped; // messages that didn't fit in the queue, only touched by the worker
+    worker_func func;
+    gpointer data;
+    // only touched by the worker
+    ctrl_mode mode;
+    bool running, ticking;
+    long long next;
+} fan_worker;
+
+// starts the control thread, func is called on the GTK thread for every message. Returns 0 or -errno
+int worker_start(fan_worker *w, fan_ctrl *ctrl, worker_func func, gpointer data);
+// applies whatever config was posted last, then stops the thread. The fan is left as it is, post a
+// config that isn't running first to put it back on auto. Safe to call more than once
+void worker_stop(fan_worker *w);
+// snapshot the configs and compiled tables of ctrl for the worker to run, replaces any config it hasn't picked up yet
+// a running config is picked up on the next tick, follow it with WORKER_REQ_RESTART to switch modes
+void worker_post(fan_worker *w, const fan_ctrl *ctrl, ctrl_mode mode, bool running);
+void worker_request(fan_worker *w, unsigned int req);
+
+#endif
@@ -1,2 +1,3 @@
 #!/bin/bash
-su -c build/fan_control
+# sudo tells the GUI who to drop to, only the fan helper keeps root
+sudo build/fan_control